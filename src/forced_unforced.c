@@ -18,116 +18,611 @@
  */
 
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "util/ring_buffer.h"
+#include "util/pgs.h"
+#include "util/pgs_image.h"
+#include "util/retime.h"
+#include "util/stats.h"
 
-#define BUF_MAX_SIZE 65536
+// What has been found in a stream, or in one range of it for a
+// parallel scan
+typedef struct {
+  // Where the analysis is printed
+  FILE *out;
+  char *buf;
+  size_t buf_len;
 
-enum segment_type {
-  PALETTE_SEGMENT      = 0x14,
-  PICTURE_SEGMENT      = 0x15,
-  PRESENTATION_SEGMENT = 0x16,
-  WINDOW_SEGMENT       = 0x17,
-  DISPLAY_SEGMENT      = 0x80,
+  unsigned int forced_objects;
+  unsigned int forced_presentations;
+
+  // Counts and payload bytes of each type of segment
+  unsigned long type_count[256];
+  unsigned long long type_bytes[256];
+
+  pgs_index *idx;
+
+  // Set if the scan had to stop, with what went wrong
+  int failed;
+  int bad_nr_objects;
+  int bad_length;
+} scan_results;
+
+enum {
+  FAILED_PRESENTATION = 1,
+  FAILED_ALLOC,
+};
+
+static scan_results totals;
+static int show_types = 0;
+
+// What to do with the segments of the current display set when
+// extracting the forced subtitles
+enum set_action {
+  SET_SKIP,
+  SET_COPY,
+  SET_CLEAR,
 };
 
-int get_be16(uint8_t*buf);
+static pgs_writer *out = NULL;
+static enum set_action action = SET_SKIP;
+static int showing_forced = 0;
+
+// For writing out the bitmaps of forced objects: the palettes and the
+// objects defined so far, and the presentation waiting for the end of
+// its display set
+#define MAX_OBJECTS 64
+static char *bitmap_prefix = NULL;
+static unsigned int nr_bitmaps = 0;
+static pgs_palette palettes[256];
+static pgs_object objects[MAX_OBJECTS];
+static int nr_objects = 0;
+static uint8_t shown[11 + 8*255];
+static int shown_len = 0;
+
+// The presentations to look at, in milliseconds
+static int windowed = 0;
+static unsigned long window_from = 0;
+static unsigned long window_to = ULONG_MAX;
+
+void report_segment(scan_results *res, int type, int length, int nr_forced, int timed, uint32_t pts);
+void report_failure(scan_results *res);
+void report_totals(scan_results *res);
+int scan_segment(scan_results *res, pgs_segment *seg, pgs_presentation *pres);
+void extract_segment(pgs_segment *seg, pgs_presentation *pres);
+void bitmap_segment(pgs_segment *seg, pgs_presentation *pres);
+int scan_stream(char *fin_name, char *fout_name);
+int scan_parallel(char *fin_name, int nr_threads);
+void scan_index(pgs_index *idx);
+
+int parse_window(char *arg) {
+  /*
+   * Parses a window of time as from-to, either of which may be left
+   * out.  Returns 0 on success or -1 if it isn't valid.
+   */
+  char *dash = strchr(arg, '-');
+  if (dash == NULL) {
+    return -1;
+  }
+  *dash = '\0';
+  if ((*arg && retime_parse_time(arg, &window_from)) ||
+      (dash[1] && retime_parse_time(dash+1, &window_to)) ||
+      window_to < window_from) {
+    return -1;
+  }
+  windowed = 1;
+  return 0;
+}
+
 
 int main (int argc, char **argv) {
 
-  if (argc != 2) {
+  stats_option(&argc, argv);
+  char *index_name = NULL;
+  char *fout_name = NULL;
+  int nr_threads = 0;
+  int invalid = 0;
+  while (argc >= 3 && argv[1][0] == '-' && argv[1][1] && !argv[1][2]) {
+    int n = 2;
+    switch (argv[1][1]) {
+    case 'i':
+      index_name = argv[2];
+      break;
+    case 'o':
+      fout_name = argv[2];
+      break;
+    case 'b':
+      bitmap_prefix = argv[2];
+      break;
+    case 't':
+      invalid |= parse_window(argv[2]);
+      break;
+    case 'j':
+      invalid |= sscanf(argv[2], "%d", &nr_threads) != 1 || nr_threads < 1;
+      break;
+    case 'c':
+      show_types = 1;
+      n = 1;
+      break;
+    default:
+      invalid = 1;
+      break;
+    }
+    if (invalid || argc - n < 2) {
+      invalid = 1;
+      break;
+    }
+    argv[n] = argv[0];
+    argv += n;
+    argc -= n;
+  }
+
+  // An index is of the whole stream, and a parallel scan only analyses
+  if (argc != 2 || invalid || (windowed && index_name != NULL) ||
+      (nr_threads > 0 && (windowed || fout_name != NULL || bitmap_prefix != NULL))) {
     printf("Analyzes numbers of forced and unforced subtitles in a PGS stream.\n");
-    printf("Usage: %s <input_file.pgs>\n", argv[0]);
+    printf("Usage: %s [-i index_file] [-o output_file.pgs] [-b prefix] [-t from-to] [-j threads]\n", argv[0]);
+    printf("          [-c] [--stats] <input_file.pgs>\n");
+    printf("Streams may be bare segments or .sup files, whose timestamps are shown.\n");
+    printf("With -i, the segments of the stream are recorded in index_file, and later\n");
+    printf("runs on the same, unchanged stream use the index instead of the stream.\n");
+    printf("With -o, a stream of just the forced subtitles is written to output_file.pgs\n");
+    printf("(- for standard output), with presentations which remove them from the screen.\n");
+    printf("With -b, each forced object shown is written out as an RGBA image, named\n");
+    printf("prefix00001.pam and so on.\n");
+    printf("With -t, only presentations from one time to another are looked at, found\n");
+    printf("without reading the rest of a .sup file; times are seconds, min:sec or\n");
+    printf("hr:min:sec, and either may be left out.  Not with -i.\n");
+    printf("With -j, the stream is scanned on the given number of threads, with the same\n");
+    printf("results; worthwhile for very large streams.  Not with -o, -b or -t.\n");
+    printf("With -c, the number and size of segments of each type are shown.\n");
+    stats_usage();
     return 127;
   }
-  
-  FILE *fin;
-  fin = fopen (argv[1], "rb");
+  char *fin_name = argv[1];
+  totals.out = (fout_name != NULL && !strcmp(fout_name, "-")) ? stderr : stdout;
 
-  Ring *ring = ring_alloc(BUF_MAX_SIZE);
-  if (ring == NULL) {
-    fprintf(stderr, "malloc fail\n");
-    return -1;
+  // Extracting needs the stream itself, so the index is only written
+  if (index_name != NULL && fout_name == NULL && bitmap_prefix == NULL) {
+    pgs_index *idx = pgs_index_load(index_name, fin_name);
+    if (idx != NULL) {
+      scan_index(idx);
+      pgs_index_free(idx);
+      return 0;
+    }
+  }
+
+  if (index_name != NULL) {
+    totals.idx = pgs_index_alloc();
+    if (totals.idx == NULL) {
+      fprintf(stderr, "malloc fail\n");
+      return -1;
+    }
   }
 
-  uint8_t *buf = malloc(BUF_MAX_SIZE);
-  if (buf == NULL) {
+  int ret = PGS_ERROR_MAP;
+  if (nr_threads > 0) {
+    ret = scan_parallel(fin_name, nr_threads);
+  }
+  if (ret == PGS_ERROR_MAP) {
+    // Not mappable (e.g. a pipe), so read it through the ring
+    ret = scan_stream(fin_name, fout_name);
+  }
+
+  // Only a complete, consistent stream is worth indexing
+  if (totals.idx != NULL) {
+    if (ret == 0 && pgs_index_write(totals.idx, index_name, fin_name)) {
+      perror(index_name);
+    }
+    pgs_index_free(totals.idx);
+  }
+  return ret;
+
+}
+
+
+void report_segment(scan_results *res, int type, int length, int nr_forced, int timed, uint32_t pts) {
+  /*
+   * Prints and counts what we know about a segment, with the time of
+   * forced objects if the stream has timestamps.
+   */
+  res->type_count[type]++;
+  res->type_bytes[type] += length;
+  char at[32] = "";
+  if (timed) {
+    unsigned long ms = pts / PGS_TICKS_PER_MS;
+    snprintf(at, sizeof(at), " at %lu:%02lu:%02lu.%03lu",
+             ms / 3600000, ms / 60000 % 60, ms / 1000 % 60, ms % 1000);
+  }
+  switch (type) {
+  case PALETTE_SEGMENT:
+  case PICTURE_SEGMENT:
+  case WINDOW_SEGMENT:
+  case DISPLAY_SEGMENT:
+    break;
+  default:
+    fprintf(res->out, "Unknown segment 0x%x, length %d\n", type, length);
+    break;
+  case PRESENTATION_SEGMENT:
+    if (nr_forced > 0) {
+      res->forced_presentations++;
+    }
+    int i;
+    for (i=0; i < nr_forced; i++) {
+      fprintf(res->out, "Forced%s\n", at);
+      res->forced_objects++;
+    }
+  }
+}
+
+
+void report_failure(scan_results *res) {
+  if (res->failed == FAILED_PRESENTATION) {
+    fprintf(stderr, "Inconsistency in presentation segment - expected %d objects, but data present for %d", res->bad_nr_objects, (res->bad_length - 11)/8);
+  } else {
     fprintf(stderr, "malloc fail\n");
-    return -1;
+  }
+}
+
+
+void report_totals(scan_results *res) {
+  fprintf(res->out, "TOTAL: %d forced objects in %d presentation segments\n", res->forced_objects, res->forced_presentations);
+  if (show_types) {
+    int type;
+    for (type=0; type < 256; type++) {
+      if (res->type_count[type] > 0) {
+        fprintf(res->out, "Segments of type 0x%02x: %lu, %llu bytes\n", type, res->type_count[type], res->type_bytes[type]);
+      }
+    }
+  }
+}
+
+
+int scan_segment(scan_results *res, pgs_segment *seg, pgs_presentation *pres) {
+  /*
+   * Reports on and indexes one segment.  Returns 0 on success, or
+   * non-zero if the scan must stop, with res->failed saying why.
+   */
+  pres->nr_objects = 0;
+  pres->nr_forced = 0;
+  pres->forced_mask = 0;
+  if (seg->type == PRESENTATION_SEGMENT && pgs_parse_presentation(seg, pres)) {
+    res->failed = FAILED_PRESENTATION;
+    res->bad_nr_objects = pres->nr_objects;
+    res->bad_length = seg->length;
+    return 1;
+  }
+  report_segment(res, seg->type, seg->length, pres->nr_forced, seg->header_len == PGS_SUP_HEADER, seg->pts);
+
+  if (res->idx != NULL && pgs_index_add(res->idx, seg)) {
+    res->failed = FAILED_ALLOC;
+    return 1;
+  }
+  return 0;
+}
+
+
+void extract_segment(pgs_segment *seg, pgs_presentation *pres) {
+  /*
+   * Writes out the segments of display sets showing forced objects,
+   * deciding what to do with each display set at its presentation
+   * segment, which comes first.  Presentations of only unforced
+   * objects are kept, without their objects, if they replace forced
+   * ones, so that those still leave the screen.  Only presentations
+   * are rewritten; everything else kept is copied from the input.
+   */
+  if (seg->type == PRESENTATION_SEGMENT) {
+    uint8_t buf[11 + 8*255];
+    int nr_kept = 0;
+    if (pres->nr_forced > 0) {
+      action = SET_COPY;
+      showing_forced = 1;
+      if (pres->nr_forced == pres->nr_objects) {
+        pgs_write_segment(out, seg);
+        return;
+      }
+      // Keep only the forced objects
+      int i;
+      for (i=0; i < pres->nr_objects; i++) {
+        if (seg->payload[11 + 8*i + 3] & 0x40) {
+          memcpy(buf + 11 + 8*nr_kept, seg->payload + 11 + 8*i, 8);
+          nr_kept++;
+        }
+      }
+    } else if (showing_forced) {
+      action = SET_CLEAR;
+      showing_forced = 0;
+      if (pres->nr_objects == 0) {
+        pgs_write_segment(out, seg);
+        return;
+      }
+    } else {
+      action = SET_SKIP;
+      return;
+    }
+    memcpy(buf, seg->payload, 11);
+    buf[10] = nr_kept;
+    pgs_write_data(out, seg, buf, 11 + 8*nr_kept);
+    return;
   }
 
-  unsigned int forced_objects = 0;
-  unsigned int forced_presentations = 0;
+  if (action == SET_SKIP) {
+    return;
+  }
+  if (action == SET_CLEAR && (seg->type == PALETTE_SEGMENT || seg->type == PICTURE_SEGMENT)) {
+    return;
+  }
+  pgs_write_segment(out, seg);
+}
 
-  while (1) {
 
-    uint8_t couldnt_read;
-    ring_read (fin, ring, &couldnt_read);
+void write_bitmap(pgs_object *obj, pgs_palette *pal) {
+  /*
+   * Decodes an object and writes it out as a PAM image.
+   */
+  char name[4096];
+  snprintf(name, sizeof(name), "%s%05u.pam", bitmap_prefix, ++nr_bitmaps);
+  uint32_t *rgba = malloc((size_t)obj->width * obj->height * sizeof(uint32_t));
+  if (rgba == NULL) {
+    fprintf(stderr, "malloc fail\n");
+    return;
+  }
+  if (pgs_object_decode(obj, pal, rgba, obj->width)) {
+    fprintf(stderr, "%s: object %d: %s\n", name, obj->id, pgs_strerror(PGS_ERROR_OBJECT));
+  }
+  FILE *f = fopen(name, "wb");
+  if (f == NULL) {
+    perror(name);
+    free(rgba);
+    return;
+  }
+  fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+          obj->width, obj->height);
+  if (fwrite(rgba, sizeof(uint32_t), (size_t)obj->width * obj->height, f) != (size_t)obj->width * obj->height ||
+      fclose(f)) {
+    perror(name);
+  }
+  free(rgba);
+}
 
-    if (ring_get_exact(ring, 3, buf)) {
+
+void bitmap_segment(pgs_segment *seg, pgs_presentation *pres) {
+  /*
+   * Keeps track of palettes and objects, and once a display set with
+   * forced objects is complete, writes out the bitmaps of those.
+   */
+  int i;
+  switch (seg->type) {
+  case PALETTE_SEGMENT:
+    if (seg->length >= 2) {
+      pgs_parse_palette(seg, &palettes[seg->payload[0]]);
+    }
+    break;
+  case PICTURE_SEGMENT:
+    if (seg->length < 2) {
       break;
     }
-    int segment_type = *buf;
-    int segment_length = get_be16(buf+1);
+    for (i=0; i < nr_objects && objects[i].id != get_be16(seg->payload); i++);
+    if (i == nr_objects && nr_objects < MAX_OBJECTS) {
+      pgs_object_init(&objects[nr_objects++]);
+    }
+    if (i < nr_objects) {
+      pgs_object_add(&objects[i], seg);
+    }
+    break;
+  case PRESENTATION_SEGMENT:
+    shown_len = 0;
+    if (pres->nr_forced > 0) {
+      shown_len = seg->length;
+      memcpy(shown, seg->payload, shown_len);
+    }
+    break;
+  case DISPLAY_SEGMENT:
+    for (i=0; shown_len > 0 && i < shown[10]; i++) {
+      uint8_t *entry = shown + 11 + 8*i;
+      if (!(entry[3] & 0x40)) {
+        continue;
+      }
+      int j;
+      for (j=0; j < nr_objects && objects[j].id != get_be16(entry); j++);
+      // An object can't be bigger than the video
+      if (j < nr_objects && objects[j].width > 0 &&
+          objects[j].width <= get_be16(shown) && objects[j].height <= get_be16(shown+2)) {
+        write_bitmap(&objects[j], &palettes[shown[9]]);
+      }
+    }
+    shown_len = 0;
+    break;
+  }
+}
+
 
-    if (ring_get_exact(ring, segment_length, buf)) {
-      fprintf (stderr, "Not enough data for a segment of length %d; try increasing buffer size\n", segment_length);
+int scan_stream(char *fin_name, char *fout_name) {
+  /*
+   * Reads the stream segment by segment, recording each segment in
+   * the index if there is one and extracting the forced subtitles to
+   * fout_name if that isn't NULL.  Memory use doesn't depend on the
+   * size of the stream.  Returns 0 on success or -1 on error.
+   */
+  pgs_reader *r = pgs_open(fin_name);
+  if (r == NULL) {
+    perror(fin_name);
+    return -1;
+  }
+  if (fout_name != NULL) {
+    out = pgs_writer_open(r, fout_name);
+    if (out == NULL) {
+      perror(fout_name);
+      pgs_close(r);
       return -1;
     }
-    switch (segment_type) {
-    case PALETTE_SEGMENT:
-      //      printf("Palette, length %d\n", segment_length);
-      break;
-    case PICTURE_SEGMENT:
-      //printf("Picture, length %d\n", segment_length);
-      break;
-    case WINDOW_SEGMENT:
-      //printf("Window, length %d\n", segment_length);
-      break;
-    case DISPLAY_SEGMENT:
-      //printf("Display, length %d\n", segment_length);
+  }
+
+  pgs_segment seg;
+  int ret = 0;
+  int failed = 0;
+  if (windowed) {
+    ret = pgs_seek(r, window_from * PGS_TICKS_PER_MS);
+    if (ret == PGS_ERROR_SEEK) {
+      fprintf(stderr, "%s: %s\n", fin_name, pgs_strerror(ret));
+      failed = 1;
+    }
+  }
+  while (!ret && !failed && !(ret = pgs_next(r, &seg))) {
+    if (windowed && seg.type == PRESENTATION_SEGMENT &&
+        seg.pts / PGS_TICKS_PER_MS > window_to) {
+      if (out != NULL && showing_forced) {
+        // Take the forced subtitle still showing off the screen
+        uint8_t buf[11];
+        memcpy(buf, seg.payload, 11);
+        buf[10] = 0;
+        pgs_write_data(out, &seg, buf, 11);
+        seg.type = DISPLAY_SEGMENT;
+        pgs_write_data(out, &seg, NULL, 0);
+      }
+      ret = PGS_EOF;
       break;
-    default:
-      printf("Unknown segment 0x%x, length %d\n", segment_type, segment_length);
+    }
+    pgs_presentation pres;
+    if (scan_segment(&totals, &seg, &pres)) {
+      report_failure(&totals);
+      failed = 1;
       break;
-    case PRESENTATION_SEGMENT:
-      //printf("Presentation, length %d\n", segment_length);
-      segment_length -= 11;
-      int nr_objects = buf[10];
-      uint8_t*buf_cur = buf + 11;
-      if (segment_length != 8*nr_objects) {
-	fprintf(stderr, "Inconsistency in presentation segment - expected %d objects, but data present for %d", nr_objects, segment_length/8);
-	return -1;
-      }
-      int i;
-      int forced_before = 0;
-      for (i=0; i < nr_objects; i++) {
-	int forced = buf_cur[8*i+3] & 0x40;
-	if (forced) {
-	  printf("Forced\n");
-	  forced_objects++;
-	  if (!forced_before) {
-	    forced_before = 1;
-	    forced_presentations++;
-	  }
-	}
-      }
+    }
+    if (out != NULL) {
+      extract_segment(&seg, &pres);
+    }
+    if (bitmap_prefix != NULL) {
+      bitmap_segment(&seg, &pres);
     }
   }
 
-  printf("TOTAL: %d forced objects in %d presentation segments\n", forced_objects, forced_presentations);
+  if (out != NULL && pgs_writer_close(out)) {
+    fprintf(stderr, "%s: %s\n", fout_name, pgs_strerror(PGS_ERROR_WRITE));
+    failed = 1;
+  }
+  out = NULL;
+  pgs_close(r);
+
+  if (failed) {
+    return -1;
+  }
+  if (ret == PGS_ERROR_TRUNCATED) {
+    fprintf (stderr, "Not enough data for a segment of length %d; try increasing buffer size\n", seg.length);
+    return -1;
+  }
+  if (ret == PGS_ERROR_SYNC) {
+    fprintf(stderr, "At offset %llu: %s\n", (unsigned long long)seg.offset, pgs_strerror(ret));
+    return -1;
+  }
 
+  report_totals(&totals);
   return 0;
+}
+
+
+static int scan_range_segment(void *ctx, pgs_segment *seg) {
+  pgs_presentation pres;
+  return scan_segment(ctx, seg, &pres);
+}
+
+
+int scan_parallel(char *fin_name, int nr_threads) {
+  /*
+   * Scans the stream on several threads, each range of it reporting
+   * into a buffer of its own, then puts the results together in order
+   * so that they are exactly as for scan_stream.  Returns 0 on
+   * success, -1 on error, or PGS_ERROR_MAP if the stream can't be
+   * scanned this way, having done nothing.
+   */
+  scan_results *ranges = calloc(nr_threads, sizeof(scan_results));
+  void **ctxs = calloc(nr_threads, sizeof(void *));
+  if (ranges == NULL || ctxs == NULL) {
+    free(ranges);
+    free(ctxs);
+    return PGS_ERROR_MAP;
+  }
+  int i;
+  int failed = 0;
+  for (i=0; i < nr_threads && !failed; i++) {
+    ranges[i].out = open_memstream(&ranges[i].buf, &ranges[i].buf_len);
+    if (totals.idx != NULL) {
+      ranges[i].idx = pgs_index_alloc();
+    }
+    failed = ranges[i].out == NULL || (totals.idx != NULL && ranges[i].idx == NULL);
+    ctxs[i] = &ranges[i];
+  }
+
+  int nr_ranges = 0;
+  pgs_segment bad;
+  int ret = failed ? PGS_ERROR_ALLOC : pgs_scan_parallel(fin_name, nr_threads, scan_range_segment, ctxs, &nr_ranges, &bad);
+
+  // Stop at the first range which failed, as a serial scan would
+  for (i=0; i < nr_ranges && !failed; i++) {
+    scan_results *res = &ranges[i];
+    fflush(res->out);
+    fwrite(res->buf, 1, res->buf_len, totals.out);
+    totals.forced_objects += res->forced_objects;
+    totals.forced_presentations += res->forced_presentations;
+    int type;
+    for (type=0; type < 256; type++) {
+      totals.type_count[type] += res->type_count[type];
+      totals.type_bytes[type] += res->type_bytes[type];
+    }
+    if (res->idx != NULL && pgs_index_merge(totals.idx, res->idx)) {
+      res->failed = FAILED_ALLOC;
+    }
+    if (res->failed) {
+      report_failure(res);
+      failed = 1;
+    }
+  }
+  for (i=0; i < nr_threads; i++) {
+    if (ranges[i].out != NULL) fclose(ranges[i].out);
+    free(ranges[i].buf);
+    if (ranges[i].idx != NULL) pgs_index_free(ranges[i].idx);
+  }
+  free(ranges);
+  free(ctxs);
 
+  if (ret == PGS_ERROR_MAP) {
+    return ret;
+  }
+  if (failed) {
+    return -1;
+  }
+  if (ret == PGS_ERROR_ALLOC) {
+    fprintf(stderr, "malloc fail\n");
+    return -1;
+  }
+  if (ret == PGS_ERROR_TRUNCATED) {
+    fprintf (stderr, "Not enough data for a segment of length %d; try increasing buffer size\n", bad.length);
+    return -1;
+  }
+  if (ret == PGS_ERROR_SYNC) {
+    fprintf(stderr, "At offset %llu: %s\n", (unsigned long long)bad.offset, pgs_strerror(ret));
+    return -1;
+  }
+
+  report_totals(&totals);
+  return 0;
 }
 
 
-int get_be16(uint8_t*buf) {
-  uint16_t val = ((uint16_t)(*buf)) << 8;
-  val |= (uint16_t)(buf[1]);
-  return val;
+void scan_index(pgs_index *idx) {
+  /*
+   * Reports on a stream from its index alone, without reading the
+   * stream itself.
+   */
+  size_t i;
+  for (i=0; i < idx->nr_entries; i++) {
+    pgs_index_entry *e = &idx->entries[i];
+    report_segment(&totals, e->type, e->length, e->nr_forced, e->header_len == PGS_SUP_HEADER, e->pts);
+  }
+
+  report_totals(&totals);
 }
@@ -0,0 +1,271 @@
+/*
+ *  Copyright Andrew Ryrie 2013
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/batch.h"
+#include "util/pgs.h"
+#include "util/srt.h"
+#include "util/stats.h"
+#include "util/subtitles.h"
+
+// How long a subtitle still on screen at the end of the stream is
+// shown for, in milliseconds
+#define FINAL_CUE_MS 2000
+
+void usage(char *executable_name) {
+  printf("Usage: %s <input.sup> <output.srt> [-e] [-f]\n", executable_name);
+  batch_usage(executable_name, "[-e] [-f]");
+  printf("\nWrites the timeline of a PGS stream in a .sup file as SRT cues, one for each\n");
+  printf("display set which shows something, from its presentation until the next one.\n");
+  printf("Each cue's text is [FORCED] if any of its objects are forced, and [SUBTITLE]\n");
+  printf("otherwise.  The stream is read once, from start to end.\n");
+  printf("  -e  Makes one cue of everything shown in an epoch until the screen is\n");
+  printf("      cleared, rather than one for each display set, so palette changes\n");
+  printf("      and updates to part of the screen don't split it up.\n");
+  printf("  -f  Only writes the cues which are forced.\n");
+  printf("\nA subtitle still on screen at the end of the stream is shown for %d\n", FINAL_CUE_MS / 1000);
+  printf("seconds.  Bare PGS streams have no timestamps, so can't be converted.\n");
+  stats_usage();
+}
+
+
+typedef struct {
+  // Whether to merge the display sets of an epoch, and whether to
+  // write only forced cues
+  int epochs;
+  int forced_only;
+
+  char *fin_name;
+  char *fout_name;
+} options;
+
+// The cue being built, and the cues written so far
+typedef struct {
+  srt_file *fout;
+  options *opts;
+
+  // Set while something is on screen, with when it appeared and
+  // whether any of it has been forced
+  int showing;
+  unsigned long start;
+  int forced;
+
+  unsigned long nr_cues;
+} timeline;
+
+
+int parse_options(int argc, char **argv, int i, options *opts) {
+  /*
+   * Parses the command line from argv[i] onwards into opts; any
+   * input/output file names not already set are taken from the
+   * non-option arguments.  Returns 0 on success or -1 if the command
+   * line is not valid.
+   */
+  for (; i < argc; ++i) {
+    if (strncmp(argv[i], "-", 1)) {
+      // Not an option, must be in/out file
+      if (opts->fin_name == NULL) {
+        opts->fin_name = argv[i];
+      } else if (opts->fout_name == NULL) {
+        opts->fout_name = argv[i];
+      } else {
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "-e")) {
+      opts->epochs = 1;
+    } else if (!strcmp(argv[i], "-f")) {
+      opts->forced_only = 1;
+    } else {
+      return -1;
+    }
+  }
+
+  // Make sure we have an input and output file
+  if (opts->fin_name == NULL || opts->fout_name == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int end_cue(timeline *tl, unsigned long end) {
+  /*
+   * Takes whatever is showing off the screen at end, writing its cue
+   * unless it is empty or filtered out.  Returns 0 or an SRT error code.
+   */
+  if (!tl->showing) {
+    return 0;
+  }
+  tl->showing = 0;
+  if (end <= tl->start || (tl->opts->forced_only && !tl->forced)) {
+    return 0;
+  }
+
+  sub_text sub;
+  sub.id = ++tl->nr_cues;
+  sub.start = tl->start;
+  sub.end = end;
+  sub.text = tl->forced ? "[FORCED]" : "[SUBTITLE]";
+  sub.len = strlen(sub.text);
+  sub.buf_len = 0;
+  return srt_write(tl->fout, &sub);
+}
+
+
+int presentation_segment(timeline *tl, pgs_segment *seg, pgs_presentation *pres) {
+  /*
+   * Moves the timeline on to a presentation, which replaces whatever
+   * was on screen.  Returns 0 or an SRT error code.
+   */
+  unsigned long ms = seg->pts / PGS_TICKS_PER_MS;
+  int epoch_start = (seg->payload[7] & 0x80) != 0;
+  int error;
+
+  if (!tl->opts->epochs || pres->nr_objects == 0 || epoch_start) {
+    if ((error = end_cue(tl, ms))) {
+      return error;
+    }
+  }
+  if (pres->nr_objects > 0) {
+    if (!tl->showing) {
+      tl->showing = 1;
+      tl->start = ms;
+      tl->forced = 0;
+    }
+    tl->forced |= pres->nr_forced > 0;
+  }
+  return 0;
+}
+
+
+int convert_file(options *opts) {
+  /*
+   * Converts one stream in a single pass, holding only the segment
+   * being read.  Returns the exit status for the program, having
+   * reported any error on stderr.
+   */
+  char *fin_name = opts->fin_name;
+  char *fout_name = opts->fout_name;
+
+  FILE *f = batch_open_stream(fin_name);
+  if (f == NULL) {
+    fprintf(stderr, "Error opening input file %s: %s\n", fin_name, strerror(errno));
+    return 1;
+  }
+  pgs_reader *r = pgs_open_stream(f);
+  if (r == NULL) {
+    fclose(f);
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+
+  // An empty stream is fine, it just has no cues
+  pgs_segment seg;
+  int ret = pgs_next(r, &seg);
+  if (!ret && r->framing != PGS_FRAMING_SUP) {
+    fprintf(stderr, "%s: not a .sup file, so there are no timestamps\n", fin_name);
+    pgs_close(r);
+    return 1;
+  }
+
+  srt_file *fout = batch_open_output(fout_name);
+  if (fout == NULL) {
+    fprintf(stderr, "Error opening output file %s: %s\n", fout_name, strerror(errno));
+    pgs_close(r);
+    return 1;
+  }
+
+  timeline tl;
+  memset(&tl, 0, sizeof(timeline));
+  tl.fout = fout;
+  tl.opts = opts;
+
+  int write_error = 0;
+  while (!ret && !write_error) {
+    if (seg.type == PRESENTATION_SEGMENT) {
+      pgs_presentation pres;
+      if ((ret = pgs_parse_presentation(&seg, &pres))) {
+        break;
+      }
+      write_error = presentation_segment(&tl, &seg, &pres);
+    }
+    ret = pgs_next(r, &seg);
+  }
+  if (!write_error) {
+    write_error = end_cue(&tl, tl.start + FINAL_CUE_MS);
+  }
+
+  if (!write_error && ret != PGS_EOF) {
+    fprintf(stderr, "At offset %llu of %s: %s\n", (unsigned long long)seg.offset, fin_name, pgs_strerror(ret));
+  }
+
+  pgs_close(r);
+  if (batch_close_output(fout) || write_error) {
+    fprintf(stderr, "Error writing to %s: %s\n", fout_name, srt_strerror(SRT_ERROR_WRITE));
+    return 2;
+  }
+
+  if (ret != PGS_EOF) {
+    return 2;
+  }
+
+  return 0;
+}
+
+
+int convert_job(int argc, char **argv) {
+  /*
+   * Batch job: argv holds the input, the output and then the options.
+   */
+  options opts = { 0, 0, argv[0], argv[1] };
+  if (parse_options(argc, argv, 2, &opts)) {
+    fprintf(stderr, "%s: invalid options\n", argv[0]);
+    return 127;
+  }
+  return convert_file(&opts);
+}
+
+
+int main(int argc, char **argv) {
+
+  stats_option(&argc, argv);
+  batch_set_suffixes(".sup", ".srt");
+  if (batch_requested(argc, argv)) {
+    int status = batch_main(argc, argv, convert_job);
+    if (status == 127) {
+      usage(argv[0]);
+    }
+    return status;
+  }
+
+  options opts = { 0, 0, NULL, NULL };
+  if (argc < 3 || parse_options(argc, argv, 1, &opts)) {
+    usage(argv[0]);
+    return 127;
+  }
+
+  return convert_file(&opts);
+}
@@ -0,0 +1,160 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/batch.h"
+#include "util/srt.h"
+#include "util/srt_binary.h"
+#include "util/srt_document.h"
+#include "util/stats.h"
+#include "util/subtitles.h"
+
+void usage(char* executable_name) {
+  printf("Usage: %s <input> <output>\n", executable_name);
+  batch_usage(executable_name, "");
+  printf("\nCompiles an SRT file into a binary file which can be loaded without\n");
+  printf("parsing, or, given a compiled file, converts it back to SRT with the\n");
+  printf("newline delimiter of the original.\n");
+  stats_usage();
+}
+
+
+int compile_file(char* fin_name, char* fout_name) {
+  /*
+   * Compiles one SRT file.  Returns the exit status for the program,
+   * having reported any error on stderr.
+   */
+  srt_file* fin = batch_open_input(fin_name);
+  if (fin == NULL) {
+    // Not mappable (e.g. a pipe), so fall back to reading through stdio
+    fin = srt_open_read(fin_name);
+  }
+  if (fin == NULL) {
+    fprintf(stderr, "Error opening input file %s: %s\n", fin_name, strerror(errno));
+    return 1;
+  }
+
+  srt_document* doc = srt_document_alloc(0, 0);
+  if (doc == NULL) {
+    fprintf(stderr, "OOM\n");
+    srt_close(fin);
+    return 1;
+  }
+  int error = srt_document_read(fin, doc);
+  if (error) {
+    fprintf(stderr, "Error at input line %u: %s\n", fin->line_no, srt_strerror(error));
+    srt_document_free(doc);
+    srt_close(fin);
+    return 2;
+  }
+  srt_close(fin);
+
+  int status = 0;
+  if (srt_binary_write(doc, fout_name)) {
+    fprintf(stderr, "Error writing to %s: %s\n", fout_name, strerror(errno));
+    status = 2;
+  }
+  srt_document_free(doc);
+  return status;
+}
+
+
+int decompile_file(srt_binary* bin, char* fin_name, char* fout_name) {
+  /*
+   * Converts one compiled file back to SRT.  Returns the exit status
+   * for the program, having reported any error on stderr.
+   */
+  srt_file* fout = batch_open_output(fout_name);
+  if (fout == NULL) {
+    fprintf(stderr, "Error opening output file %s: %s\n", fout_name, strerror(errno));
+    return 1;
+  }
+  fout->delimiter = bin->delimiter;
+
+  sub_text sub;
+  int error = 0;
+  size_t i;
+  for (i=0; i < bin->nr_subs && !error; ++i) {
+    if ((error = srt_binary_get(bin, i, &sub))) {
+      fprintf(stderr, "Error at subtitle %zu of %s: %s\n", i+1, fin_name, srt_binary_strerror(error));
+    } else {
+      error = srt_write(fout, &sub);
+    }
+  }
+
+  if (batch_close_output(fout) || error == SRT_ERROR_WRITE) {
+    fprintf(stderr, "Error writing to %s: %s\n", fout_name, srt_strerror(SRT_ERROR_WRITE));
+    return 2;
+  }
+  return error ? 2 : 0;
+}
+
+
+int convert_file(char* fin_name, char* fout_name) {
+  /*
+   * Compiles or decompiles one file, according to what the input is.
+   */
+  srt_binary* bin = srt_binary_open(fin_name);
+  if (bin == NULL) {
+    if (errno == EINVAL) {
+      return compile_file(fin_name, fout_name);
+    }
+    fprintf(stderr, "Error opening input file %s: %s\n", fin_name, strerror(errno));
+    return 1;
+  }
+  int status = decompile_file(bin, fin_name, fout_name);
+  srt_binary_close(bin);
+  return status;
+}
+
+
+int convert_job(int argc, char **argv) {
+  /*
+   * Batch job: argv holds the input and the output.
+   */
+  if (argc != 2) {
+    fprintf(stderr, "%s: unexpected parameters\n", argv[0]);
+    return 127;
+  }
+  return convert_file(argv[0], argv[1]);
+}
+
+
+int main(int argc, char **argv) {
+
+  stats_option(&argc, argv);
+  if (batch_requested(argc, argv)) {
+    int status = batch_main(argc, argv, convert_job);
+    if (status == 127) {
+      usage(argv[0]);
+    }
+    return status;
+  }
+
+  if (argc != 3) {
+    usage(argv[0]);
+    return 127;
+  }
+
+  return convert_file(argv[1], argv[2]);
+}
@@ -22,184 +22,293 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "util/batch.h"
+#include "util/retime.h"
 #include "util/srt.h"
+#include "util/srt_document.h"
+#include "util/stats.h"
 #include "util/subtitles.h"
 
 void usage(char *executable_name) {
-  printf("Usage: %s id,time [id,time ...] <input.srt> <output.srt>\n", executable_name);
-  printf("Interpolate/extrapolate the timestamps on SRT subtitles\n");
+  printf("Usage: %s [options] [id,time ...] <input.srt> <output.srt>\n", executable_name);
+  batch_usage(executable_name, "[options] [id,time ...]");
+  printf("\nInterpolate/extrapolate the timestamps on SRT subtitles\n");
   printf("so that subtitles with the given IDs occur at the corresponding\n");
-  printf("timestamps.  The time can be in hr:min:sec.msec format, or can just\n");
-  printf("be in seconds.  The ID is an unsigned integer corresponding to the\n");
-  printf("ID in the SRT input file.\n");
+  printf("timestamps.  The time can be in hr:min:sec.msec or min:sec.msec\n");
+  printf("format, or can just be in seconds.  The ID is an unsigned integer\n");
+  printf("corresponding to the ID in the SRT input file.  Each subtitle is\n");
+  printf("interpolated between the points either side of its start time, so\n");
+  printf("the points' subtitles must start in order of ID.\n");
+  printf("The input is read in a single pass, so may be a pipe; - means\n");
+  printf("stdin (or stdout for the output).  Subtitles are held in memory\n");
+  printf("until the next point has been seen.\n");
+  printf("  -m MiB     Fails if more than this much memory is needed to hold\n");
+  printf("             subtitles between points.\n");
+  printf("  -p         Reports the most memory used to hold subtitles.\n");
+  printf("  -a file    Reads further points from a file, separated by white\n");
+  printf("             space; # starts a comment.\n");
+  stats_usage();
 }
 
 
-unsigned int INITIAL_MAX_POINTS = 8;
-
-
 typedef struct {
-  unsigned int id;
-  long time_initial;
-  long time_final;
+  retime_point* points;
+  int nr_points;
 
-  // Amount to offset and multiply everything after the previous point but before this by
-  long ppm;
-  long offset;
-} point;
+  // The most memory to use for subtitles waiting for their segment to
+  // be known, or 0 for no limit
+  size_t max_buffer;
 
+  // Whether to report how much memory was used for those subtitles
+  int report_peak;
+} options;
 
-int main (int argc, char **argv) {
 
-  if (argc < 4) {
-    usage(argv[0]);
-    return 127;
-  }
+int parse_args(int nr_args, char **args, options* opts) {
+  /*
+   * Parses options and id,time points from args into opts; the points
+   * must be freed by the caller.  Returns 0 on success, 1 if memory
+   * could not be allocated, 2 if the points are unusable or 127 if an
+   * argument is invalid.
+   */
+  opts->max_buffer = 0;
+  opts->report_peak = 0;
+  char* points_file = NULL;
 
-  point* points = NULL;
-  int nr_points = 0;
-  int max_points = 0;
-  
-  points = malloc(INITIAL_MAX_POINTS*sizeof(point));
-  if (points == NULL) {
+  char** point_args = malloc(nr_args * sizeof(char*));
+  if (point_args == NULL) {
     fprintf(stderr, "OOM\n");
     return 1;
   }
-  max_points = INITIAL_MAX_POINTS;
-  
-  int arg;
+  int nr_point_args = 0;
   int i;
-  for (arg=1; arg < argc-2; ++arg) {
-    if (nr_points == max_points) {
-      point* new = realloc(points, 2*max_points*sizeof(point));
-      if (new == NULL) {
-        fprintf(stderr, "OOM\n");
-        return 1;
-      }
-      points = new;
-      max_points *= 2;
-    }
-    unsigned int id;
-    double time_float;
-    unsigned long time;
-    unsigned int hr=0, min=0;
-    if (sscanf(argv[arg], "%u,%lf", &id, &time_float) != 2) {
-      if (sscanf(argv[arg], "%u,%u:%lf", &id, &min, &time_float) != 3) {
-        if (sscanf(argv[arg], "%u,%u:%u:%lf", &id, &hr, &min, &time_float) != 4) {
-          usage(argv[0]);
-          return 127;
-        }
-      }
-    }
-    if (time_float < 0) {
-      usage(argv[0]);
-      return 127;
-    }
-    time = (unsigned long) (time_float * 1000) + ((unsigned long)hr)*3600000 + ((unsigned long)min)*60000;
-
-    // Insertion sort the new point into the list of points by ID
-    for (i=0; i < nr_points && points[i].id < id; ++i) {}
-    
-    if (i > 0) {
-      if (points[i-1].time_final > time) {
-        fprintf(stderr, "Error: times should increase monotonically with ID\n");
+  for (i=0; i < nr_args; ++i) {
+    if (!strcmp(args[i], "-p")) {
+      opts->report_peak = 1;
+    } else if (!strcmp(args[i], "-m")) {
+      double mib;
+      if (++i >= nr_args || sscanf(args[i], "%lf", &mib) != 1 || mib <= 0) {
+        free(point_args);
+        return 127;
       }
-    }
-    if (i < nr_points-1) {
-      if (points[i].time_final < time) {
-        fprintf(stderr, "Error: times should increase monotonically with ID %d\n", i);
+      opts->max_buffer = (size_t) (mib * 1048576);
+    } else if (!strcmp(args[i], "-a")) {
+      if (++i >= nr_args) {
+        free(point_args);
+        return 127;
       }
+      points_file = args[i];
+    } else {
+      point_args[nr_point_args++] = args[i];
     }
+  }
 
-    memmove(points+i+1, points+i, (nr_points-i)*sizeof(point));
-
-    points[i].id = id;
-    points[i].time_final = time;
+  int status = retime_parse_points(nr_point_args, point_args, points_file,
+                                   &opts->points, &opts->nr_points);
+  free(point_args);
+  return status;
+}
 
-    ++nr_points;
-  }
 
+int interpolate_file(options* opts, char* fin_name, char* fout_name) {
+  /*
+   * Interpolates one file in a single pass.  Subtitles are held back
+   * only until the points which decide their segment have been seen,
+   * so the input may be a pipe ("-" for stdin).  Returns the exit
+   * status for the program, having reported any error on stderr.
+   */
+  retime_point* points = opts->points;
+  int nr_points = opts->nr_points;
 
-  srt_file* fin = srt_open_read(argv[argc-2]);
+  srt_file* fin = batch_open_input(fin_name);
+  if (fin == NULL) {
+    // Not mappable (e.g. a pipe), so fall back to reading through stdio
+    fin = srt_open_read(strcmp(fin_name, "-") ? fin_name : "/dev/stdin");
+  }
   if (fin == NULL) {
-    fprintf(stderr, "Could not open %s for reading: %s\n", argv[argc-2], strerror(errno));
+    fprintf(stderr, "Could not open %s for reading: %s\n", fin_name, strerror(errno));
     return 2;
   }
 
-  srt_file* fout = srt_open_write(argv[argc-1]);
+  srt_file* fout = batch_open_output(strcmp(fout_name, "-") ? fout_name : "/dev/stdout");
   if (fout == NULL) {
-    fprintf(stderr, "Could not open %s for writing: %s\n", argv[argc-1], strerror(errno));
+    fprintf(stderr, "Could not open %s for writing: %s\n", fout_name, strerror(errno));
+    srt_close(fin);
     return 2;
   }
 
-  // Make a first pass through the file, populating the initial times
+  // Subtitles read but not yet written, because their segment is not
+  // known yet
+  srt_document* pending = srt_document_alloc(0, 0);
+  if (pending == NULL) {
+    fprintf(stderr, "OOM\n");
+    srt_close(fin);
+    batch_close_output(fout);
+    return 1;
+  }
+  size_t next_pending = 0;
+  size_t peak_bytes = pending->arena_len;
+  size_t peak_subs = 0;
+
+  // The number of points whose subtitle has been seen, and how many
+  // segments have coefficients
+  int nr_found = 0;
+  int nr_calculated = 0;
+
   sub_text sub;
-  sub.text = NULL;
-  sub.len = 0;
-  int error = srt_read(fin, &sub);
-  i = 0;
-  while (!error && i < nr_points) {
-    if (sub.id == points[i].id) {
-      points[i].time_initial = sub.start;
-      ++i;
+  int error = 0;
+  int read_error = 0;
+  int status = 0;
+  while (!read_error) {
+    read_error = srt_read_ref(fin, &sub);
+    if (!read_error) {
+      if (nr_found < nr_points && sub.id == points[nr_found].id) {
+        if (nr_found > 0 && (long) sub.start <= points[nr_found-1].time_initial) {
+          fprintf(stderr, "Error: subtitle %u doesn't start after subtitle %u in %s\n",
+                  sub.id, points[nr_found-1].id, fin_name);
+          status = 2;
+          break;
+        }
+        points[nr_found].time_initial = sub.start;
+        ++nr_found;
+      }
+      if ((error = srt_document_append(pending, &sub))) {
+        fprintf(stderr, "Error reading from %s: %s\n", fin_name, srt_strerror(error));
+        status = 1;
+        break;
+      }
+      if (pending->arena_len > peak_bytes) peak_bytes = pending->arena_len;
+      if (pending->nr_subs - next_pending > peak_subs) peak_subs = pending->nr_subs - next_pending;
+      if (opts->max_buffer && pending->arena_len > opts->max_buffer) {
+        fprintf(stderr, "Error: more than %zu bytes of subtitles between points in %s\n",
+                opts->max_buffer, fin_name);
+        status = 2;
+        break;
+      }
+    } else if (nr_found < nr_points) {
+      // Nothing more is coming, so whatever is pending is stuck
+      if (read_error == SRT_EOF) {
+        fprintf(stderr, "Error: no subtitle with ID %u in %s\n", points[nr_found].id, fin_name);
+      } else {
+        fprintf(stderr, "Error reading from %s: %s (%d)\n", fin_name, srt_strerror(read_error), read_error);
+      }
+      status = 2;
+      break;
+    }
+
+    // Write out whatever subtitles now have a known segment
+    while (next_pending < pending->nr_subs) {
+      // A subtitle belongs to the segment of the first point which
+      // starts no earlier, so can't be placed until such a point has
+      // been found, or all of them have.  The first segment shares
+      // the coefficients of the second.
+      int i = retime_find_segment(points, nr_found, pending->starts[next_pending]);
+      if (i == nr_found) {
+        if (nr_found < nr_points) break;
+        i = nr_points-1;
+      }
+      if (i == 0 && nr_points > 1 && nr_found < 2) break;
+
+      // Map the run of subtitles in this segment in one go, clamp
+      // them to the start of the video as srt_offset does, then write
+      // out those which are left
+      size_t end = retime_segment_end(points, nr_points, i, pending, next_pending, pending->nr_subs);
+      while (nr_calculated <= i) {
+        retime_calculate_segment(points, nr_points, nr_calculated++);
+      }
+      retime_map(pending->starts + next_pending, pending->ends + next_pending,
+                 end - next_pending, points[i].ppm, points[i].offset);
+      size_t kept = retime_clamp(pending, next_pending, end);
+      for (; next_pending < kept; ++next_pending) {
+        srt_document_get(pending, next_pending, &sub);
+        if ((error = srt_write(fout, &sub))) {
+          fprintf(stderr, "Error writing to %s: %s\n", fout_name, srt_strerror(error));
+          status = 2;
+          break;
+        }
+      }
+      if (status) {
+        break;
+      }
+      next_pending = end;
+    }
+    if (status) {
+      break;
+    }
+
+    // Reuse the buffer once everything in it has been written
+    if (next_pending == pending->nr_subs) {
+      srt_document_clear(pending);
+      next_pending = 0;
     }
-    error = srt_read(fin, &sub);
   }
 
-  if (error != SRT_EOF && error != 0) {
-    fprintf(stderr, "Error reading from %s: %s (%d)\n", argv[argc-2], srt_strerror(error), error);
-    return 2;
+  if (!status && read_error != SRT_EOF) {
+    fprintf(stderr, "Error reading from %s: %s\n", fin_name, srt_strerror(read_error));
+    status = 2;
   }
-  
-  if ((error = srt_seek_beginning(fin))) {
-    fprintf(stderr, "Error seeking in %s: %s\n", argv[argc-2], srt_strerror(error));
+
+  if (opts->report_peak) {
+    fprintf(stderr, "%s: peak buffer %zu bytes for %zu subtitles\n", fin_name, peak_bytes, peak_subs);
+  }
+
+  srt_document_free(pending);
+  srt_close(fin);
+  if (batch_close_output(fout)) {
+    fprintf(stderr, "Error writing to %s: %s\n", fout_name, srt_strerror(SRT_ERROR_WRITE));
     return 2;
   }
 
-  // Go through the points and calculate the interpolation coefficients for each segment
-  if (nr_points == 1) {
-    points[0].ppm = 0;
-    points[0].offset = points[0].time_final - points[0].time_initial;
-  } else {
-    for (i=1; i < nr_points; ++i) {
-      points[i].ppm = (points[i].time_final - points[i-1].time_final);
-      points[i].ppm *= 1000000;
-      points[i].ppm /= (points[i].time_initial - points[i-1].time_initial);
-      points[i].ppm -= 1000000;
-      points[i].offset = points[i].time_final - points[i].time_initial - points[i].ppm * points[i].time_initial / 1000000;
+  return status;
+
+}
+
+
+int interpolate_job(int argc, char **argv) {
+  /*
+   * Batch job: argv holds the input, the output and then the options
+   * and id,time points.
+   */
+  options opts;
+  int status = parse_args(argc-2, argv+2, &opts);
+  if (status) {
+    if (status == 127) {
+      fprintf(stderr, "%s: invalid points\n", argv[0]);
     }
-    points[0].ppm = points[1].ppm;
-    points[0].offset = points[1].offset;
+    return status;
   }
+  status = interpolate_file(&opts, argv[0], argv[1]);
+  free(opts.points);
+  return status;
+}
+
 
+int main (int argc, char **argv) {
 
-  // Make a second pass, this timing adjusting the timestamps and writing
-  error = srt_read(fin, &sub);
-  i = 0;
-  while (!error) {
-    if (points[i].time_initial < sub.start && i+1 < nr_points) ++i;
-    sub.start += points[i].ppm * sub.start / 1000000;
-    sub.end += points[i].ppm * sub.end / 1000000;
-    sub.start += points[i].offset;
-    sub.end += points[i].offset;
-    if ((error = srt_write(fout, &sub))) {
-      fprintf(stderr, "Error writing to %s: %s\n", argv[argc-1], srt_strerror(error));
-      return 2;
+  stats_option(&argc, argv);
+  if (batch_requested(argc, argv)) {
+    int status = batch_main(argc, argv, interpolate_job);
+    if (status == 127) {
+      usage(argv[0]);
     }
-    error = srt_read(fin, &sub);
+    return status;
   }
 
-  srt_close(fin);
-  srt_close(fout);
-  if (sub.text != NULL) {
-    free(sub.text);
+  if (argc < 4) {
+    usage(argv[0]);
+    return 127;
   }
-  free(points);
 
-  if (error != SRT_EOF) {
-    fprintf(stderr, "Error reading from %s: %s\n", argv[argc-2], srt_strerror(error));
+  options opts;
+  int status = parse_args(argc-3, argv+1, &opts);
+  if (status) {
+    if (status == 127) {
+      usage(argv[0]);
+    }
+    return status;
   }
 
-  return 0;
-
+  status = interpolate_file(&opts, argv[argc-2], argv[argc-1]);
+  free(opts.points);
+  return status;
 }
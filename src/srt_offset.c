@@ -28,12 +28,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "util/batch.h"
+#include "util/retime.h"
 #include "util/srt.h"
+#include "util/srt_document.h"
+#include "util/stats.h"
 #include "util/subtitles.h"
 
+// The number of subtitles retimed at a time when streaming
+#define OFFSET_BATCH_SUBS 4096
+
 void usage(char* executable_name) {
-  printf("Usage: %s <input.srt> <output.srt>\n", executable_name);
-  printf("Modifies the timestamps of srt subtitles according to the following options:\n");
+  printf("Usage: %s <input.srt> <output.srt> [options]\n", executable_name);
+  batch_usage(executable_name, "[options]");
+  printf("\nModifies the timestamps of srt subtitles according to the following options:\n");
   printf("  -t seconds Translates the input by a number of seconds, i.e.\n");
   printf("             the value given is added to each timestamp.\n");
   printf("             Positive numbers make the subtitles later, negative\n");
@@ -41,66 +49,74 @@ void usage(char* executable_name) {
   printf("             integer.\n");
   printf("  -f factor  Applies a multiplicative factor to all subtitle\n");
   printf("             timestamps.  This is applied before any translation.\n");
+  printf("  -j threads Parses the input on the given number of threads.\n");
+  printf("             Worthwhile for very large files, but the whole file\n");
+  printf("             is held in memory; otherwise it is streamed.\n");
+  printf("\n");
+  printf("Subtitles which end up ending before zero are dropped, and those\n");
+  printf("which start before zero are moved to start at zero.\n");
+  stats_usage();
 }
 
-int main(int argc, char **argv) {
-
-  if (argc < 3) {
-    usage(argv[0]);
-    return 127;
-  }
-
-  int i = 1;
 
+typedef struct {
   // The translation to apply to the timestamps, in milliseconds
-  int translation = 0;
+  int translation;
 
   // The multiplicative factor to apply to the timestamps, in ppm
   // difference from unity
-  int factor = 0;
+  int factor;
+
+  // The number of threads to parse the input with, or 0 to stream it
+  int nr_threads;
+
+  char* fin_name;
+  char* fout_name;
+} options;
 
-  char* fin_name = NULL;
-  char* fout_name = NULL;
 
+int parse_options(int argc, char **argv, int i, options* opts) {
+  /*
+   * Parses the command line from argv[i] onwards into opts; any
+   * input/output file names not already set are taken from the
+   * non-option arguments.  Returns 0 on success or -1 if the command
+   * line is not valid.
+   */
   while (i < argc) {
     if (strncmp(argv[i], "-", 1)) {
       // Not an option, must be in/out file
-      if (fin_name == NULL) {
-        fin_name = argv[i];
-      } else if (fout_name == NULL) {
-        fout_name = argv[i];
+      if (opts->fin_name == NULL) {
+        opts->fin_name = argv[i];
+      } else if (opts->fout_name == NULL) {
+        opts->fout_name = argv[i];
       } else {
-        usage(argv[0]);
-        return 127;
+        return -1;
       }
     } else {
 
       ++i;
       // This is an option; check there is an associated argument
       if (i >= argc) {
-        usage(argv[0]);
-        return 127;
+        return -1;
       }
 
       if (!strncmp(argv[i-1]+1, "t", 2)) {
         // Translation
-        double t;
-        if (sscanf(argv[i], "%lf", &t) != 1) {
-          usage(argv[0]);
-          return 127;
+        if (retime_parse_seconds(argv[i], &opts->translation)) {
+          return -1;
         }
-        translation = (int) (t * 1000.0);
       } else if (!strncmp(argv[i-1]+1, "f", 2)) {
         // Multiplication
-        double f;
-        if (sscanf(argv[i], "%lf", &f) != 1) {
-          usage(argv[0]);
-          return 127;
+        if (retime_parse_factor(argv[i], &opts->factor)) {
+          return -1;
+        }
+      } else if (!strncmp(argv[i-1]+1, "j", 2)) {
+        // Parallel parsing
+        if (sscanf(argv[i], "%d", &opts->nr_threads) != 1 || opts->nr_threads < 1) {
+          return -1;
         }
-        factor = (int) ((f-1.0) * 1e6);
       } else {
-        usage(argv[0]);
-        return 127;
+        return -1;
       }
     }
 
@@ -108,55 +124,131 @@ int main(int argc, char **argv) {
   }
 
   // Make sure we have an input and output file
-  if (fin_name == NULL || fout_name == NULL) {
-    usage(argv[0]);
-    return 127;
+  if (opts->fin_name == NULL || opts->fout_name == NULL) {
+    return -1;
   }
 
+  return 0;
+}
+
+
+int offset_file(options* opts) {
+  /*
+   * Translates and scales one file.  Returns the exit status for the
+   * program, having reported any error on stderr.
+   */
+  char* fin_name = opts->fin_name;
+  char* fout_name = opts->fout_name;
+  int translation = opts->translation;
+  int factor = opts->factor;
+
   // Open the input and output files
-  srt_file* fin = srt_open_read(fin_name);
+  srt_file* fin = batch_open_input(fin_name);
+  if (fin == NULL) {
+    // Not mappable (e.g. a pipe), so fall back to reading through stdio
+    fin = srt_open_read(fin_name);
+  }
   if (fin == NULL) {
     fprintf(stderr, "Error opening input file %s: %s\n", fin_name, strerror(errno));
     return 1;
   }
     
 
-  srt_file* fout = srt_open_write(fout_name);
+  srt_file* fout = batch_open_output(fout_name);
   if (fout == NULL) {
     fprintf(stderr, "Error opening output file %s: %s\n", fout_name, strerror(errno));
+    srt_close(fin);
     return 1;
   }
 
   
-  sub_text sub;
-  sub.text = NULL;
-  sub.buf_len = 0;
-  int error = srt_read(fin, &sub);
-  fout->delimiter = fin->delimiter;
-  while (!error) {
-    sub.start += sub.start * factor / 1000000;
-    sub.end += sub.end * factor / 1000000;
-    sub.start += translation;
-    sub.end += translation;
-
-    if (sub.end > 0) {
-      if (sub.start < 0) sub.start = 0;
-      if ((error = srt_write(fout, &sub))) break;
+  srt_document* doc = srt_document_alloc(0, 0);
+  if (doc == NULL) {
+    fprintf(stderr, "OOM\n");
+    srt_close(fin);
+    batch_close_output(fout);
+    return 1;
+  }
+  int read_error = 0;
+  int error = 0;
+  if (opts->nr_threads > 0) {
+    // Parallel parsing needs the whole file, so it is retimed in one
+    // pass and then written out, up to any error, as streaming would
+    read_error = srt_document_read_parallel(fin, doc, opts->nr_threads);
+    retime_offset(doc, translation, factor);
+    fout->delimiter = fin->delimiter;
+    error = srt_document_write(fout, doc);
+  } else {
+    // Stream the file through a batch of a fixed number of subtitles,
+    // so that memory use doesn't depend on the size of the file
+    sub_text sub;
+    while (!error && !read_error) {
+      while (doc->nr_subs < OFFSET_BATCH_SUBS && !(read_error = srt_read_ref(fin, &sub))) {
+        if ((read_error = srt_document_append(doc, &sub))) break;
+      }
+      retime_offset(doc, translation, factor);
+      fout->delimiter = fin->delimiter;
+      error = srt_document_write(fout, doc);
+      srt_document_clear(doc);
     }
+  }
+  if (!error) {
+    error = read_error ? read_error : SRT_EOF;
+  }
+  srt_document_free(doc);
 
-    error = srt_read(fin, &sub);
+  if (error != SRT_EOF) {
+    fprintf(stderr, "Error at input line %u: %s\n", fin->line_no, srt_strerror(error));
   }
 
   srt_close(fin);
-  srt_close(fout);
-  if (sub.text != NULL) {
-    free(sub.text);
+  if (batch_close_output(fout)) {
+    fprintf(stderr, "Error writing to %s: %s\n", fout_name, srt_strerror(SRT_ERROR_WRITE));
+    return 2;
   }
 
   if (error != SRT_EOF) {
-    fprintf(stderr, "Error at input line %u: %s\n", fin->line_no, srt_strerror(error));
     return 2;
   }
 
   return 0;
 }
+
+
+int offset_job(int argc, char **argv) {
+  /*
+   * Batch job: argv holds the input, the output and then the options.
+   */
+  options opts = { 0, 0, 0, argv[0], argv[1] };
+  if (parse_options(argc, argv, 2, &opts)) {
+    fprintf(stderr, "%s: invalid options\n", argv[0]);
+    return 127;
+  }
+  return offset_file(&opts);
+}
+
+
+int main(int argc, char **argv) {
+
+  stats_option(&argc, argv);
+  if (batch_requested(argc, argv)) {
+    int status = batch_main(argc, argv, offset_job);
+    if (status == 127) {
+      usage(argv[0]);
+    }
+    return status;
+  }
+
+  if (argc < 3) {
+    usage(argv[0]);
+    return 127;
+  }
+
+  options opts = { 0, 0, 0, NULL, NULL };
+  if (parse_options(argc, argv, 1, &opts)) {
+    usage(argv[0]);
+    return 127;
+  }
+
+  return offset_file(&opts);
+}
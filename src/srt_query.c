@@ -0,0 +1,189 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/retime.h"
+#include "util/srt.h"
+#include "util/srt_document.h"
+#include "util/srt_index.h"
+#include "util/stats.h"
+
+void usage(char* executable_name) {
+  printf("Usage: %s <input.srt> [query ...]\n", executable_name);
+  printf("\nFinds the subtitles showing at given times.  A query is either a time,\n");
+  printf("for the subtitles showing at that moment, or from-to, for those showing\n");
+  printf("at any time from from up to to.  Times are in seconds, min:sec or\n");
+  printf("hr:min:sec, with an optional fractional part.  With no queries on the\n");
+  printf("command line, queries are read from stdin, one per line, and answered\n");
+  printf("as they arrive; an invalid one is answered with -1, and explained on\n");
+  printf("stderr.\n");
+  printf("\nThe answer to each query is a line giving the number of subtitles\n");
+  printf("found, followed by those subtitles in SRT format, in order of start\n");
+  printf("time, with their original IDs.  Overlapping subtitles are all found.\n");
+  stats_usage();
+}
+
+
+int parse_query(char* query, long* from, long* to) {
+  /*
+   * Parses a time or from-to range into the half-open range it
+   * covers.  Returns 0 on success or -1 if the query is invalid.
+   */
+  char buf[128];
+  size_t len = strlen(query);
+  while (len > 0 && (query[len-1] == '\n' || query[len-1] == '\r' || query[len-1] == ' ')) --len;
+  if (len >= sizeof(buf)) {
+    return -1;
+  }
+  memcpy(buf, query, len);
+  buf[len] = '\0';
+
+  unsigned long start, end;
+  char* dash = strchr(buf, '-');
+  if (dash == NULL) {
+    if (retime_parse_time(buf, &start)) {
+      return -1;
+    }
+    end = start + 1;
+  } else {
+    *dash = '\0';
+    if (retime_parse_time(buf, &start) || retime_parse_time(dash+1, &end) || end < start) {
+      return -1;
+    }
+  }
+  *from = start;
+  *to = end;
+  return 0;
+}
+
+
+int answer_query(srt_index* idx, srt_document* doc, srt_index_results* results,
+                 srt_file* fout, char* query) {
+  /*
+   * Writes the answer to one query to stdout.  Returns 0 on success,
+   * 1 if memory could not be allocated, 2 if the output could not be
+   * written or 127 if the query is invalid.
+   */
+  long from, to;
+  if (parse_query(query, &from, &to)) {
+    fprintf(stderr, "Invalid query: %s\n", query);
+    return 127;
+  }
+  if (srt_index_query(idx, from, to, results)) {
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+
+  printf("%zu\n", results->nr_subs);
+  if (fflush(stdout)) {
+    return 2;
+  }
+  sub_text sub;
+  size_t i;
+  for (i=0; i < results->nr_subs; ++i) {
+    srt_document_get(doc, results->subs[i], &sub);
+    if (srt_write(fout, &sub)) {
+      return 2;
+    }
+  }
+  return srt_flush(fout) ? 2 : 0;
+}
+
+
+int main(int argc, char **argv) {
+
+  stats_option(&argc, argv);
+  if (argc < 2) {
+    usage(argv[0]);
+    return 127;
+  }
+
+  srt_file* fin = srt_open_mmap(argv[1]);
+  if (fin == NULL) {
+    fin = srt_open_read(argv[1]);
+  }
+  if (fin == NULL) {
+    fprintf(stderr, "Error opening input file %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  srt_document* doc = srt_document_alloc(0, 0);
+  if (doc == NULL) {
+    fprintf(stderr, "OOM\n");
+    srt_close(fin);
+    return 1;
+  }
+  int error = srt_document_read(fin, doc);
+  if (error) {
+    fprintf(stderr, "Error at input line %u: %s\n", fin->line_no, srt_strerror(error));
+    srt_document_free(doc);
+    srt_close(fin);
+    return 2;
+  }
+
+  srt_index* idx = srt_index_build(doc);
+  srt_file* fout = srt_open_write_stream(stdout);
+  if (idx == NULL || fout == NULL) {
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+  fout->delimiter = doc->delimiter;
+
+  srt_index_results results = { NULL, 0, 0 };
+  int status = 0;
+  if (argc > 2) {
+    int i;
+    for (i=2; i < argc && !status; ++i) {
+      status = answer_query(idx, doc, &results, fout, argv[i]);
+    }
+  } else {
+    // Queries may come from a long-running client, so a bad one is
+    // answered with -1 rather than ending the session
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t line_len;
+    while (!status && (line_len = getline(&line, &len, stdin)) != -1) {
+      while (line_len > 0 && (line[line_len-1] == '\n' || line[line_len-1] == '\r')) {
+        line[--line_len] = '\0';
+      }
+      status = answer_query(idx, doc, &results, fout, line);
+      if (status == 127) {
+        printf("-1\n");
+        status = fflush(stdout) ? 2 : 0;
+      }
+    }
+    free(line);
+  }
+  if (status == 127) {
+    usage(argv[0]);
+  } else if (status == 2) {
+    perror("Error writing output");
+  }
+
+  free(results.subs);
+  srt_index_free(idx);
+  srt_close(fout);
+  srt_document_free(doc);
+  srt_close(fin);
+  return status;
+}
@@ -23,67 +23,99 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "util/batch.h"
 #include "util/srt.h"
+#include "util/stats.h"
 #include "util/subtitles.h"
 
 void usage(char* executable_name) {
   printf("Usage: %s <input.srt> <output.srt>\n", executable_name);
-  printf("Changes the IDs in an SRT file to be numbers from 1 to the total number of subtitles in the file.\n");
+  batch_usage(executable_name, "");
+  printf("\nChanges the IDs in an SRT file to be numbers from 1 to the total number of subtitles in the file.\n");
+  stats_usage();
 }
 
-int main(int argc, char **argv) {
-
-  if (argc != 3) {
-    usage(argv[0]);
-    return 127;
-  }
-
-  char* fin_name = argv[1];
-  char* fout_name = argv[2];
-
-  // Make sure we have an input and output file
-  if (fin_name == NULL || fout_name == NULL) {
-    usage(argv[0]);
-    return 127;
-  }
+int renumber_file(char* fin_name, char* fout_name) {
+  /*
+   * Renumbers one file.  Returns the exit status for the program,
+   * having reported any error on stderr.
+   */
 
   // Open the input and output files
-  srt_file* fin = srt_open_read(fin_name);
+  srt_file* fin = batch_open_input(fin_name);
+  if (fin == NULL) {
+    // Not mappable (e.g. a pipe), so fall back to reading through stdio
+    fin = srt_open_read(fin_name);
+  }
   if (fin == NULL) {
     fprintf(stderr, "Error opening input file %s: %s\n", fin_name, strerror(errno));
     return 1;
   }
     
 
-  srt_file* fout = srt_open_write(fout_name);
+  srt_file* fout = batch_open_output(fout_name);
   if (fout == NULL) {
     fprintf(stderr, "Error opening output file %s: %s\n", fout_name, strerror(errno));
+    srt_close(fin);
     return 1;
   }
 
   
   sub_text sub;
-  sub.text = NULL;
-  sub.buf_len = 0;
-  int error = srt_read(fin, &sub);
+  int error = srt_read_ref(fin, &sub);
   fout->delimiter = fin->delimiter;
   int id = 1;
   while (!error) {
     sub.id = id++;
     if ((error = srt_write(fout, &sub))) break;
-    error = srt_read(fin, &sub);
+    error = srt_read_ref(fin, &sub);
+  }
+
+  if (error != SRT_EOF) {
+    fprintf(stderr, "Error at input line %u: %s\n", fin->line_no, srt_strerror(error));
   }
 
   srt_close(fin);
-  srt_close(fout);
-  if (sub.text != NULL) {
-    free(sub.text);
+  if (batch_close_output(fout)) {
+    fprintf(stderr, "Error writing to %s: %s\n", fout_name, srt_strerror(SRT_ERROR_WRITE));
+    return 2;
   }
 
   if (error != SRT_EOF) {
-    fprintf(stderr, "Error at input line %u: %s\n", fin->line_no, srt_strerror(error));
     return 2;
   }
 
   return 0;
 }
+
+
+int renumber_job(int argc, char **argv) {
+  /*
+   * Batch job: argv holds the input and the output.
+   */
+  if (argc != 2) {
+    fprintf(stderr, "%s: unexpected parameters\n", argv[0]);
+    return 127;
+  }
+  return renumber_file(argv[0], argv[1]);
+}
+
+
+int main(int argc, char **argv) {
+
+  stats_option(&argc, argv);
+  if (batch_requested(argc, argv)) {
+    int status = batch_main(argc, argv, renumber_job);
+    if (status == 127) {
+      usage(argv[0]);
+    }
+    return status;
+  }
+
+  if (argc != 3) {
+    usage(argv[0]);
+    return 127;
+  }
+
+  return renumber_file(argv[1], argv[2]);
+}
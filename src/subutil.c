@@ -0,0 +1,199 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/batch.h"
+#include "util/pipeline.h"
+#include "util/srt.h"
+#include "util/srt_document.h"
+#include "util/stats.h"
+
+void usage(char* executable_name) {
+  printf("Usage: %s [-j threads] <input.srt> <output.srt> stage [| stage ...]\n", executable_name);
+  batch_usage(executable_name, "[-j threads] stage [| stage ...]");
+  printf("\nApplies a chain of transformations to an SRT file, parsing and writing\n");
+  printf("it only once.  Each stage is applied to the output of the one before,\n");
+  printf("so e.g. the IDs given to interpolate are those after any renumbering.\n");
+  printf("The chain may be given as one quoted argument or as several.  Stages:\n");
+  printf("  offset [-t seconds] [-f factor]\n");
+  printf("             As srt_offset.\n");
+  printf("  interpolate [-a file] [id,time ...]\n");
+  printf("             As srt_interpolate.\n");
+  printf("  renumber   As srt_renumber.\n");
+  printf("The output keeps the newline style of the input.  Nothing is written\n");
+  printf("if the input can't be parsed or a stage fails.  - means stdin (or\n");
+  printf("stdout for the output).\n");
+  printf("  -j threads Parses the input on the given number of threads.\n");
+  printf("\nExample: %s in.srt out.srt 'offset -t 1.5 | interpolate 12,1:02.3 | renumber'\n",
+         executable_name);
+  stats_usage();
+}
+
+
+int transform_file(pipeline* p, int nr_threads, char* fin_name, char* fout_name) {
+  /*
+   * Reads one file into memory, applies the pipeline and writes the
+   * result.  Returns the exit status for the program, having reported
+   * any error on stderr.
+   */
+  srt_file* fin = batch_open_input(fin_name);
+  if (fin == NULL) {
+    // Not mappable (e.g. a pipe), so fall back to reading through stdio
+    fin = srt_open_read(strcmp(fin_name, "-") ? fin_name : "/dev/stdin");
+  }
+  if (fin == NULL) {
+    fprintf(stderr, "Error opening input file %s: %s\n", fin_name, strerror(errno));
+    return 1;
+  }
+
+  srt_document* doc = srt_document_alloc(0, 0);
+  if (doc == NULL) {
+    fprintf(stderr, "OOM\n");
+    srt_close(fin);
+    return 1;
+  }
+
+  int error;
+  if (nr_threads > 1) {
+    error = srt_document_read_parallel(fin, doc, nr_threads);
+  } else {
+    error = srt_document_read(fin, doc);
+  }
+  if (error) {
+    fprintf(stderr, "Error at input line %u of %s: %s\n", fin->line_no, fin_name, srt_strerror(error));
+    srt_document_free(doc);
+    srt_close(fin);
+    return 2;
+  }
+
+  srt_close(fin);
+
+  if ((error = pipeline_apply(p, doc))) {
+    if (error == PIPELINE_ERROR_POINT) {
+      fprintf(stderr, "Error: no subtitle with ID %u in %s\n", p->missing_id, fin_name);
+    } else if (error == PIPELINE_ERROR_POINT_ORDER) {
+      fprintf(stderr, "Error: subtitle %u starts too early in %s; points must start in order of ID\n",
+              p->missing_id, fin_name);
+    } else {
+      fprintf(stderr, "Error in %s: %s\n", fin_name, pipeline_strerror(error));
+    }
+    srt_document_free(doc);
+    return 2;
+  }
+
+  srt_file* fout = batch_open_output(strcmp(fout_name, "-") ? fout_name : "/dev/stdout");
+  if (fout == NULL) {
+    fprintf(stderr, "Error opening output file %s: %s\n", fout_name, strerror(errno));
+    srt_document_free(doc);
+    return 1;
+  }
+  fout->delimiter = doc->delimiter;
+
+  error = srt_document_write(fout, doc);
+  if (batch_close_output(fout) && !error) {
+    error = SRT_ERROR_WRITE;
+  }
+  srt_document_free(doc);
+  if (error) {
+    fprintf(stderr, "Error writing to %s: %s\n", fout_name, srt_strerror(error));
+    return 2;
+  }
+
+  return 0;
+}
+
+
+int parse_threads(int* argc, char*** argv, int* nr_threads) {
+  /*
+   * Takes a leading -j threads off the arguments.  Returns 0 on
+   * success or 127 if it is invalid.
+   */
+  *nr_threads = 0;
+  if (*argc > 0 && !strcmp((*argv)[0], "-j")) {
+    if (*argc < 2 || sscanf((*argv)[1], "%d", nr_threads) != 1 || *nr_threads < 1) {
+      return 127;
+    }
+    *argc -= 2;
+    *argv += 2;
+  }
+  return 0;
+}
+
+
+int transform_job(int argc, char **argv) {
+  /*
+   * Batch job: argv holds the input, the output and then the chain.
+   */
+  int nr_args = argc-2;
+  char** args = argv+2;
+  int nr_threads;
+  pipeline p;
+  int status = parse_threads(&nr_args, &args, &nr_threads);
+  if (!status) {
+    status = pipeline_parse(nr_args, args, &p);
+  }
+  if (status) {
+    if (status == 127) {
+      fprintf(stderr, "%s: invalid stages\n", argv[0]);
+    }
+    return status;
+  }
+  status = transform_file(&p, nr_threads, argv[0], argv[1]);
+  pipeline_free(&p);
+  return status;
+}
+
+
+int main(int argc, char **argv) {
+
+  stats_option(&argc, argv);
+  if (batch_requested(argc, argv)) {
+    int status = batch_main(argc, argv, transform_job);
+    if (status == 127) {
+      usage(argv[0]);
+    }
+    return status;
+  }
+
+  int nr_args = argc-1;
+  char** args = argv+1;
+  int nr_threads;
+  if (parse_threads(&nr_args, &args, &nr_threads) || nr_args < 3) {
+    usage(argv[0]);
+    return 127;
+  }
+
+  pipeline p;
+  int status = pipeline_parse(nr_args-2, args+2, &p);
+  if (status) {
+    if (status == 127) {
+      usage(argv[0]);
+    }
+    return status;
+  }
+
+  status = transform_file(&p, nr_threads, args[0], args[1]);
+  pipeline_free(&p);
+  return status;
+}
@@ -0,0 +1,850 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util/pgs.h"
+#include "util/pgs_image.h"
+#include "util/retime.h"
+#include "util/srt.h"
+#include "util/srt_binary.h"
+#include "util/srt_document.h"
+#include "util/utf.h"
+#include "util/subtitles.h"
+
+/*
+ * Throughput benchmarks for the SRT reader and writer and the PGS
+ * segment reader.  Synthetic files are generated in a scratch
+ * directory, each benchmark is run several times over them and the
+ * best time is reported, as one JSON object per line so that results
+ * from different commits can be collected in one file and compared.
+ * Files are read from the page cache, so the figures measure parsing
+ * and formatting rather than the disk.
+ */
+
+typedef struct {
+  char* name;
+  char* delimiter;
+  // Lines per cue, and the range of line lengths
+  int min_lines, max_lines;
+  int min_width, max_width;
+} srt_corpus;
+
+static srt_corpus srt_corpora[] = {
+  { "lf_short",   "\n",   1, 1, 12, 40 },
+  { "crlf_short", "\r\n", 1, 1, 12, 40 },
+  { "lf_long",    "\n",   2, 4, 40, 120 },
+  { "crlf_long",  "\r\n", 2, 4, 40, 120 },
+};
+
+typedef struct {
+  char* name;
+  // Range of object data in each display set; large objects are split
+  // into several picture segments
+  int min_object, max_object;
+} pgs_corpus;
+
+static pgs_corpus pgs_corpora[] = {
+  { "small_objects", 200, 4000 },
+  { "large_objects", 40000, 300000 },
+};
+
+// The bitmap decoded by the PGS decoding benchmark: a full HD frame
+// with a band of text-like runs near the bottom
+#define BENCH_BITMAP_WIDTH 1920
+#define BENCH_BITMAP_HEIGHT 1080
+
+typedef struct {
+  char* dir;
+  char* commit;
+  int repeats;
+  int keep;
+} bench_options;
+
+static uint32_t rand_state;
+
+static uint32_t bench_rand(void) {
+  // xorshift32; the corpora only need to be repeatable, not random
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state;
+}
+
+static int bench_range(int min, int max) {
+  return min + bench_rand() % (max - min + 1);
+}
+
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static size_t parse_size(char* s) {
+  /*
+   * Parses a size such as 64k, 4M or 1G.  Returns 0 if it isn't one.
+   */
+  char* end;
+  unsigned long long n = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'k': case 'K': n <<= 10; ++end; break;
+  case 'm': case 'M': n <<= 20; ++end; break;
+  case 'g': case 'G': n <<= 30; ++end; break;
+  }
+  if (*end != '\0' || end == s) {
+    return 0;
+  }
+  return n;
+}
+
+
+static size_t generate_srt(char* name, srt_corpus* corpus, size_t size) {
+  /*
+   * Writes a file of about size bytes of the given shape.  Returns
+   * the number of cues, or 0 on error.
+   */
+  FILE* f = fopen(name, "wb");
+  if (f == NULL) {
+    return 0;
+  }
+  char* nl = corpus->delimiter;
+  char line[256];
+  unsigned long t = 1000;
+  size_t written = 0;
+  size_t cues = 0;
+  rand_state = 2463534242u;
+  while (written < size) {
+    unsigned long start = t + bench_range(0, 3000);
+    unsigned long end = start + bench_range(500, 6000);
+    // Start again rather than overflow the two digits of hours
+    t = (end < 99*3600000UL) ? end : 1000;
+    int n = fprintf(f, "%zu%s%02lu:%02lu:%02lu,%03lu --> %02lu:%02lu:%02lu,%03lu%s",
+                    ++cues, nl,
+                    start / 3600000, start / 60000 % 60, start / 1000 % 60, start % 1000,
+                    end / 3600000, end / 60000 % 60, end / 1000 % 60, end % 1000, nl);
+    int nr_lines = bench_range(corpus->min_lines, corpus->max_lines);
+    int i, j;
+    for (i = 0; i < nr_lines; i++) {
+      int width = bench_range(corpus->min_width, corpus->max_width);
+      for (j = 0; j < width; j++) {
+        // Mostly lower case words, with the odd space
+        line[j] = (bench_rand() % 6) ? 'a' + bench_rand() % 26 : ' ';
+      }
+      line[0] = 'A' + bench_rand() % 26;
+      line[width] = '\0';
+      n += fprintf(f, "%s%s", line, nl);
+    }
+    n += fprintf(f, "%s", nl);
+    written += n;
+  }
+  if (fclose(f)) {
+    return 0;
+  }
+  return cues;
+}
+
+
+static void put_segment(FILE* f, int type, uint8_t* payload, int length) {
+  uint8_t header[3] = { type, length >> 8, length & 0xff };
+  fwrite(header, 1, 3, f);
+  fwrite(payload, 1, length, f);
+}
+
+
+static size_t generate_pgs(char* name, pgs_corpus* corpus, size_t size) {
+  /*
+   * Writes a stream of about size bytes made of complete display sets:
+   * presentation, window, palette, picture and display segments.
+   * Returns the number of segments, or 0 on error.
+   */
+  FILE* f = fopen(name, "wb");
+  if (f == NULL) {
+    return 0;
+  }
+  uint8_t* payload = malloc(65535);
+  if (payload == NULL) {
+    fclose(f);
+    return 0;
+  }
+  size_t written = 0;
+  size_t segments = 0;
+  rand_state = 88172645u;
+  int i;
+  for (i = 0; i < 65535; i++) {
+    payload[i] = bench_rand();
+  }
+  while (written < size) {
+    int nr_objects = bench_range(1, 2);
+    payload[10] = nr_objects;
+    for (i = 0; i < nr_objects; i++) {
+      payload[11 + 8*i + 3] = (bench_rand() % 4) ? 0 : 0x40;
+    }
+    put_segment(f, PRESENTATION_SEGMENT, payload, 11 + 8*nr_objects);
+    put_segment(f, WINDOW_SEGMENT, payload, 1 + 9*nr_objects);
+    int palette_length = 2 + 5*bench_range(2, 255);
+    put_segment(f, PALETTE_SEGMENT, payload, palette_length);
+    written += 3*3 + 11 + 8*nr_objects + 1 + 9*nr_objects + palette_length;
+    segments += 3;
+    for (i = 0; i < nr_objects; i++) {
+      int remaining = bench_range(corpus->min_object, corpus->max_object);
+      while (remaining > 0) {
+        int length = (remaining > 65535) ? 65535 : remaining;
+        put_segment(f, PICTURE_SEGMENT, payload, length);
+        written += 3 + length;
+        remaining -= length;
+        ++segments;
+      }
+    }
+    put_segment(f, DISPLAY_SEGMENT, payload, 0);
+    written += 3;
+    ++segments;
+  }
+  free(payload);
+  if (fclose(f)) {
+    return 0;
+  }
+  return segments;
+}
+
+
+static void report(bench_options* opts, char* bench, char* corpus, size_t bytes,
+                   char* unit, size_t count, double seconds) {
+  printf("{\"commit\":\"%s\",\"time\":%ld,\"bench\":\"%s\",\"corpus\":\"%s\","
+         "\"bytes\":%zu,\"%s\":%zu,\"seconds\":%.6f,\"mb_per_s\":%.1f,\"%s_per_s\":%.0f}\n",
+         opts->commit, (long)time(NULL), bench, corpus, bytes, unit, count, seconds,
+         bytes / seconds / 1e6, unit, count / seconds);
+  fflush(stdout);
+}
+
+
+static void report_pixels(bench_options* opts, char* bench, char* corpus, size_t bytes,
+                          size_t pixels, double seconds) {
+  printf("{\"commit\":\"%s\",\"time\":%ld,\"bench\":\"%s\",\"corpus\":\"%s\","
+         "\"bytes\":%zu,\"pixels\":%zu,\"seconds\":%.6f,\"mb_per_s\":%.1f,\"megapixels_per_s\":%.1f}\n",
+         opts->commit, (long)time(NULL), bench, corpus, bytes, pixels, seconds,
+         bytes / seconds / 1e6, pixels / seconds / 1e6);
+  fflush(stdout);
+}
+
+
+static int bench_srt_read(char* name, int use_mmap, size_t* cues) {
+  /*
+   * Reads every cue of a file: through stdio and srt_read, or mapped
+   * and srt_read_ref.  Returns non-zero on error.
+   */
+  srt_file* fin = use_mmap ? srt_open_mmap(name) : srt_open_read(name);
+  if (fin == NULL) {
+    return 1;
+  }
+  sub_text sub;
+  sub.text = NULL;
+  sub.buf_len = 0;
+  int error;
+  *cues = 0;
+  while (!(error = use_mmap ? srt_read_ref(fin, &sub) : srt_read(fin, &sub))) {
+    ++*cues;
+  }
+  if (!use_mmap) {
+    free(sub.text);
+  }
+  srt_close(fin);
+  return error != SRT_EOF;
+}
+
+
+static void* counting_realloc(void* ctx, void* ptr, size_t old_size, size_t new_size) {
+  ++*(size_t*) ctx;
+  return realloc(ptr, new_size);
+}
+
+
+static void counting_free(void* ctx, void* ptr, size_t size) {
+  free(ptr);
+}
+
+
+static int check_srt_read_allocations(char* name) {
+  /*
+   * Reads a file twice with srt_read into the same subtitle, counting
+   * allocations: the first pass should need only a handful as the
+   * buffers grow, and the second none at all.  Returns non-zero if
+   * not.
+   */
+  srt_file* fin = srt_open_read(name);
+  if (fin == NULL) {
+    return 1;
+  }
+  size_t allocations = 0;
+  srt_allocator alloc = { counting_realloc, counting_free, &allocations };
+  srt_set_allocator(fin, &alloc);
+  sub_text sub;
+  sub.text = NULL;
+  sub.buf_len = 0;
+
+  size_t warm_up = 0;
+  int error = 0;
+  int pass;
+  for (pass = 0; pass < 2 && !error; pass++) {
+    int ret;
+    while (!(ret = srt_read(fin, &sub)));
+    error = (ret != SRT_EOF) || srt_seek_beginning(fin);
+    if (pass == 0) {
+      warm_up = allocations;
+    }
+  }
+  srt_free_text(fin, &sub);
+  srt_close(fin);
+
+  if (!error && (warm_up > 16 || allocations != warm_up)) {
+    fprintf(stderr, "srt_read made %zu allocations warming up and %zu after\n",
+            warm_up, allocations - warm_up);
+    error = 1;
+  }
+  return error;
+}
+
+
+static int bench_srt_write(srt_document* doc, char* out_name) {
+  srt_file* fout = srt_open_write(out_name);
+  if (fout == NULL) {
+    return 1;
+  }
+  fout->delimiter = doc->delimiter;
+  int error = srt_document_write(fout, doc);
+  return srt_close(fout) || error;
+}
+
+
+static int bench_srt_round_trip(char* name, char* out_name, size_t* cues) {
+  /*
+   * The tools' usual loop: mapped input copied cue by cue to the output.
+   */
+  srt_file* fin = srt_open_mmap(name);
+  if (fin == NULL) {
+    return 1;
+  }
+  srt_file* fout = srt_open_write(out_name);
+  if (fout == NULL) {
+    srt_close(fin);
+    return 1;
+  }
+  sub_text sub;
+  int error = srt_read_ref(fin, &sub);
+  fout->delimiter = fin->delimiter;
+  *cues = 0;
+  while (!error) {
+    ++*cues;
+    if ((error = srt_write(fout, &sub))) break;
+    error = srt_read_ref(fin, &sub);
+  }
+  srt_close(fin);
+  return srt_close(fout) || error != SRT_EOF;
+}
+
+
+static int bench_srt_binary_load(char* bin_name, size_t* cues) {
+  /*
+   * Maps a compiled file and fetches every cue, touching its text.
+   */
+  srt_binary* bin = srt_binary_open(bin_name);
+  if (bin == NULL) {
+    return 1;
+  }
+  sub_text sub;
+  int error = 0;
+  unsigned int check = 0;
+  size_t i;
+  for (i=0; i < bin->nr_subs && !error; ++i) {
+    error = srt_binary_get(bin, i, &sub);
+    if (sub.len > 0) check += sub.text[0];
+  }
+  *cues = bin->nr_subs;
+  srt_binary_close(bin);
+  return error || check == 0;
+}
+
+
+static char* read_whole_file(char* name, size_t* len) {
+  FILE* f = fopen(name, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  rewind(f);
+  char* data = malloc(*len + 1);
+  if (data != NULL && fread(data, 1, *len, f) != *len) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+
+static int bench_srt_encoding(bench_options* opts, char* name, double* best_validate,
+                              double* best_transcode) {
+  /*
+   * Times UTF-8 validation of a file, and transcoding a UTF-16LE copy
+   * of it back to UTF-8, checking that the results are right.
+   */
+  size_t len = 0;
+  char* data = read_whole_file(name, &len);
+  char* utf16 = malloc(2*len + 1);
+  char* utf8 = malloc(UTF16_MAX_UTF8_LEN(2*len));
+  int error = (data == NULL || utf16 == NULL || utf8 == NULL);
+  size_t i;
+  for (i=0; i < len && !error; ++i) {
+    // The corpus is ASCII, so each byte becomes one code unit
+    utf16[2*i] = data[i];
+    utf16[2*i+1] = 0;
+  }
+
+  int r;
+  for (r = 0; r < opts->repeats && !error; r++) {
+    double t = bench_now();
+    error |= utf8_validate(data, len) != len;
+    t = bench_now() - t;
+    if (r == 0 || t < *best_validate) *best_validate = t;
+
+    t = bench_now();
+    size_t out_len = utf16_to_utf8(utf16, 2*len, 0, utf8);
+    t = bench_now() - t;
+    error |= out_len != len || memcmp(utf8, data, len);
+    if (r == 0 || t < *best_transcode) *best_transcode = t;
+  }
+  free(data);
+  free(utf16);
+  free(utf8);
+  return error;
+}
+
+
+static int bench_pgs_scan(char* name, size_t* segments) {
+  /*
+   * Reads every segment of a stream, parsing presentation segments as
+   * forced_unforced does.
+   */
+  pgs_reader* r = pgs_open(name);
+  if (r == NULL) {
+    return 1;
+  }
+  pgs_segment seg;
+  pgs_presentation pres;
+  int error;
+  *segments = 0;
+  while (!(error = pgs_next(r, &seg))) {
+    if (seg.type == PRESENTATION_SEGMENT && pgs_parse_presentation(&seg, &pres)) {
+      error = PGS_ERROR_PRESENTATION;
+      break;
+    }
+    ++*segments;
+  }
+  pgs_close(r);
+  return error != PGS_EOF;
+}
+
+
+static int run_srt(bench_options* opts, srt_corpus* corpus, size_t size) {
+  char name[4096], out_name[4096], bin_name[4096], label[64];
+  snprintf(name, sizeof(name), "%s/subutil_bench_%s_%zu.srt", opts->dir, corpus->name, size);
+  snprintf(out_name, sizeof(out_name), "%s/subutil_bench_out.srt", opts->dir);
+  snprintf(bin_name, sizeof(bin_name), "%s/subutil_bench_out.srtb", opts->dir);
+  snprintf(label, sizeof(label), "%s_%zu", corpus->name, size);
+
+  size_t cues = generate_srt(name, corpus, size);
+  if (cues == 0) {
+    fprintf(stderr, "Error generating %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  FILE* f = fopen(name, "rb");
+  fseek(f, 0, SEEK_END);
+  size_t bytes = ftell(f);
+  fclose(f);
+
+  double best_stdio = 0, best_mmap = 0, best_write = 0, best_round_trip = 0;
+  int error = check_srt_read_allocations(name);
+  int i;
+  for (i = 0; i < opts->repeats && !error; i++) {
+    size_t n;
+    double t = bench_now();
+    error |= bench_srt_read(name, 0, &n) || n != cues;
+    t = bench_now() - t;
+    if (i == 0 || t < best_stdio) best_stdio = t;
+
+    t = bench_now();
+    error |= bench_srt_read(name, 1, &n) || n != cues;
+    t = bench_now() - t;
+    if (i == 0 || t < best_mmap) best_mmap = t;
+
+    t = bench_now();
+    error |= bench_srt_round_trip(name, out_name, &n) || n != cues;
+    t = bench_now() - t;
+    if (i == 0 || t < best_round_trip) best_round_trip = t;
+  }
+
+  // Writing is timed separately from reading, from a document already
+  // in memory
+  srt_document* doc = srt_document_alloc(0, 0);
+  srt_file* fin = srt_open_mmap(name);
+  if (doc == NULL || fin == NULL || srt_document_read(fin, doc)) {
+    error = 1;
+  }
+  if (fin != NULL) {
+    srt_close(fin);
+  }
+  for (i = 0; i < opts->repeats && !error; i++) {
+    double t = bench_now();
+    error |= bench_srt_write(doc, out_name);
+    t = bench_now() - t;
+    if (i == 0 || t < best_write) best_write = t;
+  }
+
+  double best_validate = 0, best_transcode = 0;
+  if (!error) {
+    error = bench_srt_encoding(opts, name, &best_validate, &best_transcode);
+  }
+
+  // Loading a compiled copy, against reading the SRT itself
+  double best_binary_load = 0;
+  if (!error && srt_binary_write(doc, bin_name)) {
+    error = 1;
+  }
+  for (i = 0; i < opts->repeats && !error; i++) {
+    size_t n;
+    double t = bench_now();
+    error |= bench_srt_binary_load(bin_name, &n) || n != cues;
+    t = bench_now() - t;
+    if (i == 0 || t < best_binary_load) best_binary_load = t;
+  }
+
+  // The timestamp kernels on their own, there and back again so that
+  // the times stay the same; only the 16 bytes of times per subtitle
+  // are counted
+  double best_translate = 0, best_scale = 0;
+  for (i = 0; i < opts->repeats && !error; i++) {
+    double t = bench_now();
+    retime_map(doc->starts, doc->ends, doc->nr_subs, 0, 1500);
+    retime_map(doc->starts, doc->ends, doc->nr_subs, 0, -1500);
+    t = (bench_now() - t) / 2;
+    if (i == 0 || t < best_translate) best_translate = t;
+
+    t = bench_now();
+    retime_map(doc->starts, doc->ends, doc->nr_subs, 1000, 1500);
+    retime_map(doc->starts, doc->ends, doc->nr_subs, -1000, -1500);
+    t = (bench_now() - t) / 2;
+    if (i == 0 || t < best_scale) best_scale = t;
+  }
+  if (doc != NULL) {
+    srt_document_free(doc);
+  }
+
+  if (!opts->keep) {
+    remove(name);
+  }
+  remove(out_name);
+  remove(bin_name);
+  if (error) {
+    fprintf(stderr, "Error benchmarking %s\n", name);
+    return 1;
+  }
+
+  report(opts, "srt_read", label, bytes, "cues", cues, best_stdio);
+  report(opts, "srt_read_mmap", label, bytes, "cues", cues, best_mmap);
+  report(opts, "srt_write", label, bytes, "cues", cues, best_write);
+  report(opts, "srt_round_trip", label, bytes, "cues", cues, best_round_trip);
+  report(opts, "srt_binary_load", label, bytes, "cues", cues, best_binary_load);
+  report(opts, "utf8_validate", label, bytes, "cues", cues, best_validate);
+  report(opts, "utf16_transcode", label, 2 * bytes, "cues", cues, best_transcode);
+  report(opts, "retime_translate", label, 16 * cues, "cues", cues, best_translate);
+  report(opts, "retime_scale", label, 16 * cues, "cues", cues, best_scale);
+  return 0;
+}
+
+
+// Threads for the parallel PGS scan
+#define BENCH_PGS_THREADS 4
+
+static int bench_pgs_count(void* ctx, pgs_segment* seg) {
+  pgs_presentation pres;
+  if (seg->type == PRESENTATION_SEGMENT && pgs_parse_presentation(seg, &pres)) {
+    return 1;
+  }
+  ++*(size_t*)ctx;
+  return 0;
+}
+
+
+static int bench_pgs_scan_parallel(char* name, size_t* segments) {
+  /*
+   * Scans a stream on several threads, counting its segments as
+   * bench_pgs_scan does.
+   */
+  size_t counts[BENCH_PGS_THREADS] = { 0 };
+  void* ctxs[BENCH_PGS_THREADS];
+  int i;
+  for (i = 0; i < BENCH_PGS_THREADS; i++) {
+    ctxs[i] = &counts[i];
+  }
+  int nr_ranges;
+  pgs_segment bad;
+  int error = pgs_scan_parallel(name, BENCH_PGS_THREADS, bench_pgs_count, ctxs, &nr_ranges, &bad);
+  *segments = 0;
+  for (i = 0; i < nr_ranges; i++) {
+    *segments += counts[i];
+  }
+  return error;
+}
+
+
+static uint8_t* put_run(uint8_t* p, int color, int run) {
+  /*
+   * Encodes a run of pixels in the PGS run-length code.
+   */
+  while (run > 0) {
+    int n = (run > 16383) ? 16383 : run;
+    run -= n;
+    if (color != 0 && n <= 2) {
+      while (n--) *p++ = color;
+      continue;
+    }
+    *p++ = 0;
+    *p++ = ((color != 0) ? 0x80 : 0) | ((n >= 64) ? 0x40 | (n >> 8) : n);
+    if (n >= 64) *p++ = n & 0xff;
+    if (color != 0) *p++ = color;
+  }
+  return p;
+}
+
+
+static int run_pgs_decode(bench_options* opts) {
+  /*
+   * Decodes a frame-sized object to RGBA through a converted palette,
+   * checking the pixels against the bitmap that was encoded.
+   */
+  int width = BENCH_BITMAP_WIDTH, height = BENCH_BITMAP_HEIGHT;
+  size_t pixels = (size_t)width * height;
+  uint8_t* bitmap = malloc(pixels);
+  uint8_t* decoded = malloc(pixels);
+  uint32_t* rgba = malloc(pixels * sizeof(uint32_t));
+  uint8_t* segment = malloc(11 + 4 * pixels);
+  if (bitmap == NULL || decoded == NULL || rgba == NULL || segment == NULL) {
+    free(bitmap);
+    free(decoded);
+    free(rgba);
+    free(segment);
+    return 1;
+  }
+
+  // Outlined text in the bottom fifth, transparent elsewhere
+  rand_state = 88172645u;
+  int x, y;
+  for (y = 0; y < height; y++) {
+    uint8_t* row = bitmap + (size_t)y * width;
+    x = 0;
+    while (x < width) {
+      int run = (y < height * 4 / 5) ? width : bench_range(1, 12);
+      int color = (y < height * 4 / 5) ? 0 : bench_range(0, 3);
+      if (run > width - x) run = width - x;
+      memset(row + x, color, run);
+      x += run;
+    }
+  }
+
+  // One picture segment holding the whole object, as pgs_object_add
+  // would have assembled it
+  uint8_t* p = segment + 11;
+  for (y = 0; y < height; y++) {
+    uint8_t* row = bitmap + (size_t)y * width;
+    for (x = 0; x < width; ) {
+      int run = 1;
+      while (x + run < width && row[x + run] == row[x]) run++;
+      p = put_run(p, row[x], run);
+      x += run;
+    }
+    *p++ = 0;
+    *p++ = 0;
+  }
+  pgs_object obj;
+  pgs_object_init(&obj);
+  obj.width = width;
+  obj.height = height;
+  obj.data = segment + 11;
+  obj.len = p - obj.data;
+  obj.complete = 1;
+
+  // A palette converted eight entries at a time must match one
+  // converted an entry at a time
+  uint8_t ycbcra[4][256];
+  int i;
+  for (i = 0; i < 256; i++) {
+    ycbcra[0][i] = bench_rand();
+    ycbcra[1][i] = bench_rand();
+    ycbcra[2][i] = bench_rand();
+    ycbcra[3][i] = bench_rand();
+  }
+  pgs_palette pal;
+  pgs_palette_init(&pal);
+  pgs_ycbcr_to_rgba(ycbcra[0], ycbcra[1], ycbcra[2], ycbcra[3], 256, pal.rgba);
+  int error = 0;
+  for (i = 0; i < 256; i++) {
+    uint32_t one;
+    pgs_ycbcr_to_rgba(ycbcra[0] + i, ycbcra[1] + i, ycbcra[2] + i, ycbcra[3] + i, 1, &one);
+    error |= one != pal.rgba[i];
+  }
+
+  error |= pgs_object_decode_indices(&obj, decoded, width) || memcmp(decoded, bitmap, pixels);
+  double best = 0;
+  int r;
+  for (r = 0; r < opts->repeats && !error; r++) {
+    double t = bench_now();
+    error |= pgs_object_decode(&obj, &pal, rgba, width);
+    t = bench_now() - t;
+    if (r == 0 || t < best) best = t;
+  }
+  for (i = 0; i < (int)pixels && !error; i++) {
+    error |= rgba[i] != pal.rgba[bitmap[i]];
+  }
+
+  if (!error) {
+    char label[64];
+    snprintf(label, sizeof(label), "%dx%d", width, height);
+    report_pixels(opts, "pgs_decode", label, obj.len, pixels, best);
+  } else {
+    fprintf(stderr, "Error benchmarking PGS decoding\n");
+  }
+  free(bitmap);
+  free(decoded);
+  free(rgba);
+  free(segment);
+  return error;
+}
+
+
+static int run_pgs(bench_options* opts, pgs_corpus* corpus, size_t size) {
+  char name[4096], label[64];
+  snprintf(name, sizeof(name), "%s/subutil_bench_%s_%zu.pgs", opts->dir, corpus->name, size);
+  snprintf(label, sizeof(label), "%s_%zu", corpus->name, size);
+
+  size_t segments = generate_pgs(name, corpus, size);
+  if (segments == 0) {
+    fprintf(stderr, "Error generating %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  FILE* f = fopen(name, "rb");
+  fseek(f, 0, SEEK_END);
+  size_t bytes = ftell(f);
+  fclose(f);
+
+  double best = 0, best_parallel = 0;
+  int error = 0;
+  int i;
+  for (i = 0; i < opts->repeats && !error; i++) {
+    size_t n;
+    double t = bench_now();
+    error |= bench_pgs_scan(name, &n) || n != segments;
+    t = bench_now() - t;
+    if (i == 0 || t < best) best = t;
+
+    t = bench_now();
+    error |= bench_pgs_scan_parallel(name, &n) || n != segments;
+    t = bench_now() - t;
+    if (i == 0 || t < best_parallel) best_parallel = t;
+  }
+
+  if (!opts->keep) {
+    remove(name);
+  }
+  if (error) {
+    fprintf(stderr, "Error benchmarking %s\n", name);
+    return 1;
+  }
+
+  report(opts, "pgs_scan", label, bytes, "segments", segments, best);
+  report(opts, "pgs_scan_parallel", label, bytes, "segments", segments, best_parallel);
+  return 0;
+}
+
+
+void usage(char* executable_name) {
+  printf("Usage: %s [-d dir] [-r repeats] [-c commit] [-k] <size> [size ...]\n", executable_name);
+  printf("\nGenerates synthetic SRT files (LF and CRLF, short and long cues) and PGS\n");
+  printf("streams of each size (e.g. 64k, 4M, 1G) in dir (default /tmp), and reports\n");
+  printf("the best of repeats (default 3) runs of reading, writing, round tripping,\n");
+  printf("retiming and scanning them, one JSON object per line, then decodes a\n");
+  printf("frame-sized PGS bitmap.  commit labels the results; -k keeps the generated\n");
+  printf("files.\n");
+}
+
+
+int main(int argc, char** argv) {
+
+  bench_options opts = { "/tmp", "", 3, 0 };
+
+  int i;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp(argv[i], "-k")) {
+      opts.keep = 1;
+    } else if (i + 1 < argc && !strcmp(argv[i], "-d")) {
+      opts.dir = argv[++i];
+    } else if (i + 1 < argc && !strcmp(argv[i], "-c")) {
+      opts.commit = argv[++i];
+    } else if (i + 1 < argc && !strcmp(argv[i], "-r") && atoi(argv[i+1]) > 0) {
+      opts.repeats = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 127;
+    }
+  }
+  if (i == argc) {
+    usage(argv[0]);
+    return 127;
+  }
+
+  int failed = 0;
+  for (; i < argc; i++) {
+    size_t size = parse_size(argv[i]);
+    if (size == 0) {
+      usage(argv[0]);
+      return 127;
+    }
+    size_t j;
+    for (j = 0; j < sizeof(srt_corpora) / sizeof(srt_corpora[0]); j++) {
+      failed |= run_srt(&opts, &srt_corpora[j], size);
+    }
+    for (j = 0; j < sizeof(pgs_corpora) / sizeof(pgs_corpora[0]); j++) {
+      failed |= run_pgs(&opts, &pgs_corpora[j], size);
+    }
+  }
+  failed |= run_pgs_decode(&opts);
+
+  return failed ? 2 : 0;
+}
@@ -0,0 +1,626 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "aio.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define AIO_HAVE_URING
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// The most threads the thread pool backend starts
+#define AIO_MAX_THREADS 64
+
+// One request, allocated together with its file name
+typedef struct aio_op {
+  aio_type type;
+  void* tag;
+  int fd;
+  char* filename;
+
+  // The data read or to be written, its length and how much of it has
+  // been done so far
+  char* data;
+  size_t len;
+  size_t done;
+
+  // Set once the request has finished, successfully or not
+  int finished;
+  int error;
+
+  struct iovec iov;
+
+  // The next request in a thread pool queue
+  struct aio_op* next;
+} aio_op;
+
+struct aio_engine {
+  aio_backend backend;
+
+  // Serialises submissions, and for the thread pool protects the queues
+  pthread_mutex_t lock;
+
+#ifdef AIO_HAVE_URING
+  // The ring and its mappings
+  int ring_fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_map;
+  size_t sq_map_len;
+  void* cq_map;
+  size_t cq_map_len;
+  size_t sqes_len;
+#endif
+
+  // For the thread pool, requests waiting to be worked on and those
+  // finished but not collected, signalled by work_cond and done_cond
+  aio_op* work_head;
+  aio_op* work_tail;
+  aio_op* done_head;
+  aio_op* done_tail;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  pthread_t* threads;
+  int nr_threads;
+  int stopping;
+};
+
+
+static aio_op* aio_new_op(aio_type type, char* filename, void* tag) {
+  size_t name_len = filename ? strlen(filename) + 1 : 0;
+  aio_op* op = malloc(sizeof(aio_op) + name_len);
+  if (op == NULL) {
+    return NULL;
+  }
+  memset(op, 0, sizeof(aio_op));
+  op->type = type;
+  op->tag = tag;
+  op->fd = -1;
+  if (filename != NULL) {
+    op->filename = (char*) (op + 1);
+    memcpy(op->filename, filename, name_len);
+  }
+  return op;
+}
+
+
+static void aio_fail(aio_op* op, int error) {
+  op->error = error;
+  op->finished = 1;
+}
+
+
+static int aio_open_file(aio_op* op) {
+  /*
+   * Opens the file for a request and, for a read, allocates room for
+   * the whole file.  Returns 0 if there is I/O to be done, or non-zero
+   * if the request has already finished.
+   */
+  if (op->type == AIO_READ) {
+    op->fd = open(op->filename, O_RDONLY);
+    struct stat st;
+    if (op->fd < 0 || fstat(op->fd, &st)) {
+      aio_fail(op, errno);
+      return 1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      // Pipes and the like are left to be read by the caller
+      aio_fail(op, ENODEV);
+      return 1;
+    }
+    op->len = st.st_size;
+    if (op->len > 0 && (op->data = malloc(op->len)) == NULL) {
+      aio_fail(op, ENOMEM);
+      return 1;
+    }
+  } else if (op->type == AIO_WRITE) {
+    op->fd = open(op->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (op->fd < 0) {
+      aio_fail(op, errno);
+      return 1;
+    }
+  }
+  if (op->type == AIO_POST || op->done == op->len) {
+    op->finished = 1;
+    return 1;
+  }
+  return 0;
+}
+
+
+static void aio_progress(aio_op* op, ssize_t res) {
+  /*
+   * Accounts for the result of one read or write, finishing the
+   * request if it is complete or has failed.
+   */
+  if (res < 0) {
+    if (res != -EINTR && res != -EAGAIN) {
+      aio_fail(op, -res);
+    }
+  } else if (res == 0) {
+    if (op->type == AIO_READ) {
+      // The file has shrunk since it was opened
+      op->len = op->done;
+      op->finished = 1;
+    } else {
+      aio_fail(op, EIO);
+    }
+  } else {
+    op->done += res;
+    op->finished = (op->done == op->len);
+    STATS_ADD(op->type == AIO_READ ? STATS_BYTES_READ : STATS_BYTES_WRITTEN, res);
+  }
+}
+
+
+static void aio_complete(aio_op* op, aio_result* result) {
+  /*
+   * Fills in the result of a finished request and frees it.
+   */
+  if (op->fd >= 0 && close(op->fd) && !op->error && op->type == AIO_WRITE) {
+    op->error = errno;
+  }
+  result->type = op->type;
+  result->tag = op->tag;
+  result->error = op->error;
+  result->data = NULL;
+  result->len = 0;
+  if (op->type == AIO_READ && !op->error) {
+    result->data = op->data;
+    result->len = op->len;
+  } else {
+    free(op->data);
+  }
+  free(op);
+}
+
+
+#ifdef AIO_HAVE_URING
+
+static int aio_uring_setup(aio_engine* e, int depth) {
+  /*
+   * Creates the ring and maps its queues.  Returns 0 on success or
+   * non-zero if io_uring is not available.
+   */
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  e->ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+  if (e->ring_fd < 0) {
+    return 1;
+  }
+
+  e->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  e->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (e->cq_map_len > e->sq_map_len) e->sq_map_len = e->cq_map_len;
+    e->cq_map_len = e->sq_map_len;
+  }
+  e->sq_map = mmap(NULL, e->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   e->ring_fd, IORING_OFF_SQ_RING);
+  if (e->sq_map == MAP_FAILED) {
+    close(e->ring_fd);
+    return 1;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    e->cq_map = e->sq_map;
+  } else {
+    e->cq_map = mmap(NULL, e->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     e->ring_fd, IORING_OFF_CQ_RING);
+    if (e->cq_map == MAP_FAILED) {
+      munmap(e->sq_map, e->sq_map_len);
+      close(e->ring_fd);
+      return 1;
+    }
+  }
+  e->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  e->sqes = mmap(NULL, e->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 e->ring_fd, IORING_OFF_SQES);
+  if (e->sqes == MAP_FAILED) {
+    if (e->cq_map != e->sq_map) munmap(e->cq_map, e->cq_map_len);
+    munmap(e->sq_map, e->sq_map_len);
+    close(e->ring_fd);
+    return 1;
+  }
+
+  char* sq = e->sq_map;
+  char* cq = e->cq_map;
+  e->sq_head = (unsigned*) (sq + p.sq_off.head);
+  e->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  e->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  e->sq_array = (unsigned*) (sq + p.sq_off.array);
+  e->sq_entries = p.sq_entries;
+  e->cq_head = (unsigned*) (cq + p.cq_off.head);
+  e->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  e->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  e->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+  return 0;
+}
+
+
+static void aio_uring_teardown(aio_engine* e) {
+  munmap(e->sqes, e->sqes_len);
+  if (e->cq_map != e->sq_map) munmap(e->cq_map, e->cq_map_len);
+  munmap(e->sq_map, e->sq_map_len);
+  close(e->ring_fd);
+}
+
+
+static int aio_uring_submit(aio_engine* e, aio_op* op) {
+  /*
+   * Queues the next step of a request on the ring: a read or write
+   * of what remains, or a no-op to deliver a request which has
+   * already finished.  Returns 0 on success or an errno value; EBUSY
+   * if the ring is full, which passes once requests in flight finish.
+   */
+  pthread_mutex_lock(&e->lock);
+  unsigned tail = *e->sq_tail;
+  if (tail - __atomic_load_n(e->sq_head, __ATOMIC_ACQUIRE) >= e->sq_entries) {
+    // Full of entries left queued by an earlier busy ring, so try
+    // them again to make room, or callers retrying would never get it
+    syscall(__NR_io_uring_enter, e->ring_fd, e->sq_entries, 0, 0, NULL, 0);
+    if (tail - __atomic_load_n(e->sq_head, __ATOMIC_ACQUIRE) >= e->sq_entries) {
+      pthread_mutex_unlock(&e->lock);
+      return EBUSY;
+    }
+  }
+  unsigned idx = tail & *e->sq_mask;
+  struct io_uring_sqe* sqe = &e->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  if (op->finished) {
+    sqe->opcode = IORING_OP_NOP;
+  } else {
+    op->iov.iov_base = op->data + op->done;
+    op->iov.iov_len = op->len - op->done;
+    sqe->opcode = (op->type == AIO_READ) ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->fd = op->fd;
+    sqe->off = op->done;
+    sqe->addr = (unsigned long) &op->iov;
+    sqe->len = 1;
+  }
+  sqe->user_data = (unsigned long) op;
+  e->sq_array[idx] = idx;
+  __atomic_store_n(e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  // Anything left over from an earlier busy ring goes in too
+  int error = 0;
+  while (1) {
+    unsigned to_submit = tail + 1 - __atomic_load_n(e->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 || syscall(__NR_io_uring_enter, e->ring_fd, to_submit, 0, 0, NULL, 0) >= 0) {
+      break;
+    }
+    if (errno != EINTR) {
+      // EAGAIN and EBUSY leave the entry queued for the next call
+      if (errno != EAGAIN && errno != EBUSY) error = errno;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&e->lock);
+  return error;
+}
+
+
+static aio_op* aio_uring_reap(aio_engine* e) {
+  /*
+   * Waits for the next request to finish, resubmitting the remainder
+   * of short reads and writes.
+   */
+  while (1) {
+    unsigned head = *e->cq_head;
+    if (head == __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE)) {
+      syscall(__NR_io_uring_enter, e->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      continue;
+    }
+    struct io_uring_cqe* cqe = &e->cqes[head & *e->cq_mask];
+    aio_op* op = (aio_op*) (unsigned long) cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(e->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    if (!op->finished) {
+      aio_progress(op, res);
+    }
+    if (op->finished) {
+      return op;
+    }
+    int error = aio_uring_submit(e, op);
+    if (error) {
+      aio_fail(op, error);
+      return op;
+    }
+  }
+}
+
+#endif
+
+
+static void aio_do_blocking(aio_op* op) {
+  /*
+   * Carries out a request with ordinary blocking I/O.
+   */
+  stats_timer t;
+  STATS_BEGIN(t);
+  if (aio_open_file(op)) {
+    STATS_END(STATS_IO_NS, t);
+    return;
+  }
+  while (!op->finished) {
+    ssize_t res;
+    if (op->type == AIO_READ) {
+      res = pread(op->fd, op->data + op->done, op->len - op->done, op->done);
+    } else {
+      res = pwrite(op->fd, op->data + op->done, op->len - op->done, op->done);
+    }
+    aio_progress(op, res < 0 ? -errno : res);
+  }
+  STATS_END(STATS_IO_NS, t);
+}
+
+
+static void* aio_worker(void* arg) {
+  /*
+   * Thread body for the thread pool backend.
+   */
+  aio_engine* e = arg;
+  pthread_mutex_lock(&e->lock);
+  while (1) {
+    while (e->work_head == NULL && !e->stopping) {
+      pthread_cond_wait(&e->work_cond, &e->lock);
+    }
+    if (e->work_head == NULL) {
+      break;
+    }
+    aio_op* op = e->work_head;
+    e->work_head = op->next;
+    if (e->work_head == NULL) {
+      e->work_tail = NULL;
+    }
+    pthread_mutex_unlock(&e->lock);
+
+    aio_do_blocking(op);
+
+    pthread_mutex_lock(&e->lock);
+    op->next = NULL;
+    if (e->done_tail != NULL) {
+      e->done_tail->next = op;
+    } else {
+      e->done_head = op;
+    }
+    e->done_tail = op;
+    pthread_cond_signal(&e->done_cond);
+  }
+  pthread_mutex_unlock(&e->lock);
+  return NULL;
+}
+
+
+aio_engine* aio_open(aio_backend backend, int depth) {
+  /*
+   * Starts an engine able to keep depth requests in flight.  Returns
+   * NULL if the backend is not available (io_uring may be missing
+   * from the kernel, or forbidden) or resources could not be
+   * allocated.  The engine must be closed with aio_close.
+   */
+  aio_engine* e = malloc(sizeof(aio_engine));
+  if (e == NULL) {
+    return NULL;
+  }
+  memset(e, 0, sizeof(aio_engine));
+  e->backend = backend;
+  if (depth < 1) depth = 1;
+  pthread_mutex_init(&e->lock, NULL);
+  pthread_cond_init(&e->work_cond, NULL);
+  pthread_cond_init(&e->done_cond, NULL);
+
+  if (backend == AIO_BACKEND_URING) {
+#ifdef AIO_HAVE_URING
+    if (!aio_uring_setup(e, depth)) {
+      return e;
+    }
+#endif
+  } else {
+    int nr_threads = (depth < AIO_MAX_THREADS) ? depth : AIO_MAX_THREADS;
+    e->threads = malloc(nr_threads * sizeof(pthread_t));
+    while (e->threads != NULL && e->nr_threads < nr_threads &&
+           !pthread_create(&e->threads[e->nr_threads], NULL, aio_worker, e)) {
+      ++e->nr_threads;
+    }
+    if (e->nr_threads > 0) {
+      return e;
+    }
+    free(e->threads);
+  }
+
+  pthread_cond_destroy(&e->done_cond);
+  pthread_cond_destroy(&e->work_cond);
+  pthread_mutex_destroy(&e->lock);
+  free(e);
+  return NULL;
+}
+
+
+void aio_close(aio_engine* e) {
+  /*
+   * Shuts down an engine.  Everything submitted must have been
+   * collected with aio_wait first.
+   */
+  if (e->backend == AIO_BACKEND_URING) {
+#ifdef AIO_HAVE_URING
+    aio_uring_teardown(e);
+#endif
+  } else {
+    pthread_mutex_lock(&e->lock);
+    e->stopping = 1;
+    pthread_cond_broadcast(&e->work_cond);
+    pthread_mutex_unlock(&e->lock);
+    int i;
+    for (i=0; i < e->nr_threads; ++i) {
+      pthread_join(e->threads[i], NULL);
+    }
+    free(e->threads);
+  }
+  pthread_cond_destroy(&e->done_cond);
+  pthread_cond_destroy(&e->work_cond);
+  pthread_mutex_destroy(&e->lock);
+  free(e);
+}
+
+
+aio_backend aio_get_backend(aio_engine* e) {
+  return e->backend;
+}
+
+
+static int aio_submit(aio_engine* e, aio_op* op) {
+  /*
+   * Hands a new request to the backend.  Returns 0 on success or an
+   * errno value, in which case the request is freed.
+   */
+  if (e->backend == AIO_BACKEND_URING) {
+#ifdef AIO_HAVE_URING
+    // Opening is done here; only the reads and writes go on the ring
+    aio_open_file(op);
+    int error = aio_uring_submit(e, op);
+    if (error) {
+      if (op->fd >= 0) close(op->fd);
+      if (op->type == AIO_READ) free(op->data);
+      free(op);
+    }
+    return error;
+#endif
+  }
+
+  pthread_mutex_lock(&e->lock);
+  op->next = NULL;
+  if (op->type == AIO_POST) {
+    // Nothing to do, so it goes straight to the finished queue
+    op->finished = 1;
+    if (e->done_tail != NULL) {
+      e->done_tail->next = op;
+    } else {
+      e->done_head = op;
+    }
+    e->done_tail = op;
+    pthread_cond_signal(&e->done_cond);
+  } else {
+    if (e->work_tail != NULL) {
+      e->work_tail->next = op;
+    } else {
+      e->work_head = op;
+    }
+    e->work_tail = op;
+    pthread_cond_signal(&e->work_cond);
+  }
+  pthread_mutex_unlock(&e->lock);
+  return 0;
+}
+
+
+int aio_read_file(aio_engine* e, char* filename, void* tag) {
+  /*
+   * Starts reading the whole of filename into memory.  The result is
+   * collected by aio_wait; a file which isn't a regular file gives
+   * ENODEV.  Returns 0 on success or an errno value if the request
+   * could not be submitted.
+   */
+  aio_op* op = aio_new_op(AIO_READ, filename, tag);
+  if (op == NULL) {
+    return ENOMEM;
+  }
+  return aio_submit(e, op);
+}
+
+
+int aio_write_file(aio_engine* e, char* filename, char* data, size_t len, void* tag) {
+  /*
+   * Starts writing len bytes of data to filename, replacing anything
+   * already there.  The engine takes ownership of data, which must
+   * have come from malloc, and frees it once written.  Returns 0 on
+   * success or an errno value if the request could not be submitted,
+   * in which case data is still the caller's.
+   */
+  aio_op* op = aio_new_op(AIO_WRITE, filename, tag);
+  if (op == NULL) {
+    return ENOMEM;
+  }
+  op->data = data;
+  op->len = len;
+  return aio_submit(e, op);
+}
+
+
+int aio_post(aio_engine* e, void* tag) {
+  /*
+   * Posts a request which does nothing, to wake up the thread
+   * collecting results.  Returns 0 on success or an errno value.
+   */
+  aio_op* op = aio_new_op(AIO_POST, NULL, tag);
+  if (op == NULL) {
+    return ENOMEM;
+  }
+  return aio_submit(e, op);
+}
+
+
+void aio_wait(aio_engine* e, aio_result* result) {
+  /*
+   * Waits for the next request to finish and fills in its result.
+   * This blocks until something finishes, so there must be a request
+   * in flight, or one about to be submitted by another thread.
+   */
+  aio_op* op = NULL;
+  if (e->backend == AIO_BACKEND_URING) {
+#ifdef AIO_HAVE_URING
+    op = aio_uring_reap(e);
+#endif
+  } else {
+    pthread_mutex_lock(&e->lock);
+    while (e->done_head == NULL) {
+      pthread_cond_wait(&e->done_cond, &e->lock);
+    }
+    op = e->done_head;
+    e->done_head = op->next;
+    if (e->done_head == NULL) {
+      e->done_tail = NULL;
+    }
+    pthread_mutex_unlock(&e->lock);
+  }
+
+  aio_complete(op, result);
+}
@@ -0,0 +1,73 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Asynchronous whole-file reads and writes, so that many files can be
+// in flight at once.  Requests may be submitted from any thread, but
+// completions must all be collected by one thread.
+
+typedef enum {
+  // io_uring, driven through the raw system calls
+  AIO_BACKEND_URING,
+
+  // Blocking I/O on a pool of threads
+  AIO_BACKEND_THREADS
+} aio_backend;
+
+typedef enum {
+  AIO_READ,
+  AIO_WRITE,
+  AIO_POST
+} aio_type;
+
+typedef struct {
+  aio_type type;
+
+  // The tag given when the request was submitted
+  void* tag;
+
+  // For reads, the contents of the file, to be freed by the caller,
+  // and its length
+  char* data;
+  size_t len;
+
+  // 0 on success, or an errno value
+  int error;
+} aio_result;
+
+typedef struct aio_engine aio_engine;
+
+aio_engine* aio_open(aio_backend backend, int depth);
+void aio_close(aio_engine* e);
+aio_backend aio_get_backend(aio_engine* e);
+int aio_read_file(aio_engine* e, char* filename, void* tag);
+int aio_write_file(aio_engine* e, char* filename, char* data, size_t len, void* tag);
+int aio_post(aio_engine* e, void* tag);
+void aio_wait(aio_engine* e, aio_result* result);
+
+#ifdef __cplusplus
+}
+#endif
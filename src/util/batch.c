@@ -0,0 +1,843 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "batch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+  char*** jobs;
+  int nr_jobs;
+  batch_job job;
+
+  // The next job to hand out and the number which have failed,
+  // protected by lock
+  int next;
+  int failed;
+  pthread_mutex_t lock;
+} batch_queue;
+
+// A job run with asynchronous I/O
+typedef struct {
+  char** argv;
+
+  // The input, read in advance, and its length; have_input is set if
+  // it was read successfully
+  char* input;
+  size_t input_len;
+  int have_input;
+
+  // The output, collected in memory by batch_close_output, and its
+  // length; have_output is set if there is output to be written
+  char* output;
+  size_t output_len;
+  int have_output;
+
+  // The job's return value
+  int status;
+} batch_slot;
+
+typedef struct {
+  batch_slot* slots;
+  int nr_jobs;
+  batch_job job;
+  aio_engine* io;
+
+  // Jobs whose input is ready, in the order it arrived, and whether
+  // any more are to come, protected by lock and signalled by ready_cond
+  int* ready;
+  int ready_head;
+  int ready_tail;
+  int finished;
+
+  // The number of jobs which have failed, protected by lock
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t ready_cond;
+} batch_async;
+
+// The job being run by this thread with asynchronous I/O, if any
+static __thread batch_slot* batch_current = NULL;
+
+// Set when the job being run by this thread has opened its output file
+// itself, so that the output of a failed job can be removed
+static __thread int batch_output_opened = 0;
+
+// The files --batch-dir picks up, and what their outputs are named
+static char* batch_input_suffix = ".srt";
+static char* batch_output_suffix = ".srt";
+
+
+static int batch_argc(char** argv) {
+  int argc = 0;
+  while (argv[argc] != NULL) ++argc;
+  return argc;
+}
+
+
+static void batch_remove_output(char* filename) {
+  /*
+   * Removes what a failed job wrote, so that it isn't mistaken for a
+   * finished output; anything other than a regular file, such as
+   * /dev/stdout, is left alone.
+   */
+  struct stat st;
+  if (!stat(filename, &st) && S_ISREG(st.st_mode)) {
+    unlink(filename);
+  }
+}
+
+
+static void* batch_worker(void* arg) {
+  /*
+   * Thread body: runs jobs from the queue until there are none left.
+   */
+  batch_queue* q = arg;
+  while (1) {
+    pthread_mutex_lock(&q->lock);
+    int i = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if (i >= q->nr_jobs) {
+      return NULL;
+    }
+
+    char** argv = q->jobs[i];
+    batch_output_opened = 0;
+    if (q->job(batch_argc(argv), argv)) {
+      fprintf(stderr, "%s: failed\n", argv[0]);
+      if (batch_output_opened) {
+        batch_remove_output(argv[1]);
+      }
+      pthread_mutex_lock(&q->lock);
+      ++q->failed;
+      pthread_mutex_unlock(&q->lock);
+    }
+  }
+}
+
+
+int batch_run(char*** jobs, int nr_jobs, int nr_threads, batch_job job) {
+  /*
+   * Runs nr_jobs jobs, each given as a NULL-terminated argument list
+   * (see batch_job), on a pool of nr_threads threads.  A failing job
+   * is reported on stderr and doesn't stop the others.  Returns the
+   * number of jobs which failed.
+   */
+  batch_queue q;
+  q.jobs = jobs;
+  q.nr_jobs = nr_jobs;
+  q.job = job;
+  q.next = 0;
+  q.failed = 0;
+  pthread_mutex_init(&q.lock, NULL);
+
+  if (nr_threads > nr_jobs) nr_threads = nr_jobs;
+  pthread_t* threads = malloc(nr_threads * sizeof(pthread_t));
+  int started = 0;
+  if (threads != NULL) {
+    while (started < nr_threads &&
+           !pthread_create(&threads[started], NULL, batch_worker, &q)) {
+      ++started;
+    }
+  }
+  if (started == 0) {
+    // No threads to be had, so do the work here instead
+    batch_worker(&q);
+  }
+  int i;
+  for (i=0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  pthread_mutex_destroy(&q.lock);
+  return q.failed;
+}
+
+
+static void batch_ready(batch_async* a, int i) {
+  pthread_mutex_lock(&a->lock);
+  a->ready[a->ready_tail++] = i;
+  pthread_cond_signal(&a->ready_cond);
+  pthread_mutex_unlock(&a->lock);
+}
+
+
+static void batch_fail(batch_async* a) {
+  pthread_mutex_lock(&a->lock);
+  ++a->failed;
+  pthread_mutex_unlock(&a->lock);
+}
+
+
+static void* batch_async_worker(void* arg) {
+  /*
+   * Thread body: runs jobs as their input arrives, then hands their
+   * output to the I/O engine to be written.
+   */
+  batch_async* a = arg;
+  while (1) {
+    pthread_mutex_lock(&a->lock);
+    while (a->ready_head == a->ready_tail && !a->finished) {
+      pthread_cond_wait(&a->ready_cond, &a->lock);
+    }
+    if (a->ready_head == a->ready_tail) {
+      pthread_mutex_unlock(&a->lock);
+      return NULL;
+    }
+    batch_slot* slot = &a->slots[a->ready[a->ready_head++]];
+    pthread_mutex_unlock(&a->lock);
+
+    char** argv = slot->argv;
+    batch_current = slot;
+    slot->status = a->job(batch_argc(argv), argv);
+    batch_current = NULL;
+    free(slot->input);
+    slot->input = NULL;
+    if (slot->status) {
+      // What it did produce is dropped rather than written
+      fprintf(stderr, "%s: failed\n", argv[0]);
+      batch_fail(a);
+      if (slot->have_output) {
+        free(slot->output);
+        slot->output = NULL;
+        slot->have_output = 0;
+      }
+    }
+
+    // The engine tells the main thread when the job is over, either
+    // with the completion of the write or with a post
+    int error = 0;
+    if (slot->have_output) {
+      // A full ring only means waiting for room, as for posts below
+      while ((error = aio_write_file(a->io, argv[1], slot->output, slot->output_len, slot)) == EBUSY ||
+             error == EAGAIN) {
+        usleep(1000);
+      }
+      if (error) {
+        fprintf(stderr, "Error writing to %s: %s\n", argv[1], strerror(error));
+        free(slot->output);
+        if (!slot->status) {
+          batch_fail(a);
+        }
+      }
+    }
+    if (!slot->have_output || error) {
+      while (aio_post(a->io, slot)) {
+        // A post only fails for lack of memory or of room on the
+        // ring, and both come back as other requests finish
+        usleep(1000);
+      }
+    }
+  }
+}
+
+
+int batch_run_async(char*** jobs, int nr_jobs, int nr_threads, batch_job job,
+                    aio_backend backend) {
+  /*
+   * Runs jobs as batch_run does, but with their files read and written
+   * asynchronously through the given backend: the inputs of the next
+   * few jobs are read into memory while earlier jobs run, and outputs
+   * are collected in memory and written while later jobs run.  Jobs
+   * must use batch_open_input and batch_open_output for this to help.
+   * If io_uring is not available the thread pool backend is used
+   * instead, and if that fails too the jobs are run by batch_run.
+   * Returns the number of jobs which failed.
+   */
+  // Enough reads in flight to keep every thread busy
+  int depth = 2 * nr_threads;
+  if (depth < 8) depth = 8;
+
+  aio_engine* io = aio_open(backend, depth);
+  if (io == NULL && backend == AIO_BACKEND_URING) {
+    fprintf(stderr, "io_uring is not available; using a thread pool for I/O\n");
+    io = aio_open(AIO_BACKEND_THREADS, depth);
+  }
+  batch_async a;
+  memset(&a, 0, sizeof(a));
+  a.slots = calloc(nr_jobs, sizeof(batch_slot));
+  a.ready = malloc(nr_jobs * sizeof(int));
+  if (nr_threads > nr_jobs) nr_threads = nr_jobs;
+  pthread_t* threads = malloc(nr_threads * sizeof(pthread_t));
+  if (io == NULL || a.slots == NULL || a.ready == NULL || threads == NULL) {
+    if (io != NULL) aio_close(io);
+    free(a.slots);
+    free(a.ready);
+    free(threads);
+    return batch_run(jobs, nr_jobs, nr_threads, job);
+  }
+  a.nr_jobs = nr_jobs;
+  a.job = job;
+  a.io = io;
+  pthread_mutex_init(&a.lock, NULL);
+  pthread_cond_init(&a.ready_cond, NULL);
+
+  int i;
+  for (i=0; i < nr_jobs; ++i) {
+    a.slots[i].argv = jobs[i];
+  }
+  int started = 0;
+  while (started < nr_threads &&
+         !pthread_create(&threads[started], NULL, batch_async_worker, &a)) {
+    ++started;
+  }
+  if (started == 0) {
+    // No threads to be had, so do the work here instead
+    aio_close(io);
+    free(a.slots);
+    free(a.ready);
+    free(threads);
+    pthread_cond_destroy(&a.ready_cond);
+    pthread_mutex_destroy(&a.lock);
+    return batch_run(jobs, nr_jobs, nr_threads, job);
+  }
+
+  // Keep up to depth jobs between having their input read and being
+  // finished with, so that memory use is bounded
+  int next = 0;
+  int done = 0;
+  while (done < nr_jobs) {
+    while (next < nr_jobs && next - done < depth) {
+      if (aio_read_file(io, jobs[next][0], &a.slots[next])) {
+        batch_ready(&a, next);
+      }
+      ++next;
+    }
+
+    aio_result r;
+    aio_wait(io, &r);
+    batch_slot* slot = r.tag;
+    if (r.type == AIO_READ) {
+      slot->input = r.data;
+      slot->input_len = r.len;
+      slot->have_input = !r.error;
+      batch_ready(&a, slot - a.slots);
+    } else {
+      if (r.type == AIO_WRITE && r.error) {
+        fprintf(stderr, "Error writing to %s: %s\n", slot->argv[1], strerror(r.error));
+        if (!slot->status) {
+          batch_fail(&a);
+        }
+      }
+      ++done;
+    }
+  }
+
+  pthread_mutex_lock(&a.lock);
+  a.finished = 1;
+  pthread_cond_broadcast(&a.ready_cond);
+  pthread_mutex_unlock(&a.lock);
+  for (i=0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  aio_close(io);
+  free(threads);
+  free(a.slots);
+  free(a.ready);
+  pthread_cond_destroy(&a.ready_cond);
+  pthread_mutex_destroy(&a.lock);
+  return a.failed;
+}
+
+
+srt_file* batch_open_input(char* filename) {
+  /*
+   * Opens a job's input as srt_open_mmap does, but if it has already
+   * been read by asynchronous I/O, reads it from memory instead.
+   */
+  batch_slot* slot = batch_current;
+  if (slot != NULL && slot->have_input && !strcmp(filename, slot->argv[0])) {
+    return srt_open_memory(slot->input, slot->input_len);
+  }
+  return srt_open_mmap(filename);
+}
+
+
+FILE* batch_open_stream(char* filename) {
+  /*
+   * Opens a job's input for reading through stdio, for inputs which
+   * aren't SRT; if it has already been read by asynchronous I/O, the
+   * stream reads it from memory instead, and has no file descriptor.
+   * Returns NULL if the file cannot be opened.
+   */
+  batch_slot* slot = batch_current;
+  if (slot != NULL && slot->have_input && slot->input_len > 0 &&
+      !strcmp(filename, slot->argv[0])) {
+    FILE* f = fmemopen(slot->input, slot->input_len, "r");
+    if (f != NULL) {
+      return f;
+    }
+  }
+  return fopen(filename, "rb");
+}
+
+
+srt_file* batch_open_output(char* filename) {
+  /*
+   * Opens a job's output as srt_open_write does, but with asynchronous
+   * I/O, collects it in memory to be written once the job is done.
+   * The file must be closed with batch_close_output.  If the job
+   * fails, its output is removed, or with asynchronous I/O not
+   * written at all.
+   */
+  batch_slot* slot = batch_current;
+  if (slot != NULL && !strcmp(filename, slot->argv[1])) {
+    return srt_open_write_memory();
+  }
+  srt_file* file = srt_open_write(filename);
+  if (file != NULL) {
+    batch_output_opened = 1;
+  }
+  return file;
+}
+
+
+int batch_close_output(srt_file* file) {
+  /*
+   * Closes a file opened with batch_open_output, as srt_close does.
+   * Output collected in memory is handed over to be written, and any
+   * error writing it is reported once the job is done.
+   */
+  batch_slot* slot = batch_current;
+  if (slot != NULL && file->f == NULL) {
+    size_t len;
+    char* output = srt_take_memory(file, &len);
+    if (file->error) {
+      srt_close(file);
+      return SRT_ERROR_WRITE;
+    }
+    free(slot->output);
+    slot->output = output;
+    slot->output_len = len;
+    slot->have_output = 1;
+  }
+  return srt_close(file);
+}
+
+
+static int batch_add(char**** jobs, int* nr_jobs, int* max_jobs, char** argv) {
+  /*
+   * Appends a job to a growing list of jobs.  Returns 0 on success or
+   * -1 if memory could not be allocated.
+   */
+  if (*nr_jobs == *max_jobs) {
+    int new_max = *max_jobs ? 2 * *max_jobs : 64;
+    char*** new = realloc(*jobs, new_max * sizeof(char**));
+    if (new == NULL) {
+      return -1;
+    }
+    *jobs = new;
+    *max_jobs = new_max;
+  }
+  (*jobs)[(*nr_jobs)++] = argv;
+  return 0;
+}
+
+
+static char** batch_split(const char* line) {
+  /*
+   * Splits a manifest line into whitespace-separated words; a word
+   * may be enclosed in double quotes to include spaces.  Returns a
+   * NULL-terminated list of the words, allocated in one block along
+   * with the words themselves so that it is freed with a single free,
+   * or NULL if memory could not be allocated.
+   */
+  size_t len = strlen(line);
+  size_t max_words = len/2 + 2;
+  char** words = malloc(max_words * sizeof(char*) + len + 1);
+  if (words == NULL) {
+    return NULL;
+  }
+  char* c = (char*)(words + max_words);
+  memcpy(c, line, len + 1);
+
+  int nr_words = 0;
+  while (1) {
+    while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n') ++c;
+    if (*c == 0 || *c == '#') break;
+
+    if (*c == '"') {
+      words[nr_words++] = ++c;
+      while (*c != 0 && *c != '"') ++c;
+    } else {
+      words[nr_words++] = c;
+      while (*c != 0 && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n') ++c;
+    }
+    if (*c == 0) break;
+    *c++ = 0;
+  }
+
+  words[nr_words] = NULL;
+  return words;
+}
+
+
+static int batch_read_manifest(char* filename, char**** jobs, int* nr_jobs) {
+  /*
+   * Reads a manifest, one job per line: input file, output file, then
+   * parameters.  Blank lines and lines starting with # are ignored.
+   * Returns 0 on success, or -1 (with a message on stderr) if the
+   * manifest could not be read or a line has no output file.
+   */
+  FILE* f = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Error opening manifest %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+
+  int max_jobs = 0;
+  char* line = NULL;
+  size_t len = 0;
+  unsigned int line_no = 0;
+  int error = 0;
+  while (getline(&line, &len, f) >= 0) {
+    ++line_no;
+    char** argv = batch_split(line);
+    if (argv == NULL) {
+      fprintf(stderr, "OOM\n");
+      error = -1;
+      break;
+    }
+    if (argv[0] == NULL) {
+      free(argv);
+      continue;
+    }
+    if (argv[1] == NULL) {
+      fprintf(stderr, "Error at manifest line %u: expected an input and an output file\n", line_no);
+      free(argv);
+      error = -1;
+      break;
+    }
+    if (batch_add(jobs, nr_jobs, &max_jobs, argv)) {
+      fprintf(stderr, "OOM\n");
+      free(argv);
+      error = -1;
+      break;
+    }
+  }
+
+  free(line);
+  if (f != stdin) {
+    fclose(f);
+  }
+  return error;
+}
+
+
+static int batch_make_dirs(char* path) {
+  /*
+   * Creates a directory along with any of its parents which don't
+   * exist yet.  Returns 0 on success or -1 (with a message on stderr).
+   */
+  char* dir = strdup(path);
+  if (dir == NULL) {
+    fprintf(stderr, "OOM\n");
+    return -1;
+  }
+  char* c = dir;
+  int error = 0;
+  while (!error) {
+    c = strchr(c+1, '/');
+    if (c != NULL) *c = 0;
+    if (mkdir(dir, 0777) && errno != EEXIST) {
+      fprintf(stderr, "Error creating directory %s: %s\n", dir, strerror(errno));
+      error = -1;
+    }
+    if (c == NULL) break;
+    *c = '/';
+  }
+  free(dir);
+  return error;
+}
+
+
+static char* batch_resolve(char* path) {
+  /*
+   * Makes path absolute and canonical, as realpath does, but allows
+   * the end of it not to exist yet.  Returns a string to be freed, or
+   * NULL if it couldn't be resolved.
+   */
+  size_t len = strlen(path);
+  char* head = malloc(len + 3);
+  if (head == NULL) {
+    return NULL;
+  }
+  strcpy(head, path);
+
+  // Strip components off the end until what's left exists
+  char* real;
+  size_t head_len = len;
+  while ((real = realpath(*head ? head : ".", NULL)) == NULL && errno == ENOENT && head_len > 0) {
+    while (head_len > 0 && head[head_len-1] == '/') --head_len;
+    while (head_len > 0 && head[head_len-1] != '/') --head_len;
+    head[head_len] = 0;
+  }
+  free(head);
+  if (real == NULL) {
+    return NULL;
+  }
+
+  char* tail = path + head_len;
+  size_t real_len = strlen(real);
+  char* resolved = malloc(real_len + strlen(tail) + 2);
+  if (resolved != NULL) {
+    int sep = *tail && real[real_len-1] != '/';
+    sprintf(resolved, "%s%s%s", real, sep ? "/" : "", tail);
+  }
+  free(real);
+  return resolved;
+}
+
+
+static int batch_inside(char* in_dir, char* out_dir) {
+  /*
+   * Returns true if out_dir is in_dir or somewhere under it, where
+   * outputs would be picked up as inputs.  Paths which can't be
+   * resolved are left for the walk to report.
+   */
+  char* in = batch_resolve(in_dir);
+  char* out = batch_resolve(out_dir);
+  int inside = 0;
+  if (in != NULL && out != NULL) {
+    size_t len = strlen(in);
+    if (len > 0 && in[len-1] == '/') --len;
+    inside = !strncmp(in, out, len) && (out[len] == 0 || out[len] == '/');
+  }
+  free(in);
+  free(out);
+  return inside;
+}
+
+
+static int batch_walk(char* in_dir, char* out_dir, char** params, int nr_params,
+                      char**** jobs, int* nr_jobs, int* max_jobs) {
+  /*
+   * Adds a job for every file under in_dir with the input suffix,
+   * writing to the same relative path under out_dir with the output
+   * suffix in its place, and creates the output directories which
+   * will have jobs' outputs in them.
+   * Returns 0 on success or -1 (with a message on stderr).
+   */
+  DIR* d = opendir(in_dir);
+  if (d == NULL) {
+    fprintf(stderr, "Error opening directory %s: %s\n", in_dir, strerror(errno));
+    return -1;
+  }
+
+  int error = 0;
+  int have_out_dir = 0;
+  struct dirent* entry;
+  while (!error && (entry = readdir(d)) != NULL) {
+    char* name = entry->d_name;
+    if (name[0] == '.') continue;
+
+    // A job is allocated in one block: the argument list, followed by
+    // the input and output paths; the output may have a longer suffix
+    size_t len = strlen(name);
+    size_t in_suffix_len = strlen(batch_input_suffix);
+    size_t in_len = strlen(in_dir) + len + 2;
+    size_t out_len = strlen(out_dir) + len + strlen(batch_output_suffix) + 2;
+    char** argv = malloc((nr_params + 3) * sizeof(char*) + in_len + out_len);
+    if (argv == NULL) {
+      fprintf(stderr, "OOM\n");
+      error = -1;
+      break;
+    }
+    char* in_path = (char*)(argv + nr_params + 3);
+    char* out_path = in_path + in_len;
+    sprintf(in_path, "%s/%s", in_dir, name);
+    sprintf(out_path, "%s/%s", out_dir, name);
+
+    struct stat st;
+    if (stat(in_path, &st)) {
+      fprintf(stderr, "Error reading %s: %s\n", in_path, strerror(errno));
+      error = -1;
+    } else if (S_ISDIR(st.st_mode)) {
+      error = batch_walk(in_path, out_path, params, nr_params, jobs, nr_jobs, max_jobs);
+    } else if (S_ISREG(st.st_mode) && len > in_suffix_len &&
+               strcasecmp(name + len - in_suffix_len, batch_input_suffix) == 0) {
+      // Only directories which will have something in them are created
+      if (!have_out_dir) {
+        if (batch_make_dirs(out_dir)) {
+          error = -1;
+          break;
+        }
+        have_out_dir = 1;
+      }
+      strcpy(out_path + strlen(out_path) - in_suffix_len, batch_output_suffix);
+      argv[0] = in_path;
+      argv[1] = out_path;
+      memcpy(argv+2, params, nr_params * sizeof(char*));
+      argv[nr_params+2] = NULL;
+      if (!batch_add(jobs, nr_jobs, max_jobs, argv)) {
+        continue;
+      }
+      fprintf(stderr, "OOM\n");
+      error = -1;
+    }
+    free(argv);
+  }
+
+  closedir(d);
+  return error;
+}
+
+
+void batch_set_suffixes(char* input_suffix, char* output_suffix) {
+  /*
+   * Sets the suffix of the files --batch-dir picks up, and the suffix
+   * given to their outputs in its place; both are .srt by default.
+   * Must be called before batch_main or batch_usage.
+   */
+  batch_input_suffix = input_suffix;
+  batch_output_suffix = output_suffix;
+}
+
+
+int batch_requested(int argc, char** argv) {
+  /*
+   * Returns true if the command line asks for batch mode.
+   */
+  return argc > 1 && (strcmp(argv[1], "--batch") == 0 ||
+                      strcmp(argv[1], "--batch-dir") == 0);
+}
+
+
+void batch_usage(char* executable_name, char* params) {
+  /*
+   * Describes the batch mode command lines for a tool taking params.
+   */
+  printf("       %s --batch <manifest> [--threads n] [--io mode]\n", executable_name);
+  char* sep = (*params != 0) ? " " : "";
+  printf("       %s --batch-dir <input_dir> <output_dir> [--threads n] [--io mode]%s%s\n", executable_name, sep, params);
+  printf("Batch mode processes many files in one process on a pool of threads\n");
+  printf("(one per CPU by default).  Each line of the manifest gives an input\n");
+  printf("file, an output file and then the parameters for that pair, e.g.\n");
+  printf("  in%s out%s%s%s\n", batch_input_suffix, batch_output_suffix, sep, params);
+  printf("The manifest - is read from stdin.  With --batch-dir, every %s file\n", batch_input_suffix);
+  printf("under input_dir is processed with the same parameters and written to\n");
+  printf("the same place under output_dir.  A file which fails is reported and\n");
+  printf("the rest carry on.  --io chooses how files are read and written: sync\n");
+  printf("(the default) reads and writes them on the threads doing the work;\n");
+  printf("async keeps many reads and writes in flight at once with io_uring, or\n");
+  printf("a pool of I/O threads where io_uring isn't available; threads always\n");
+  printf("uses the pool.\n");
+  if (strcmp(batch_input_suffix, batch_output_suffix)) {
+    printf("Outputs under output_dir are named with %s in place of %s.\n",
+           batch_output_suffix, batch_input_suffix);
+  }
+}
+
+
+int batch_main(int argc, char** argv, batch_job job) {
+  /*
+   * Runs batch mode for a command line accepted by batch_requested,
+   * with job doing the work for each input/output pair.  Returns the
+   * exit status for the tool: 0 if everything succeeded, 2 if some
+   * jobs failed, 1 if the jobs could not be set up, or 127 for a bad
+   * command line.
+   */
+  int nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int io = -1;
+  int tree = (strcmp(argv[1], "--batch-dir") == 0);
+  int nr_fixed = tree ? 2 : 1;
+
+  // Pick out the thread count, leaving the parameters for the jobs
+  char** params = malloc(argc * sizeof(char*));
+  if (params == NULL) {
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+  int nr_params = 0;
+  int i;
+  for (i=2+nr_fixed; i < argc; ++i) {
+    if (strcmp(argv[i], "--threads") == 0) {
+      if (++i >= argc || sscanf(argv[i], "%d", &nr_threads) != 1 || nr_threads < 1) {
+        free(params);
+        return 127;
+      }
+    } else if (strcmp(argv[i], "--io") == 0) {
+      if (++i >= argc) {
+        free(params);
+        return 127;
+      }
+      if (strcmp(argv[i], "async") == 0) {
+        io = AIO_BACKEND_URING;
+      } else if (strcmp(argv[i], "threads") == 0) {
+        io = AIO_BACKEND_THREADS;
+      } else if (strcmp(argv[i], "sync") != 0) {
+        free(params);
+        return 127;
+      }
+    } else {
+      params[nr_params++] = argv[i];
+    }
+  }
+  if (argc < 2+nr_fixed || (!tree && nr_params > 0)) {
+    free(params);
+    return 127;
+  }
+  if (nr_threads < 1) nr_threads = 1;
+
+  char*** jobs = NULL;
+  int nr_jobs = 0;
+  int max_jobs = 0;
+  int error;
+  if (tree && batch_inside(argv[2], argv[3])) {
+    fprintf(stderr, "Error: output directory %s is inside input directory %s\n", argv[3], argv[2]);
+    error = -1;
+  } else if (tree) {
+    error = batch_walk(argv[2], argv[3], params, nr_params, &jobs, &nr_jobs, &max_jobs);
+  } else {
+    error = batch_read_manifest(argv[2], &jobs, &nr_jobs);
+  }
+
+  int failed = 0;
+  if (!error) {
+    if (io >= 0 && nr_jobs > 0) {
+      failed = batch_run_async(jobs, nr_jobs, nr_threads, job, io);
+    } else {
+      failed = batch_run(jobs, nr_jobs, nr_threads, job);
+    }
+    if (failed) {
+      fprintf(stderr, "%d of %d files failed\n", failed, nr_jobs);
+    }
+  }
+
+  for (i=0; i < nr_jobs; ++i) {
+    free(jobs[i]);
+  }
+  free(jobs);
+  free(params);
+
+  if (error) {
+    return 1;
+  }
+  return failed ? 2 : 0;
+}
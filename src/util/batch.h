@@ -0,0 +1,54 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "aio.h"
+#include "srt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A job for a batch: argv[0] is the input file, argv[1] the output
+// file, and any further arguments are the tool's parameters for that
+// pair.  Returns 0 on success; anything else counts as a failure, and
+// should already have been explained on stderr.  Jobs run
+// concurrently, so must not share state.  Jobs should open their input
+// and output with batch_open_input (or batch_open_stream for input
+// which isn't SRT) and batch_open_output, so that with asynchronous
+// I/O they are handed input which has already been read, and their
+// output is written for them.
+typedef int (*batch_job)(int argc, char** argv);
+
+int batch_requested(int argc, char** argv);
+int batch_main(int argc, char** argv, batch_job job);
+void batch_usage(char* executable_name, char* params);
+void batch_set_suffixes(char* input_suffix, char* output_suffix);
+int batch_run(char*** jobs, int nr_jobs, int nr_threads, batch_job job);
+int batch_run_async(char*** jobs, int nr_jobs, int nr_threads, batch_job job,
+                    aio_backend backend);
+srt_file* batch_open_input(char* filename);
+FILE* batch_open_stream(char* filename);
+srt_file* batch_open_output(char* filename);
+int batch_close_output(srt_file* file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1078 @@
+/*
+ *  Copyright Andrew Ryrie 2013
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "pgs.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int PGS_EOF = -1;
+int PGS_ERROR_TRUNCATED = -2;
+int PGS_ERROR_ALLOC = -3;
+int PGS_ERROR_PRESENTATION = -4;
+int PGS_ERROR_INDEX = -5;
+int PGS_ERROR_WRITE = -6;
+int PGS_ERROR_SYNC = -7;
+int PGS_ERROR_SEEK = -8;
+int PGS_ERROR_MAP = -9;
+int PGS_ERROR_OBJECT = -10;
+int PGS_ERROR_PALETTE = -11;
+
+#define PGS_INDEX_MAGIC "PGSINDEX"
+#define PGS_INDEX_VERSION 2
+
+// Seeking bisects the file down to this much, then walks the headers
+#define PGS_SEEK_LINEAR 65536
+
+// Each thread of a parallel scan takes at least this much of a file,
+// so that small files are not split up for nothing
+#define PGS_PARALLEL_MIN_RANGE 1048576
+
+// A parallel scan only takes an offset for the start of a segment if
+// this many segments follow on from it (or the file ends first)
+#define PGS_RESYNC_CHAIN 8
+
+// A part of a stream scanned by one thread of pgs_scan_parallel
+typedef struct {
+  uint8_t *data;
+  uint64_t size;
+  enum pgs_framing framing;
+
+  // Segments starting from start up to stop are scanned; stop is the
+  // first boundary at or after split, where the next range nominally
+  // begins, or where the stream ends or goes wrong, as error says
+  uint64_t start;
+  uint64_t split;
+  uint64_t stop;
+  int error;
+
+  pgs_segment_fn fn;
+  void *ctx;
+} pgs_range;
+
+// The start of an index file, followed by nr_entries pgs_index_entry
+// records.  The details of the input file let a stale index be spotted.
+typedef struct {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+  uint64_t nr_entries;
+  uint64_t input_size;
+  uint64_t input_dev;
+  uint64_t input_ino;
+  int64_t input_mtime_sec;
+  int64_t input_mtime_nsec;
+} pgs_index_header;
+
+
+int get_be16(uint8_t*buf) {
+  uint16_t val = ((uint16_t)(*buf)) << 8;
+  val |= (uint16_t)(buf[1]);
+  return val;
+}
+
+
+uint32_t get_be32(uint8_t *buf) {
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+
+static int pgs_fill(pgs_reader *r, size_t len, uint8_t **ptr) {
+  /*
+   * Points ptr at the next len bytes of the stream, reading more of
+   * the file if necessary.  Returns 0, or non-zero if the file ends
+   * first.
+   */
+  if (!ring_peek(r->ring, len, ptr)) {
+    return 0;
+  }
+  uint8_t couldnt_read;
+  stats_timer t;
+  STATS_BEGIN(t);
+  int read = ring_read(r->f, r->ring, &couldnt_read);
+  STATS_END(STATS_IO_NS, t);
+  STATS_ADD(STATS_BYTES_READ, read);
+  return ring_peek(r->ring, len, ptr);
+}
+
+
+pgs_reader *pgs_open(char *filename) {
+  /*
+   * Opens a PGS stream for reading segment by segment.  Returns NULL
+   * if the file cannot be opened (errno may be inspected to determine
+   * the cause) or memory cannot be allocated.  The reader must be
+   * closed with pgs_close.
+   */
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  pgs_reader *r = pgs_open_stream(f);
+  if (r == NULL) {
+    fclose(f);
+  }
+  return r;
+}
+
+
+pgs_reader *pgs_open_stream(FILE *f) {
+  /*
+   * Reads a PGS stream from a file which is already open, and which
+   * is closed by pgs_close.  A stream with no file descriptor behind
+   * it, such as one from fmemopen, can be read but not seeked in or
+   * copied from by a writer.  Returns NULL if memory cannot be
+   * allocated, leaving f open.
+   */
+  pgs_reader *r = malloc(sizeof(pgs_reader));
+  if (r == NULL) {
+    return NULL;
+  }
+  r->f = f;
+
+  // Streams are mostly read from start to end, so ask for generous
+  // readahead; seeking still works, it just reads a little more
+  int fd = fileno(f);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  // Room for the biggest possible segment, mapped so that segments
+  // can always be parsed in place
+  r->ring = ring_alloc_mirrored(PGS_MAX_SEGMENT);
+  if (r->ring == NULL) {
+    r->ring = ring_alloc(PGS_MAX_SEGMENT);
+  }
+  if (r->ring == NULL) {
+    free(r);
+    return NULL;
+  }
+
+  r->offset = 0;
+  r->pending = 0;
+
+  // Streams are either all .sup framing or all bare
+  uint8_t *magic;
+  r->framing = PGS_FRAMING_BARE;
+  if (!pgs_fill(r, 2, &magic) && magic[0] == 'P' && magic[1] == 'G') {
+    r->framing = PGS_FRAMING_SUP;
+  }
+  return r;
+}
+
+
+void pgs_close(pgs_reader *r) {
+  fclose(r->f);
+  ring_free(r->ring);
+  free(r);
+}
+
+
+int pgs_next(pgs_reader *r, pgs_segment *seg) {
+  /*
+   * Reads the next segment from the stream.  The payload is parsed in
+   * place and stays valid until the next call.  Returns 0 on success,
+   * PGS_EOF at the end of the stream (including a partial header at
+   * the very end), PGS_ERROR_TRUNCATED if the file ends part-way
+   * through a segment, in which case seg's type, length and offset
+   * are still filled in, or PGS_ERROR_SYNC if a .sup segment doesn't
+   * start with "PG".
+   */
+  uint8_t *buf;
+
+  if (r->pending) {
+    ring_consume(r->ring, r->pending);
+    r->offset += r->pending;
+    r->pending = 0;
+  }
+
+  int header_len = (r->framing == PGS_FRAMING_SUP) ? PGS_SUP_HEADER : PGS_BARE_HEADER;
+  if (pgs_fill(r, header_len, &buf)) {
+    return PGS_EOF;
+  }
+  seg->offset = r->offset;
+  seg->header_len = header_len;
+  if (r->framing == PGS_FRAMING_SUP) {
+    if (buf[0] != 'P' || buf[1] != 'G') {
+      return PGS_ERROR_SYNC;
+    }
+    seg->pts = get_be32(buf+2);
+    seg->dts = get_be32(buf+6);
+    buf += 10;
+  } else {
+    seg->pts = 0;
+    seg->dts = 0;
+  }
+  seg->type = *buf;
+  seg->length = get_be16(buf+1);
+
+  if (pgs_fill(r, header_len + seg->length, &buf)) {
+    return PGS_ERROR_TRUNCATED;
+  }
+  seg->payload = buf + header_len;
+  r->pending = header_len + seg->length;
+  STATS_ADD(STATS_SEGMENTS, 1);
+  return 0;
+}
+
+
+static int pgs_header_at(int fd, uint64_t offset, uint64_t size, uint32_t *pts, int *type,
+                         uint64_t *next) {
+  /*
+   * Reads the .sup header at offset, returning 0 if it is plausibly a
+   * segment: "PG", a known type, and either the end of the file or
+   * another "PG" straight after it.
+   */
+  uint8_t buf[PGS_SUP_HEADER];
+  if (offset + PGS_SUP_HEADER > size ||
+      pread(fd, buf, PGS_SUP_HEADER, offset) != PGS_SUP_HEADER ||
+      buf[0] != 'P' || buf[1] != 'G') {
+    return -1;
+  }
+  *type = buf[10];
+  if (*type != PALETTE_SEGMENT && *type != PICTURE_SEGMENT && *type != PRESENTATION_SEGMENT &&
+      *type != WINDOW_SEGMENT && *type != DISPLAY_SEGMENT) {
+    return -1;
+  }
+  *pts = get_be32(buf+2);
+  *next = offset + PGS_SUP_HEADER + get_be16(buf+11);
+  if (*next > size) {
+    return -1;
+  }
+  if (*next + 2 <= size && (pread(fd, buf, 2, *next) != 2 || buf[0] != 'P' || buf[1] != 'G')) {
+    return -1;
+  }
+  return 0;
+}
+
+
+static uint64_t pgs_resync(int fd, uint64_t offset, uint64_t limit, uint64_t size) {
+  /*
+   * Finds the first segment starting at or after offset and before
+   * limit, which may be anywhere in the stream, by looking for "PG".
+   * Returns its offset, or UINT64_MAX if there is none.
+   */
+  uint8_t buf[4096];
+  while (offset < limit) {
+    ssize_t n = pread(fd, buf, sizeof(buf), offset);
+    if (n < 2) {
+      break;
+    }
+    uint8_t *p = buf;
+    while ((p = memchr(p, 'P', buf + n - 1 - p)) != NULL) {
+      uint64_t candidate = offset + (p - buf);
+      uint32_t pts;
+      int type;
+      uint64_t next;
+      if (candidate >= limit) {
+        return UINT64_MAX;
+      }
+      if (p[1] == 'G' && !pgs_header_at(fd, candidate, size, &pts, &type, &next)) {
+        return candidate;
+      }
+      ++p;
+    }
+    // Overlap by a byte so a "PG" across the boundary isn't missed
+    offset += n - 1;
+  }
+  return UINT64_MAX;
+}
+
+
+static int pgs_skip(pgs_reader *r, uint32_t pts) {
+  /*
+   * Seeks as pgs_seek does by reading segment after segment, for
+   * streams which can't be bisected, such as pipes.  The presentation
+   * found is left in the ring to be returned again by pgs_next, as is
+   * any error, so that the caller sees it along with its segment.
+   */
+  pgs_segment seg;
+  memset(&seg, 0, sizeof(pgs_segment));
+  int ret;
+  while (!(ret = pgs_next(r, &seg))) {
+    if (seg.type == PRESENTATION_SEGMENT && seg.pts >= pts) {
+      r->pending = 0;
+      return 0;
+    }
+  }
+  return (ret == PGS_EOF) ? PGS_EOF : 0;
+}
+
+
+int pgs_seek(pgs_reader *r, uint32_t pts) {
+  /*
+   * Moves a .sup stream on to the first presentation segment whose
+   * timestamp is at least pts, so that the next pgs_next returns it.
+   * Bisects the file, resynchronising on "PG" wherever it lands, until
+   * little is left to walk, so only a few pages are read however long
+   * the stream; the timestamps are assumed not to go backwards.  A
+   * stream which isn't a file, such as a pipe, is read through to the
+   * presentation instead.  Returns 0 on success, PGS_EOF if there is
+   * no such presentation, or PGS_ERROR_SEEK for a bare stream, which
+   * has no timestamps.
+   */
+  if (r->framing != PGS_FRAMING_SUP) {
+    return PGS_ERROR_SEEK;
+  }
+  int fd = fileno(r->f);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode) || lseek(fd, 0, SEEK_CUR) < 0) {
+    return pgs_skip(r, pts);
+  }
+  uint64_t size = st.st_size;
+
+  stats_timer t;
+  STATS_BEGIN(t);
+  uint64_t lo = 0;
+  uint64_t hi = size;
+  uint32_t seg_pts;
+  int type;
+  uint64_t next;
+  while (hi - lo > PGS_SEEK_LINEAR) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    uint64_t offset = pgs_resync(fd, mid, hi, size);
+    if (offset == UINT64_MAX || pgs_header_at(fd, offset, size, &seg_pts, &type, &next)) {
+      hi = mid;
+    } else if (seg_pts < pts) {
+      lo = offset;
+    } else {
+      hi = mid;
+    }
+  }
+
+  // lo is the start of a segment before the one we want, so walk on
+  uint64_t offset = lo;
+  while (!pgs_header_at(fd, offset, size, &seg_pts, &type, &next)) {
+    if (type == PRESENTATION_SEGMENT && seg_pts >= pts) {
+      break;
+    }
+    offset = next;
+  }
+  STATS_END(STATS_IO_NS, t);
+  if (offset >= size) {
+    return PGS_EOF;
+  }
+
+  ring_consume(r->ring, ring_get_fill(r->ring));
+  r->pending = 0;
+  r->offset = offset;
+  if (fseeko(r->f, offset, SEEK_SET)) {
+    return PGS_ERROR_SEEK;
+  }
+  return 0;
+}
+
+
+pgs_writer *pgs_writer_open(pgs_reader *r, char *filename) {
+  /*
+   * Opens an output stream whose segments are mostly copied from the
+   * stream being read by r, or standard output if filename is "-".
+   * If r's stream is a pipe, segments are written from memory instead.
+   * Returns NULL if the file cannot be opened (errno may be inspected
+   * to determine the cause) or memory cannot be allocated.  The writer
+   * must be closed with pgs_writer_close.
+   */
+  pgs_writer *w = malloc(sizeof(pgs_writer));
+  if (w == NULL) {
+    return NULL;
+  }
+  w->fd_in = fileno(r->f);
+  if (!strcmp(filename, "-")) {
+    w->fd_out = STDOUT_FILENO;
+  } else {
+    w->fd_out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (w->fd_out < 0) {
+      free(w);
+      return NULL;
+    }
+  }
+  w->copy_offset = 0;
+  w->copy_len = 0;
+  w->method = PGS_COPY_FILE_RANGE;
+  w->error = 0;
+
+  // Nothing can be copied by offset from a pipe, so segments are
+  // written from the reader's ring instead
+  if (w->fd_in < 0 || lseek(w->fd_in, 0, SEEK_CUR) < 0) {
+    w->method = PGS_COPY_NONE;
+  }
+  return w;
+}
+
+
+static int pgs_write_all(int fd, uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+static int pgs_copy_range(pgs_writer *w, uint64_t offset, size_t len) {
+  /*
+   * Copies len bytes from offset in the input to the output, inside
+   * the kernel where possible: copy_file_range between files, splice
+   * into a pipe, and only otherwise through a buffer here.  The first
+   * method to fail as unsupported is not tried again.  Returns 0 on
+   * success or -1 on error.
+   */
+  while (len > 0) {
+    ssize_t n;
+    loff_t off = offset;
+    if (w->method == PGS_COPY_FILE_RANGE) {
+      n = copy_file_range(w->fd_in, &off, w->fd_out, NULL, len, 0);
+      if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                    errno == EOPNOTSUPP || errno == EBADF)) {
+        w->method = PGS_COPY_SPLICE;
+        continue;
+      }
+    } else if (w->method == PGS_COPY_SPLICE) {
+      n = splice(w->fd_in, &off, w->fd_out, NULL, len, 0);
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        w->method = PGS_COPY_READ;
+        continue;
+      }
+    } else {
+      uint8_t buf[65536];
+      n = pread(w->fd_in, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+      if (n > 0 && pgs_write_all(w->fd_out, buf, n)) {
+        return -1;
+      }
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // Nothing more in the input counts as an error too
+      return -1;
+    }
+    STATS_ADD(STATS_BYTES_WRITTEN, n);
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+static void pgs_writer_flush(pgs_writer *w) {
+  if (w->copy_len > 0 && !w->error) {
+    stats_timer t;
+    STATS_BEGIN(t);
+    if (pgs_copy_range(w, w->copy_offset, w->copy_len)) {
+      w->error = PGS_ERROR_WRITE;
+    }
+    STATS_END(STATS_IO_NS, t);
+  }
+  w->copy_len = 0;
+}
+
+
+void pgs_write_segment(pgs_writer *w, pgs_segment *seg) {
+  /*
+   * Passes a segment of the input through unchanged.  Nothing is
+   * copied yet: runs of consecutive segments are copied in one go,
+   * once a segment which doesn't follow on is written, or the writer
+   * is closed.  If the input can't be copied from, the segment is
+   * written straight away from where it was read into memory.
+   */
+  size_t len = seg->header_len + seg->length;
+  if (w->method == PGS_COPY_NONE) {
+    if (w->error) {
+      return;
+    }
+    if (pgs_write_all(w->fd_out, seg->payload - seg->header_len, len)) {
+      w->error = PGS_ERROR_WRITE;
+      return;
+    }
+    STATS_ADD(STATS_BYTES_WRITTEN, len);
+    return;
+  }
+  if (w->copy_len > 0 && w->copy_offset + w->copy_len == seg->offset) {
+    w->copy_len += len;
+    return;
+  }
+  pgs_writer_flush(w);
+  w->copy_offset = seg->offset;
+  w->copy_len = len;
+}
+
+
+void pgs_write_data(pgs_writer *w, pgs_segment *seg, uint8_t *payload, int length) {
+  /*
+   * Writes a segment built here rather than copied from the input,
+   * with the type, framing and timestamps of seg but the given
+   * payload.
+   */
+  pgs_writer_flush(w);
+  if (w->error) {
+    return;
+  }
+  uint8_t header[PGS_SUP_HEADER] = { 'P', 'G',
+                                     seg->pts >> 24, seg->pts >> 16, seg->pts >> 8, seg->pts,
+                                     seg->dts >> 24, seg->dts >> 16, seg->dts >> 8, seg->dts };
+  uint8_t *h = header + seg->header_len - PGS_BARE_HEADER;
+  h[0] = seg->type;
+  h[1] = length >> 8;
+  h[2] = length & 0xff;
+  if (pgs_write_all(w->fd_out, header, seg->header_len) || pgs_write_all(w->fd_out, payload, length)) {
+    w->error = PGS_ERROR_WRITE;
+    return;
+  }
+  STATS_ADD(STATS_BYTES_WRITTEN, seg->header_len + length);
+}
+
+
+int pgs_writer_close(pgs_writer *w) {
+  /*
+   * Copies whatever is still pending and closes the output.  Returns 0
+   * on success or PGS_ERROR_WRITE if anything could not be written.
+   */
+  pgs_writer_flush(w);
+  int error = w->error;
+  if (w->fd_out != STDOUT_FILENO && close(w->fd_out)) {
+    error = PGS_ERROR_WRITE;
+  }
+  free(w);
+  return error;
+}
+
+
+int pgs_parse_presentation(pgs_segment *seg, pgs_presentation *pres) {
+  /*
+   * Counts the objects and forced objects in a presentation segment.
+   * Returns 0 on success or PGS_ERROR_PRESENTATION if the number of
+   * objects doesn't match the length of the segment; nr_objects is
+   * set either way.
+   */
+  uint8_t *buf = seg->payload;
+  pres->nr_objects = (seg->length > 10) ? buf[10] : 0;
+  pres->nr_forced = 0;
+  pres->forced_mask = 0;
+  if (seg->length - 11 != 8*pres->nr_objects) {
+    return PGS_ERROR_PRESENTATION;
+  }
+
+  uint8_t *buf_cur = buf + 11;
+  int i;
+  for (i=0; i < pres->nr_objects; i++) {
+    if (buf_cur[8*i+3] & 0x40) {
+      pres->nr_forced++;
+      if (i < 8) {
+        pres->forced_mask |= 1 << i;
+      }
+    }
+  }
+  return 0;
+}
+
+
+static int pgs_header_in(pgs_range *range, uint64_t offset, pgs_segment *seg) {
+  /*
+   * Reads the segment at offset in a mapped stream as pgs_next would.
+   * Returns 0, PGS_EOF if not even the header is there,
+   * PGS_ERROR_SYNC or PGS_ERROR_TRUNCATED.
+   */
+  int header_len = (range->framing == PGS_FRAMING_SUP) ? PGS_SUP_HEADER : PGS_BARE_HEADER;
+  memset(seg, 0, sizeof(pgs_segment));
+  seg->offset = offset;
+  seg->header_len = header_len;
+  if (offset + header_len > range->size) {
+    return PGS_EOF;
+  }
+  uint8_t *buf = range->data + offset;
+  if (range->framing == PGS_FRAMING_SUP) {
+    if (buf[0] != 'P' || buf[1] != 'G') {
+      return PGS_ERROR_SYNC;
+    }
+    seg->pts = get_be32(buf+2);
+    seg->dts = get_be32(buf+6);
+    buf += 10;
+  }
+  seg->type = buf[0];
+  seg->length = get_be16(buf+1);
+  seg->payload = range->data + offset + header_len;
+  if (offset + header_len + seg->length > range->size) {
+    return PGS_ERROR_TRUNCATED;
+  }
+  return 0;
+}
+
+
+static uint64_t pgs_walk(pgs_range *range, uint64_t offset, uint64_t limit, int *error) {
+  /*
+   * Steps from segment to segment, starting at offset, until reaching
+   * limit.  Returns where it stopped, with error set to 0, or to why
+   * it stopped short.
+   */
+  pgs_segment seg;
+  *error = 0;
+  while (offset < limit) {
+    if ((*error = pgs_header_in(range, offset, &seg))) {
+      break;
+    }
+    offset += seg.header_len + seg.length;
+  }
+  return offset;
+}
+
+
+static uint64_t pgs_find_boundary(pgs_range *range, uint64_t offset) {
+  /*
+   * Finds the first offset from which a chain of plausible segments
+   * follows, which is very probably a segment boundary.  Returns the
+   * size of the stream if there is none.
+   */
+  for (; offset < range->size; ++offset) {
+    uint64_t next = offset;
+    pgs_segment seg;
+    int i;
+    for (i=0; i < PGS_RESYNC_CHAIN && next < range->size; ++i) {
+      if (pgs_header_in(range, next, &seg)) {
+        break;
+      }
+      if (seg.type != PALETTE_SEGMENT && seg.type != PICTURE_SEGMENT &&
+          seg.type != PRESENTATION_SEGMENT && seg.type != WINDOW_SEGMENT &&
+          seg.type != DISPLAY_SEGMENT) {
+        break;
+      }
+      next += seg.header_len + seg.length;
+    }
+    if (i == PGS_RESYNC_CHAIN || next == range->size) {
+      return offset;
+    }
+  }
+  return range->size;
+}
+
+
+static void *pgs_range_find(void *arg) {
+  /*
+   * Guesses where the range's first segment is, and walks to the end
+   * of the range from there.
+   */
+  pgs_range *range = arg;
+  if (range->start != 0) {
+    range->start = pgs_find_boundary(range, range->start);
+  }
+  range->stop = pgs_walk(range, range->start, range->split, &range->error);
+  return NULL;
+}
+
+
+static void *pgs_range_scan(void *arg) {
+  /*
+   * Passes each segment of the range to the callback, until it asks
+   * to stop.
+   */
+  pgs_range *range = arg;
+  stats_timer t;
+  STATS_BEGIN(t);
+  uint64_t offset = range->start;
+  pgs_segment seg;
+  while (offset < range->stop) {
+    pgs_header_in(range, offset, &seg);
+    STATS_ADD(STATS_SEGMENTS, 1);
+    STATS_ADD(STATS_BYTES_READ, seg.header_len + seg.length);
+    if (range->fn(range->ctx, &seg)) {
+      break;
+    }
+    offset += seg.header_len + seg.length;
+  }
+  STATS_END(STATS_PARSE_NS, t);
+  return NULL;
+}
+
+
+static int pgs_run_ranges(pgs_range *ranges, int nr_ranges, void *(*fn)(void *)) {
+  /*
+   * Runs fn on each range on a thread of its own, or inline if a
+   * thread can't be started.  Returns 0 on success or
+   * PGS_ERROR_ALLOC.
+   */
+  pthread_t *threads = calloc(nr_ranges, sizeof(pthread_t));
+  int *started = calloc(nr_ranges, sizeof(int));
+  if (threads == NULL || started == NULL) {
+    free(threads);
+    free(started);
+    return PGS_ERROR_ALLOC;
+  }
+  int i;
+  for (i=0; i < nr_ranges; ++i) {
+    started[i] = !pthread_create(&threads[i], NULL, fn, &ranges[i]);
+    if (!started[i]) {
+      fn(&ranges[i]);
+    }
+  }
+  for (i=0; i < nr_ranges; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+  free(threads);
+  free(started);
+  return 0;
+}
+
+
+int pgs_scan_parallel(char *filename, int nr_threads, pgs_segment_fn fn, void **ctxs,
+                      int *nr_ranges, pgs_segment *bad) {
+  /*
+   * Scans a whole stream on up to nr_threads threads, passing every
+   * segment to fn in the same way as a loop over pgs_next, except that
+   * the stream is split into consecutive ranges, each with its own
+   * context from ctxs, and the ranges are scanned at the same time.
+   * fn returns non-zero to stop its range.  nr_ranges is set to the
+   * number of contexts used, which the caller should merge in order
+   * to get the same results as a serial scan.
+   *
+   * Ranges are split at nominal offsets, then each range looks for
+   * the first offset from which several plausible segments follow and
+   * walks the segment headers from there to the end of the range, in
+   * parallel.  Where a range's walk doesn't end where the next range
+   * started, that range guessed wrong and is walked again from the
+   * right place, so the ranges always meet exactly where a serial
+   * scan would go from one to the next.
+   *
+   * Returns 0 on success, PGS_ERROR_TRUNCATED or PGS_ERROR_SYNC as
+   * pgs_next would at the end of the last range, with bad filled in,
+   * PGS_ERROR_MAP if the stream can't be mapped (e.g. a pipe), in
+   * which case nothing has been scanned, or PGS_ERROR_ALLOC.
+   */
+  *nr_ranges = 0;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return PGS_ERROR_MAP;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return PGS_ERROR_MAP;
+  }
+  uint64_t size = st.st_size;
+  uint8_t *data = NULL;
+  if (size > 0) {
+    stats_timer t;
+    STATS_BEGIN(t);
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    STATS_END(STATS_IO_NS, t);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return PGS_ERROR_MAP;
+    }
+  }
+  close(fd);
+
+  if (size / PGS_PARALLEL_MIN_RANGE < (uint64_t)nr_threads) {
+    nr_threads = size / PGS_PARALLEL_MIN_RANGE;
+  }
+  if (nr_threads < 1) {
+    nr_threads = 1;
+  }
+  pgs_range *ranges = calloc(nr_threads, sizeof(pgs_range));
+  if (ranges == NULL) {
+    if (data != NULL) munmap(data, size);
+    return PGS_ERROR_ALLOC;
+  }
+  enum pgs_framing framing = (size >= 2 && data[0] == 'P' && data[1] == 'G') ?
+    PGS_FRAMING_SUP : PGS_FRAMING_BARE;
+  int i;
+  for (i=0; i < nr_threads; ++i) {
+    ranges[i].data = data;
+    ranges[i].size = size;
+    ranges[i].framing = framing;
+    ranges[i].start = size / nr_threads * i;
+    ranges[i].split = (i == nr_threads - 1) ? size : size / nr_threads * (i + 1);
+    ranges[i].fn = fn;
+    ranges[i].ctx = ctxs[i];
+  }
+
+  int error = pgs_run_ranges(ranges, nr_threads, pgs_range_find);
+
+  // Join the ranges up, walking again wherever a guess was wrong, and
+  // stop at the first range which ends in an error
+  uint64_t expected = 0;
+  int n = 0;
+  while (!error && n < nr_threads) {
+    pgs_range *range = &ranges[n++];
+    if (range->start != expected) {
+      range->start = expected;
+      range->stop = pgs_walk(range, range->start, range->split, &range->error);
+    }
+    expected = range->stop;
+    if (range->error) {
+      if (range->error != PGS_EOF) {
+        pgs_header_in(range, range->stop, bad);
+        error = range->error;
+      }
+      break;
+    }
+  }
+
+  if (error != PGS_ERROR_ALLOC && pgs_run_ranges(ranges, n, pgs_range_scan)) {
+    error = PGS_ERROR_ALLOC;
+  } else {
+    *nr_ranges = n;
+  }
+  free(ranges);
+  if (data != NULL) munmap(data, size);
+  return error;
+}
+
+
+char *pgs_strerror(int error_code) {
+  /*
+   * Returns a human-readable string explaining an error code.
+   */
+  if (error_code == PGS_EOF) {
+    return "End of file";
+  } else if (error_code == PGS_ERROR_TRUNCATED) {
+    return "The file ends part-way through a segment";
+  } else if (error_code == PGS_ERROR_ALLOC) {
+    return "Could not allocate memory";
+  } else if (error_code == PGS_ERROR_PRESENTATION) {
+    return "The number of objects in a presentation segment doesn't match its length";
+  } else if (error_code == PGS_ERROR_INDEX) {
+    return "Could not write the index";
+  } else if (error_code == PGS_ERROR_WRITE) {
+    return "Could not write the output stream";
+  } else if (error_code == PGS_ERROR_SYNC) {
+    return "A segment doesn't start with PG";
+  } else if (error_code == PGS_ERROR_SEEK) {
+    return "The stream has no timestamps to seek by";
+  } else if (error_code == PGS_ERROR_MAP) {
+    return "The stream could not be mapped";
+  } else if (error_code == PGS_ERROR_OBJECT) {
+    return "A picture segment or its run-length data is malformed";
+  } else if (error_code == PGS_ERROR_PALETTE) {
+    return "A palette segment is malformed";
+  } else {
+    return "Unknown error code";
+  }
+}
+
+
+pgs_index *pgs_index_alloc(void) {
+  /*
+   * Allocates an empty index, to be filled with pgs_index_add and
+   * freed with pgs_index_free.  Returns NULL if memory could not be
+   * allocated.
+   */
+  pgs_index *idx = malloc(sizeof(pgs_index));
+  if (idx == NULL) {
+    return NULL;
+  }
+  idx->nr_entries = 0;
+  idx->max_entries = 1024;
+  idx->entries = malloc(idx->max_entries * sizeof(pgs_index_entry));
+  if (idx->entries == NULL) {
+    free(idx);
+    return NULL;
+  }
+  return idx;
+}
+
+
+void pgs_index_free(pgs_index *idx) {
+  free(idx->entries);
+  free(idx);
+}
+
+
+int pgs_index_merge(pgs_index *idx, pgs_index *other) {
+  /*
+   * Appends the entries of other to idx.  Returns 0 on success or
+   * PGS_ERROR_ALLOC.
+   */
+  if (idx->nr_entries + other->nr_entries > idx->max_entries) {
+    size_t max_entries = idx->max_entries;
+    while (idx->nr_entries + other->nr_entries > max_entries) {
+      max_entries *= 2;
+    }
+    STATS_ADD(STATS_REALLOCS, 1);
+    pgs_index_entry *new = realloc(idx->entries, max_entries * sizeof(pgs_index_entry));
+    if (new == NULL) {
+      return PGS_ERROR_ALLOC;
+    }
+    idx->entries = new;
+    idx->max_entries = max_entries;
+  }
+  memcpy(idx->entries + idx->nr_entries, other->entries, other->nr_entries * sizeof(pgs_index_entry));
+  idx->nr_entries += other->nr_entries;
+  return 0;
+}
+
+
+int pgs_index_add(pgs_index *idx, pgs_segment *seg) {
+  /*
+   * Records a segment in the index.  Returns 0 on success,
+   * PGS_ERROR_ALLOC, or PGS_ERROR_PRESENTATION for an inconsistent
+   * presentation segment (which is not recorded).
+   */
+  if (idx->nr_entries == idx->max_entries) {
+    STATS_ADD(STATS_REALLOCS, 1);
+    pgs_index_entry *new = realloc(idx->entries, 2 * idx->max_entries * sizeof(pgs_index_entry));
+    if (new == NULL) {
+      return PGS_ERROR_ALLOC;
+    }
+    idx->entries = new;
+    idx->max_entries *= 2;
+  }
+
+  pgs_index_entry *e = &idx->entries[idx->nr_entries];
+  memset(e, 0, sizeof(pgs_index_entry));
+  e->offset = seg->offset;
+  e->pts = seg->pts;
+  e->header_len = seg->header_len;
+  e->length = seg->length;
+  e->type = seg->type;
+  if (seg->type == PRESENTATION_SEGMENT) {
+    pgs_presentation pres;
+    if (pgs_parse_presentation(seg, &pres)) {
+      return PGS_ERROR_PRESENTATION;
+    }
+    e->nr_objects = pres.nr_objects;
+    e->nr_forced = pres.nr_forced;
+    e->forced_mask = pres.forced_mask;
+  }
+  ++idx->nr_entries;
+  return 0;
+}
+
+
+static void pgs_index_stamp(pgs_index_header *h, struct stat *st, uint64_t nr_entries) {
+  memset(h, 0, sizeof(pgs_index_header));
+  memcpy(h->magic, PGS_INDEX_MAGIC, 8);
+  h->byte_order = 0x01020304;
+  h->version = PGS_INDEX_VERSION;
+  h->nr_entries = nr_entries;
+  h->input_size = st->st_size;
+  h->input_dev = st->st_dev;
+  h->input_ino = st->st_ino;
+  h->input_mtime_sec = st->st_mtim.tv_sec;
+  h->input_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+
+int pgs_index_write(pgs_index *idx, char *index_name, char *input_name) {
+  /*
+   * Writes the index for input_name to index_name, stamped with the
+   * input's size, identity and modification time so that
+   * pgs_index_load can tell when it is out of date.  The index is
+   * written to a temporary file and renamed into place, so a reader
+   * never sees a partial index.  Returns 0 on success or
+   * PGS_ERROR_INDEX (errno may be inspected to determine the cause).
+   */
+  struct stat st;
+  if (stat(input_name, &st)) {
+    return PGS_ERROR_INDEX;
+  }
+  pgs_index_header h;
+  pgs_index_stamp(&h, &st, idx->nr_entries);
+
+  char *tmp_name = malloc(strlen(index_name) + 5);
+  if (tmp_name == NULL) {
+    return PGS_ERROR_INDEX;
+  }
+  sprintf(tmp_name, "%s.tmp", index_name);
+
+  FILE *f = fopen(tmp_name, "wb");
+  if (f == NULL) {
+    free(tmp_name);
+    return PGS_ERROR_INDEX;
+  }
+  int error = fwrite(&h, sizeof(h), 1, f) != 1;
+  if (idx->nr_entries > 0) {
+    error |= fwrite(idx->entries, sizeof(pgs_index_entry), idx->nr_entries, f) != idx->nr_entries;
+  }
+  error |= fclose(f) != 0;
+  if (!error) {
+    error = rename(tmp_name, index_name) != 0;
+  }
+  if (error) {
+    remove(tmp_name);
+  }
+  free(tmp_name);
+  return error ? PGS_ERROR_INDEX : 0;
+}
+
+
+pgs_index *pgs_index_load(char *index_name, char *input_name) {
+  /*
+   * Loads the index for input_name from index_name.  Returns NULL if
+   * there is no usable index: it doesn't exist, is damaged, or was
+   * made from a different version of the input.  The index must be
+   * freed with pgs_index_free.
+   */
+  struct stat st;
+  if (stat(input_name, &st)) {
+    return NULL;
+  }
+
+  FILE *f = fopen(index_name, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+
+  pgs_index_header h, expected;
+  struct stat index_st;
+  if (fread(&h, sizeof(h), 1, f) != 1 || fstat(fileno(f), &index_st)) {
+    fclose(f);
+    return NULL;
+  }
+  pgs_index_stamp(&expected, &st, h.nr_entries);
+  if (memcmp(&h, &expected, sizeof(h)) ||
+      (uint64_t)index_st.st_size != sizeof(h) + h.nr_entries * sizeof(pgs_index_entry)) {
+    fclose(f);
+    return NULL;
+  }
+
+  pgs_index *idx = malloc(sizeof(pgs_index));
+  if (idx == NULL) {
+    fclose(f);
+    return NULL;
+  }
+  idx->nr_entries = h.nr_entries;
+  idx->max_entries = h.nr_entries ? h.nr_entries : 1;
+  idx->entries = malloc(idx->max_entries * sizeof(pgs_index_entry));
+  if (idx->entries == NULL ||
+      fread(idx->entries, sizeof(pgs_index_entry), idx->nr_entries, f) != idx->nr_entries) {
+    fclose(f);
+    free(idx->entries);
+    free(idx);
+    return NULL;
+  }
+  fclose(f);
+  return idx;
+}
@@ -0,0 +1,185 @@
+/*
+ *  Copyright Andrew Ryrie 2013
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ring_buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum segment_type {
+  PALETTE_SEGMENT      = 0x14,
+  PICTURE_SEGMENT      = 0x15,
+  PRESENTATION_SEGMENT = 0x16,
+  WINDOW_SEGMENT       = 0x17,
+  DISPLAY_SEGMENT      = 0x80,
+};
+
+// Errors which might be encountered while reading a stream
+extern int PGS_EOF;
+extern int PGS_ERROR_TRUNCATED;
+extern int PGS_ERROR_ALLOC;
+extern int PGS_ERROR_PRESENTATION;
+extern int PGS_ERROR_INDEX;
+extern int PGS_ERROR_WRITE;
+extern int PGS_ERROR_SYNC;
+extern int PGS_ERROR_SEEK;
+extern int PGS_ERROR_MAP;
+extern int PGS_ERROR_OBJECT;
+extern int PGS_ERROR_PALETTE;
+
+// How segments are framed: bare, as a type and a length, or as in .sup
+// files, where "PG" and the presentation and decoding timestamps come
+// first
+enum pgs_framing {
+  PGS_FRAMING_BARE,
+  PGS_FRAMING_SUP,
+};
+
+#define PGS_BARE_HEADER 3
+#define PGS_SUP_HEADER 13
+
+// The largest possible segment, including its header
+#define PGS_MAX_SEGMENT (PGS_SUP_HEADER + 65535)
+
+// Timestamps count at 90kHz
+#define PGS_TICKS_PER_MS 90
+
+typedef struct {
+  // Offset of the segment's header in the file
+  uint64_t offset;
+
+  // Segment type, the length of its header and the length of its
+  // payload
+  int type;
+  int header_len;
+  int length;
+
+  // Presentation and decoding timestamps, or 0 for bare segments
+  uint32_t pts;
+  uint32_t dts;
+
+  // The payload, valid until the next segment is read
+  uint8_t *payload;
+} pgs_segment;
+
+// Called by pgs_scan_parallel for each segment, with the context of
+// the range it is in; returns non-zero to stop scanning the range
+typedef int (*pgs_segment_fn)(void *ctx, pgs_segment *seg);
+
+typedef struct {
+  FILE *f;
+  Ring *ring;
+  enum pgs_framing framing;
+
+  // Offset in the file of the next segment
+  uint64_t offset;
+
+  // Size of the segment last returned, still to be removed from the ring
+  size_t pending;
+} pgs_reader;
+
+// How a writer copies segments from its input, from the best down
+enum pgs_copy_method {
+  PGS_COPY_FILE_RANGE,
+  PGS_COPY_SPLICE,
+  PGS_COPY_READ,
+
+  // The input isn't seekable, so segments are written from memory
+  PGS_COPY_NONE,
+};
+
+// A stream written mostly by copying ranges of the input stream, so
+// that segments which pass through never come into user space
+typedef struct {
+  int fd_in;
+  int fd_out;
+
+  // The range of the input still to be copied
+  uint64_t copy_offset;
+  size_t copy_len;
+
+  enum pgs_copy_method method;
+  int error;
+} pgs_writer;
+
+// The objects in a presentation segment which matter for forced
+// subtitles
+typedef struct {
+  int nr_objects;
+  int nr_forced;
+
+  // Bit i is set if object i is forced, for the first 8 objects
+  uint8_t forced_mask;
+} pgs_presentation;
+
+// One segment of a stream as recorded in an index.  Written to disk
+// as-is, so the layout must not change without changing the version.
+typedef struct {
+  uint64_t offset;
+  uint32_t pts;
+  uint16_t length;
+  uint8_t type;
+  uint8_t nr_objects;
+  uint8_t nr_forced;
+  uint8_t forced_mask;
+  uint8_t header_len;
+  uint8_t pad[5];
+} pgs_index_entry;
+
+typedef struct {
+  pgs_index_entry *entries;
+  size_t nr_entries;
+  size_t max_entries;
+} pgs_index;
+
+
+int get_be16(uint8_t *buf);
+uint32_t get_be32(uint8_t *buf);
+
+pgs_reader *pgs_open(char *filename);
+pgs_reader *pgs_open_stream(FILE *f);
+void pgs_close(pgs_reader *r);
+int pgs_next(pgs_reader *r, pgs_segment *seg);
+int pgs_seek(pgs_reader *r, uint32_t pts);
+int pgs_scan_parallel(char *filename, int nr_threads, pgs_segment_fn fn, void **ctxs,
+                      int *nr_ranges, pgs_segment *bad);
+int pgs_parse_presentation(pgs_segment *seg, pgs_presentation *pres);
+char *pgs_strerror(int error_code);
+
+pgs_writer *pgs_writer_open(pgs_reader *r, char *filename);
+void pgs_write_segment(pgs_writer *w, pgs_segment *seg);
+void pgs_write_data(pgs_writer *w, pgs_segment *seg, uint8_t *payload, int length);
+int pgs_writer_close(pgs_writer *w);
+
+pgs_index *pgs_index_alloc(void);
+void pgs_index_free(pgs_index *idx);
+int pgs_index_merge(pgs_index *idx, pgs_index *other);
+int pgs_index_add(pgs_index *idx, pgs_segment *seg);
+int pgs_index_write(pgs_index *idx, char *index_name, char *input_name);
+pgs_index *pgs_index_load(char *index_name, char *input_name);
+
+#ifdef __cplusplus
+}
+#endif
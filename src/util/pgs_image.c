@@ -0,0 +1,358 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pgs_image.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// BT.709 limited range to RGB, in fixed point with 10 fractional bits
+#define PGS_COEF_Y 1192
+#define PGS_COEF_R_CR 1836
+#define PGS_COEF_G_CB -218
+#define PGS_COEF_G_CR -546
+#define PGS_COEF_B_CB 2163
+
+
+void pgs_palette_init(pgs_palette *pal) {
+  /*
+   * Makes every entry of a palette transparent black.
+   */
+  pal->id = 0;
+  pal->version = 0;
+  memset(pal->rgba, 0, sizeof(pal->rgba));
+}
+
+
+static uint8_t pgs_clamp(int v) {
+  return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+
+void pgs_ycbcr_to_rgba(const uint8_t *y, const uint8_t *cr, const uint8_t *cb, const uint8_t *alpha,
+                       size_t n, uint32_t *rgba) {
+  /*
+   * Converts n colours from separate Y, Cr, Cb and alpha arrays to
+   * RGBA.  Eight at a time go through SSE2 with the same integer
+   * arithmetic as the scalar code, so the results don't depend on
+   * which did the work.
+   */
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i coef_r = _mm_set_epi16(PGS_COEF_R_CR, PGS_COEF_Y, PGS_COEF_R_CR, PGS_COEF_Y,
+                                       PGS_COEF_R_CR, PGS_COEF_Y, PGS_COEF_R_CR, PGS_COEF_Y);
+  const __m128i coef_g = _mm_set_epi16(PGS_COEF_G_CB, PGS_COEF_Y, PGS_COEF_G_CB, PGS_COEF_Y,
+                                       PGS_COEF_G_CB, PGS_COEF_Y, PGS_COEF_G_CB, PGS_COEF_Y);
+  const __m128i coef_g_cr = _mm_set_epi16(0, PGS_COEF_G_CR, 0, PGS_COEF_G_CR,
+                                          0, PGS_COEF_G_CR, 0, PGS_COEF_G_CR);
+  const __m128i coef_b = _mm_set_epi16(PGS_COEF_B_CB, PGS_COEF_Y, PGS_COEF_B_CB, PGS_COEF_Y,
+                                       PGS_COEF_B_CB, PGS_COEF_Y, PGS_COEF_B_CB, PGS_COEF_Y);
+  const __m128i round = _mm_set1_epi32(512);
+  for (; i + 8 <= n; i += 8) {
+    __m128i y16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + i)), zero),
+                                _mm_set1_epi16(16));
+    __m128i cr16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cr + i)), zero),
+                                 _mm_set1_epi16(128));
+    __m128i cb16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cb + i)), zero),
+                                 _mm_set1_epi16(128));
+    __m128i a16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(alpha + i)), zero);
+
+    // Pair Y with a chroma term so that each madd does two products
+    __m128i y_cr_lo = _mm_unpacklo_epi16(y16, cr16);
+    __m128i y_cr_hi = _mm_unpackhi_epi16(y16, cr16);
+    __m128i y_cb_lo = _mm_unpacklo_epi16(y16, cb16);
+    __m128i y_cb_hi = _mm_unpackhi_epi16(y16, cb16);
+    __m128i cr_lo = _mm_unpacklo_epi16(cr16, zero);
+    __m128i cr_hi = _mm_unpackhi_epi16(cr16, zero);
+
+    __m128i r_lo = _mm_add_epi32(_mm_madd_epi16(y_cr_lo, coef_r), round);
+    __m128i r_hi = _mm_add_epi32(_mm_madd_epi16(y_cr_hi, coef_r), round);
+    __m128i g_lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(y_cb_lo, coef_g),
+                                               _mm_madd_epi16(cr_lo, coef_g_cr)), round);
+    __m128i g_hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(y_cb_hi, coef_g),
+                                               _mm_madd_epi16(cr_hi, coef_g_cr)), round);
+    __m128i b_lo = _mm_add_epi32(_mm_madd_epi16(y_cb_lo, coef_b), round);
+    __m128i b_hi = _mm_add_epi32(_mm_madd_epi16(y_cb_hi, coef_b), round);
+
+    // Saturate to bytes, giving r0..r7 g0..g7 and b0..b7 a0..a7
+    __m128i rg = _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(r_lo, 10), _mm_srai_epi32(r_hi, 10)),
+                                  _mm_packs_epi32(_mm_srai_epi32(g_lo, 10), _mm_srai_epi32(g_hi, 10)));
+    __m128i ba = _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(b_lo, 10), _mm_srai_epi32(b_hi, 10)),
+                                  a16);
+
+    // Interleave into r g b a for each colour
+    rg = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+    ba = _mm_unpacklo_epi8(ba, _mm_srli_si128(ba, 8));
+    _mm_storeu_si128((__m128i *)(rgba + i), _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i *)(rgba + i + 4), _mm_unpackhi_epi16(rg, ba));
+  }
+#endif
+  for (; i < n; i++) {
+    int yy = y[i] - 16;
+    int r = cr[i] - 128;
+    int b = cb[i] - 128;
+    uint8_t px[4] = {
+      pgs_clamp((PGS_COEF_Y*yy + PGS_COEF_R_CR*r + 512) >> 10),
+      pgs_clamp((PGS_COEF_Y*yy + PGS_COEF_G_CB*b + PGS_COEF_G_CR*r + 512) >> 10),
+      pgs_clamp((PGS_COEF_Y*yy + PGS_COEF_B_CB*b + 512) >> 10),
+      alpha[i]
+    };
+    memcpy(rgba + i, px, 4);
+  }
+}
+
+
+int pgs_parse_palette(pgs_segment *seg, pgs_palette *pal) {
+  /*
+   * Sets the entries of a palette given by a palette segment, which
+   * are converted to RGBA all together.  Returns 0 on success or
+   * PGS_ERROR_PALETTE if the segment is the wrong length, in which
+   * case the palette is unchanged.
+   */
+  if (seg->length < 2 || (seg->length - 2) % 5) {
+    return PGS_ERROR_PALETTE;
+  }
+  uint8_t *buf = seg->payload;
+  pal->id = buf[0];
+  pal->version = buf[1];
+
+  // Split the entries into arrays for the conversion, then put the
+  // results where they belong
+  int n = (seg->length - 2) / 5;
+  if (n > 256) {
+    n = 256;
+  }
+  uint8_t ids[256] = { 0 }, y[256] = { 0 }, cr[256] = { 0 }, cb[256] = { 0 }, alpha[256] = { 0 };
+  uint32_t rgba[256];
+  int i;
+  for (i=0; i < n; i++) {
+    uint8_t *entry = buf + 2 + 5*i;
+    ids[i] = entry[0];
+    y[i] = entry[1];
+    cr[i] = entry[2];
+    cb[i] = entry[3];
+    alpha[i] = entry[4];
+  }
+  pgs_ycbcr_to_rgba(y, cr, cb, alpha, n, rgba);
+  for (i=0; i < n; i++) {
+    pal->rgba[ids[i]] = rgba[i];
+  }
+  return 0;
+}
+
+
+void pgs_object_init(pgs_object *obj) {
+  memset(obj, 0, sizeof(pgs_object));
+}
+
+
+void pgs_object_free(pgs_object *obj) {
+  free(obj->data);
+  pgs_object_init(obj);
+}
+
+
+int pgs_object_add(pgs_object *obj, pgs_segment *seg) {
+  /*
+   * Adds a picture segment to an object: the first segment of an
+   * object starts it afresh and later ones append to its data.  The
+   * buffer is kept from one object to the next, growing when it must.
+   * Returns 0 on success, PGS_ERROR_OBJECT if the segment is malformed
+   * or continues an object which hasn't been started, or
+   * PGS_ERROR_ALLOC.
+   */
+  uint8_t *buf = seg->payload;
+  if (seg->length < 4) {
+    return PGS_ERROR_OBJECT;
+  }
+  int id = get_be16(buf);
+  int first = buf[3] & 0x80;
+  int last = buf[3] & 0x40;
+  size_t header = 4;
+
+  if (first) {
+    if (seg->length < 11) {
+      return PGS_ERROR_OBJECT;
+    }
+    // The length covers the width and height too
+    size_t data_len = ((size_t)buf[4] << 16) | (buf[5] << 8) | buf[6];
+    obj->id = id;
+    obj->version = buf[2];
+    obj->expected_len = (data_len > 4) ? data_len - 4 : 0;
+    obj->width = get_be16(buf+7);
+    obj->height = get_be16(buf+9);
+    obj->len = 0;
+    obj->complete = 0;
+    header = 11;
+  } else if (obj->complete || obj->width == 0 || id != obj->id) {
+    return PGS_ERROR_OBJECT;
+  }
+
+  size_t len = seg->length - header;
+  if (obj->len + len > obj->max_len) {
+    size_t max_len = obj->max_len ? obj->max_len : 4096;
+    while (max_len < obj->len + len || max_len < obj->expected_len) {
+      max_len *= 2;
+    }
+    STATS_ADD(STATS_REALLOCS, 1);
+    uint8_t *data = realloc(obj->data, max_len);
+    if (data == NULL) {
+      return PGS_ERROR_ALLOC;
+    }
+    obj->data = data;
+    obj->max_len = max_len;
+  }
+  memcpy(obj->data + obj->len, buf + header, len);
+  obj->len += len;
+  obj->complete = (last != 0);
+  return 0;
+}
+
+
+static inline void pgs_fill_rgba(uint32_t *dst, uint32_t value, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128i v = _mm_set1_epi32(value);
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = value;
+  }
+}
+
+
+static inline int pgs_decode(pgs_object *obj, const uint32_t *palette, void *out, size_t stride) {
+  /*
+   * Decodes the run-length data of an object into rows stride pixels
+   * apart: RGBA through palette if it is given, or else palette
+   * indices.  Every code in the data is a run (a lone pixel being a
+   * run of one), written with a fill, so nothing is done pixel by
+   * pixel.  Every pixel of the object is written: a line which ends
+   * early is made up with colour 0, as are any lines missing at the
+   * end.  Returns 0 on success or PGS_ERROR_OBJECT if the data is
+   * malformed or the object incomplete, having decoded what it could;
+   * runs past the end of a line are cut short.
+   */
+  const uint8_t *p = obj->data;
+  const uint8_t *end = obj->data + obj->len;
+  int width = obj->width;
+  int height = obj->height;
+  int error = !obj->complete;
+  int x = 0;
+  int y = 0;
+  uint32_t *row32 = out;
+  uint8_t *row8 = out;
+
+  while (y < height && p < end) {
+    int color;
+    int run;
+    if (*p) {
+      color = *p++;
+      run = 1;
+    } else {
+      // 0 then a flags byte: end of line, or a run of colour 0 or of
+      // the colour in the last byte, with a 6 or 14 bit length
+      int flags = (end - p > 1) ? p[1] : 0;
+      int need = 2 + ((flags & 0x40) != 0) + ((flags & 0x80) != 0);
+      if (end - p < need) {
+        error = 1;
+        break;
+      }
+      if (flags == 0) {
+        run = width - x;
+        color = 0;
+      } else {
+        run = flags & 0x3f;
+        if (flags & 0x40) {
+          run = (run << 8) | p[2];
+        }
+        color = (flags & 0x80) ? p[need-1] : 0;
+      }
+      p += need;
+      if (flags == 0) {
+        if (palette != NULL) {
+          pgs_fill_rgba(row32 + x, palette[0], run);
+        } else {
+          memset(row8 + x, 0, run);
+        }
+        x = 0;
+        y++;
+        row32 += stride;
+        row8 += stride;
+        continue;
+      }
+    }
+
+    if (run > width - x) {
+      error = 1;
+      run = width - x;
+    }
+    if (palette != NULL) {
+      pgs_fill_rgba(row32 + x, palette[color], run);
+    } else {
+      memset(row8 + x, color, run);
+    }
+    x += run;
+  }
+
+  // Make up whatever the data didn't cover
+  if (y < height) {
+    error = 1;
+  }
+  for (; y < height; y++) {
+    if (palette != NULL) {
+      pgs_fill_rgba(row32 + x, palette[0], width - x);
+    } else {
+      memset(row8 + x, 0, width - x);
+    }
+    x = 0;
+    row32 += stride;
+    row8 += stride;
+  }
+  return error ? PGS_ERROR_OBJECT : 0;
+}
+
+
+int pgs_object_decode(pgs_object *obj, pgs_palette *pal, uint32_t *rgba, size_t stride) {
+  /*
+   * Decodes an object into a caller's buffer of RGBA pixels, as in
+   * pgs_palette, with rows stride pixels apart; the buffer must have
+   * room for the object's width and height.  Returns 0 on success or
+   * PGS_ERROR_OBJECT if the object is malformed or incomplete, in
+   * which case every pixel is still written.
+   */
+  return pgs_decode(obj, pal->rgba, rgba, stride);
+}
+
+
+int pgs_object_decode_indices(pgs_object *obj, uint8_t *indices, size_t stride) {
+  /*
+   * Decodes an object as palette indices, one byte a pixel, otherwise
+   * as pgs_object_decode.
+   */
+  return pgs_decode(obj, NULL, indices, stride);
+}
@@ -0,0 +1,71 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pgs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A palette, with each of its 256 entries as R, G, B and A bytes in
+// that order in memory.  Entries a palette segment doesn't set are
+// left as they were, so start from pgs_palette_init.
+typedef struct {
+  int id;
+  int version;
+  uint32_t rgba[256];
+} pgs_palette;
+
+// An object, put together from one or more picture segments
+typedef struct {
+  int id;
+  int version;
+  int width;
+  int height;
+
+  // The run-length encoded bitmap, how long the first segment said it
+  // would be, and the room allocated for it
+  uint8_t *data;
+  size_t len;
+  size_t expected_len;
+  size_t max_len;
+
+  // Set once the last segment of the object has been added
+  int complete;
+} pgs_object;
+
+void pgs_palette_init(pgs_palette *pal);
+int pgs_parse_palette(pgs_segment *seg, pgs_palette *pal);
+void pgs_ycbcr_to_rgba(const uint8_t *y, const uint8_t *cr, const uint8_t *cb, const uint8_t *alpha,
+                       size_t n, uint32_t *rgba);
+
+void pgs_object_init(pgs_object *obj);
+void pgs_object_free(pgs_object *obj);
+int pgs_object_add(pgs_object *obj, pgs_segment *seg);
+int pgs_object_decode(pgs_object *obj, pgs_palette *pal, uint32_t *rgba, size_t stride);
+int pgs_object_decode_indices(pgs_object *obj, uint8_t *indices, size_t stride);
+
+#ifdef __cplusplus
+}
+#endif
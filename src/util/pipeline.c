@@ -0,0 +1,277 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int PIPELINE_ERROR_POINT = -1;
+int PIPELINE_ERROR_POINT_ORDER = -2;
+
+
+static int pipeline_tokenize(int argc, char** argv, char*** tokens_out, int* nr_tokens_out) {
+  /*
+   * Splits the arguments into words, so that a chain may be given as
+   * one quoted argument or as many; | is always a word of its own.
+   * The words are in one block of memory, freed with the array.
+   * Returns 0 on success or 1 if memory could not be allocated.
+   */
+  size_t len = 0;
+  int i;
+  for (i=0; i < argc; ++i) {
+    len += strlen(argv[i]) + 1;
+  }
+
+  // At worst every other character starts a word
+  size_t max_tokens = len;
+  char** tokens = malloc(max_tokens * sizeof(char*) + 2*len);
+  if (tokens == NULL) {
+    return 1;
+  }
+  char* out = (char*) (tokens + max_tokens);
+  int nr_tokens = 0;
+
+  for (i=0; i < argc; ++i) {
+    char* c = argv[i];
+    while (*c) {
+      if (*c == ' ' || *c == '\t' || *c == '\n') {
+        ++c;
+        continue;
+      }
+      tokens[nr_tokens++] = out;
+      if (*c == '|') {
+        *out++ = *c++;
+      } else {
+        while (*c && *c != ' ' && *c != '\t' && *c != '\n' && *c != '|') {
+          *out++ = *c++;
+        }
+      }
+      *out++ = '\0';
+    }
+  }
+
+  *tokens_out = tokens;
+  *nr_tokens_out = nr_tokens;
+  return 0;
+}
+
+
+static int pipeline_parse_stage(int nr_args, char** args, pipeline_stage* stage) {
+  /*
+   * Parses one stage: its name followed by its parameters.  Returns 0
+   * on success, 1 if memory could not be allocated, 2 if a points file
+   * is unusable or 127 if the stage is invalid.
+   */
+  memset(stage, 0, sizeof(pipeline_stage));
+  if (nr_args == 0) {
+    return 127;
+  }
+
+  if (!strcmp(args[0], "offset")) {
+    stage->type = STAGE_OFFSET;
+    int i;
+    for (i=1; i < nr_args; i += 2) {
+      if (i+1 >= nr_args) {
+        return 127;
+      }
+      if (!strcmp(args[i], "-t")) {
+        if (retime_parse_seconds(args[i+1], &stage->translation)) {
+          return 127;
+        }
+      } else if (!strcmp(args[i], "-f")) {
+        if (retime_parse_factor(args[i+1], &stage->factor)) {
+          return 127;
+        }
+      } else {
+        return 127;
+      }
+    }
+    return 0;
+  } else if (!strcmp(args[0], "interpolate")) {
+    stage->type = STAGE_INTERPOLATE;
+    char* points_file = NULL;
+    if (nr_args >= 3 && !strcmp(args[1], "-a")) {
+      points_file = args[2];
+      args += 2;
+      nr_args -= 2;
+    }
+    return retime_parse_points(nr_args-1, args+1, points_file, &stage->points, &stage->nr_points);
+  } else if (!strcmp(args[0], "renumber")) {
+    stage->type = STAGE_RENUMBER;
+    return (nr_args == 1) ? 0 : 127;
+  }
+  return 127;
+}
+
+
+int pipeline_parse(int argc, char** argv, pipeline* p) {
+  /*
+   * Parses a chain of stages separated by | into p, which must be
+   * freed with pipeline_free on success.  The stages are:
+   *   offset [-t seconds] [-f factor]
+   *   interpolate [-a file] [id,time ...]
+   *   renumber
+   * with parameters as for srt_offset and srt_interpolate.  Returns 0
+   * on success, 1 if memory could not be allocated, 2 if a points file
+   * is unusable (explained on stderr) or 127 if the chain is invalid.
+   */
+  char** tokens;
+  int nr_tokens;
+  if (pipeline_tokenize(argc, argv, &tokens, &nr_tokens)) {
+    return 1;
+  }
+
+  int max_stages = 1;
+  int i;
+  for (i=0; i < nr_tokens; ++i) {
+    if (!strcmp(tokens[i], "|")) ++max_stages;
+  }
+  p->stages = malloc(max_stages * sizeof(pipeline_stage));
+  p->nr_stages = 0;
+  p->missing_id = 0;
+  if (p->stages == NULL) {
+    free(tokens);
+    return 1;
+  }
+
+  int status = 0;
+  int start = 0;
+  for (i=0; i <= nr_tokens && !status; ++i) {
+    if (i == nr_tokens || !strcmp(tokens[i], "|")) {
+      status = pipeline_parse_stage(i - start, tokens + start, &p->stages[p->nr_stages]);
+      if (!status) {
+        ++p->nr_stages;
+      }
+      start = i+1;
+    }
+  }
+
+  free(tokens);
+  if (status) {
+    pipeline_free(p);
+  }
+  return status;
+}
+
+
+void pipeline_free(pipeline* p) {
+  int i;
+  for (i=0; i < p->nr_stages; ++i) {
+    free(p->stages[i].points);
+  }
+  free(p->stages);
+  p->stages = NULL;
+  p->nr_stages = 0;
+}
+
+
+static int pipeline_interpolate(pipeline* p, pipeline_stage* stage, srt_document* doc) {
+  /*
+   * Interpolates every subtitle exactly as srt_interpolate does,
+   * including dropping those which end up before the video starts.
+   * Returns 0 on success, PIPELINE_ERROR_POINT if a point's subtitle
+   * isn't in the document or PIPELINE_ERROR_POINT_ORDER if the points'
+   * subtitles don't start in order.
+   */
+  retime_point* points = stage->points;
+  int nr_points = stage->nr_points;
+
+  // Find the points, in order, as srt_interpolate does while reading
+  int nr_found = 0;
+  size_t n;
+  for (n=0; n < doc->nr_subs && nr_found < nr_points; ++n) {
+    if (doc->ids[n] == points[nr_found].id) {
+      if (nr_found > 0 && doc->starts[n] <= points[nr_found-1].time_initial) {
+        p->missing_id = points[nr_found].id;
+        return PIPELINE_ERROR_POINT_ORDER;
+      }
+      points[nr_found].time_initial = doc->starts[n];
+      ++nr_found;
+    }
+  }
+  if (nr_found < nr_points) {
+    p->missing_id = points[nr_found].id;
+    return PIPELINE_ERROR_POINT;
+  }
+
+  int i;
+  for (i=0; i < nr_points; ++i) {
+    retime_calculate_segment(points, nr_points, i);
+  }
+
+  // Map each run of subtitles in the same segment in one go
+  n = 0;
+  while (n < doc->nr_subs) {
+    i = retime_find_segment(points, nr_points, doc->starts[n]);
+    if (i == nr_points) i = nr_points-1;
+    size_t end = retime_segment_end(points, nr_points, i, doc, n, doc->nr_subs);
+    retime_map(doc->starts + n, doc->ends + n, end - n, points[i].ppm, points[i].offset);
+    n = end;
+  }
+  doc->nr_subs = retime_clamp(doc, 0, doc->nr_subs);
+  return 0;
+}
+
+
+int pipeline_apply(pipeline* p, srt_document* doc) {
+  /*
+   * Applies each stage in turn to the whole document.  Returns 0 on
+   * success or a negative error code, in which case the document is
+   * left part-way through the pipeline.
+   */
+  int i;
+  size_t n;
+  int error;
+  for (i=0; i < p->nr_stages; ++i) {
+    pipeline_stage* stage = &p->stages[i];
+    switch (stage->type) {
+    case STAGE_OFFSET:
+      retime_offset(doc, stage->translation, stage->factor);
+      break;
+    case STAGE_INTERPOLATE:
+      if ((error = pipeline_interpolate(p, stage, doc))) {
+        return error;
+      }
+      break;
+    case STAGE_RENUMBER:
+      for (n=0; n < doc->nr_subs; ++n) {
+        doc->ids[n] = n+1;
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+
+char* pipeline_strerror(int error_code) {
+  /*
+   * Returns a human-readable string explaining an error code.
+   */
+  if (error_code == PIPELINE_ERROR_POINT) {
+    return "No subtitle with the ID of an interpolation point";
+  } else if (error_code == PIPELINE_ERROR_POINT_ORDER) {
+    return "The subtitles of the interpolation points don't start in order of ID";
+  } else {
+    return "Unknown error code";
+  }
+}
@@ -0,0 +1,74 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "retime.h"
+#include "srt_document.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Errors which might be encountered while applying a pipeline
+extern int PIPELINE_ERROR_POINT;
+extern int PIPELINE_ERROR_POINT_ORDER;
+
+typedef enum {
+  STAGE_OFFSET,
+  STAGE_INTERPOLATE,
+  STAGE_RENUMBER
+} stage_type;
+
+// One step of a pipeline, with the parameters for its type
+typedef struct {
+  stage_type type;
+
+  // For STAGE_OFFSET, the translation in milliseconds and the factor
+  // in ppm difference from unity
+  int translation;
+  int factor;
+
+  // For STAGE_INTERPOLATE, the points sorted by ID
+  retime_point* points;
+  int nr_points;
+} pipeline_stage;
+
+// A chain of transformations applied in turn to a whole document, so
+// that a file is parsed and written once however many there are
+typedef struct {
+  pipeline_stage* stages;
+  int nr_stages;
+
+  // After PIPELINE_ERROR_POINT, the interpolation point whose
+  // subtitle was not in the document; after
+  // PIPELINE_ERROR_POINT_ORDER, the one which starts too early
+  unsigned int missing_id;
+} pipeline;
+
+
+int pipeline_parse(int argc, char** argv, pipeline* p);
+void pipeline_free(pipeline* p);
+int pipeline_apply(pipeline* p, srt_document* doc);
+char* pipeline_strerror(int error_code);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,403 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "retime.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned int INITIAL_MAX_POINTS = 8;
+
+
+int retime_parse_seconds(char* arg, int* ms) {
+  /*
+   * Parses a (possibly negative, possibly fractional) number of
+   * seconds into milliseconds.  Returns 0 on success or -1 if arg
+   * isn't a number.
+   */
+  double t;
+  if (sscanf(arg, "%lf", &t) != 1) {
+    return -1;
+  }
+  *ms = (int) (t * 1000.0);
+  return 0;
+}
+
+
+int retime_parse_factor(char* arg, int* ppm) {
+  /*
+   * Parses a multiplicative factor into its difference from unity in
+   * ppm.  Returns 0 on success or -1 if arg isn't a number.
+   */
+  double f;
+  if (sscanf(arg, "%lf", &f) != 1) {
+    return -1;
+  }
+  *ppm = (int) ((f-1.0) * 1e6);
+  return 0;
+}
+
+
+int retime_parse_time(char* arg, unsigned long* ms) {
+  /*
+   * Parses a time as seconds, min:sec or hr:min:sec, where the seconds
+   * may have a fractional part after a point or (as in SRT files) a
+   * comma.  Returns 0 on success or -1 if it isn't a valid time.
+   */
+  unsigned long fields[2] = { 0, 0 };
+  int nr_fields = 0;
+  char* c = arg;
+  char* colon;
+  while ((colon = strchr(c, ':')) != NULL) {
+    if (nr_fields == 2 || colon == c) {
+      return -1;
+    }
+    char* end;
+    fields[nr_fields++] = strtoul(c, &end, 10);
+    if (end != colon || *c == '-' || *c == '+') {
+      return -1;
+    }
+    c = colon+1;
+  }
+
+  char sec[64];
+  size_t len = strlen(c);
+  if (len == 0 || len >= sizeof(sec) || *c == '-' || *c == '+') {
+    return -1;
+  }
+  memcpy(sec, c, len+1);
+  char* comma = strchr(sec, ',');
+  if (comma != NULL) *comma = '.';
+  char* end;
+  double time_float = strtod(sec, &end);
+  if (*end != '\0' || time_float < 0) {
+    return -1;
+  }
+
+  unsigned long hr = (nr_fields == 2) ? fields[0] : 0;
+  unsigned long min = (nr_fields == 2) ? fields[1] : fields[0];
+  *ms = (unsigned long) (time_float * 1000 + 0.5) + hr*3600000 + min*60000;
+  return 0;
+}
+
+
+static int retime_parse_point(char* arg, retime_point* point) {
+  /*
+   * Parses one id,time point.  Returns 0 on success or -1 if it isn't
+   * valid.
+   */
+  char* end;
+  if (*arg < '0' || *arg > '9') {
+    return -1;
+  }
+  unsigned long id = strtoul(arg, &end, 10);
+  if (*end != ',' || id > 0xffffffffUL) {
+    return -1;
+  }
+  unsigned long time;
+  if (retime_parse_time(end+1, &time)) {
+    return -1;
+  }
+  point->id = id;
+  point->time_final = time;
+  return 0;
+}
+
+
+static int retime_add_point(retime_point** points, int* nr_points, int* max_points) {
+  /*
+   * Makes room for one more point.  Returns 0 on success or 1 if
+   * memory could not be allocated.
+   */
+  if (*nr_points < *max_points) {
+    return 0;
+  }
+  int new_max = *max_points ? 2 * *max_points : INITIAL_MAX_POINTS;
+  retime_point* new = realloc(*points, new_max * sizeof(retime_point));
+  if (new == NULL) {
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+  *points = new;
+  *max_points = new_max;
+  return 0;
+}
+
+
+static int retime_load_points(char* filename, retime_point** points, int* nr_points, int* max_points) {
+  /*
+   * Adds the points in a file: id,time pairs separated by white
+   * space, with # starting a comment which runs to the end of the
+   * line.  Returns 0 on success, 1 if memory could not be allocated or
+   * 2 if the file can't be read or holds an invalid point.
+   */
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Error opening points file %s: %s\n", filename, strerror(errno));
+    return 2;
+  }
+
+  char* line = NULL;
+  size_t len = 0;
+  unsigned int line_no = 0;
+  int status = 0;
+  while (!status && getline(&line, &len, f) != -1) {
+    ++line_no;
+    char* comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+
+    char* save;
+    char* word;
+    for (word = strtok_r(line, " \t\r\n", &save); word != NULL && !status;
+         word = strtok_r(NULL, " \t\r\n", &save)) {
+      if ((status = retime_add_point(points, nr_points, max_points))) {
+        break;
+      }
+      if (retime_parse_point(word, &(*points)[*nr_points])) {
+        fprintf(stderr, "Invalid point %s at line %u of %s\n", word, line_no, filename);
+        status = 2;
+        break;
+      }
+      ++*nr_points;
+    }
+  }
+  if (!status && ferror(f)) {
+    fprintf(stderr, "Error reading points file %s: %s\n", filename, strerror(errno));
+    status = 2;
+  }
+
+  free(line);
+  fclose(f);
+  return status;
+}
+
+
+static int retime_compare_points(const void* a, const void* b) {
+  unsigned int id_a = ((retime_point*) a)->id;
+  unsigned int id_b = ((retime_point*) b)->id;
+  return (id_a > id_b) - (id_a < id_b);
+}
+
+
+int retime_parse_points(int nr_args, char** args, char* points_file,
+                        retime_point** points_out, int* nr_points_out) {
+  /*
+   * Parses id,time arguments, and the points in points_file unless it
+   * is NULL, into a list of points sorted by ID, which must be freed
+   * by the caller.  Returns 0 on success, 1 if memory could not be
+   * allocated, 2 if there is a problem with the file or the points
+   * (explained on stderr) or 127 if an argument is invalid.
+   */
+  retime_point* points = NULL;
+  int nr_points = 0;
+  int max_points = 0;
+  int status = 0;
+
+  int arg;
+  for (arg=0; arg < nr_args && !status; ++arg) {
+    if ((status = retime_add_point(&points, &nr_points, &max_points))) {
+      break;
+    }
+    if (retime_parse_point(args[arg], &points[nr_points])) {
+      status = 127;
+      break;
+    }
+    ++nr_points;
+  }
+  if (!status && points_file != NULL) {
+    status = retime_load_points(points_file, &points, &nr_points, &max_points);
+  }
+  if (!status && nr_points == 0) {
+    status = 127;
+  }
+  if (status) {
+    free(points);
+    return status;
+  }
+
+  qsort(points, nr_points, sizeof(retime_point), retime_compare_points);
+
+  int i;
+  for (i=1; i < nr_points; ++i) {
+    if (points[i].id == points[i-1].id) {
+      fprintf(stderr, "Error: more than one point for ID %u\n", points[i].id);
+      free(points);
+      return 2;
+    }
+    if (points[i].time_final < points[i-1].time_final) {
+      fprintf(stderr, "Error: times should increase monotonically with ID\n");
+    }
+  }
+
+  *points_out = points;
+  *nr_points_out = nr_points;
+  return 0;
+}
+
+
+void retime_calculate_segment(retime_point* points, int nr_points, int i) {
+  /*
+   * Calculates the interpolation coefficients for segment i, which
+   * covers subtitles after point i-1 up to point i; the first segment
+   * shares the coefficients of the second.  Needs the initial times
+   * of the points at both ends.
+   */
+  if (nr_points == 1) {
+    points[0].ppm = 0;
+    points[0].offset = points[0].time_final - points[0].time_initial;
+    return;
+  }
+  if (i == 0) {
+    retime_calculate_segment(points, nr_points, 1);
+    points[0].ppm = points[1].ppm;
+    points[0].offset = points[1].offset;
+    return;
+  }
+  points[i].ppm = (points[i].time_final - points[i-1].time_final);
+  points[i].ppm *= 1000000;
+  points[i].ppm /= (points[i].time_initial - points[i-1].time_initial);
+  points[i].ppm -= 1000000;
+  points[i].offset = points[i].time_final - points[i].time_initial - points[i].ppm * points[i].time_initial / 1000000;
+}
+
+
+static inline long retime_scale(long t, long ppm) {
+  /*
+   * t * ppm / 1000000, truncated towards zero as C division is.  t is
+   * split into whole and part seconds (of the same sign) so that
+   * neither product can overflow, however large the factor.
+   */
+  long whole = t / 1000000;
+  long part = t % 1000000;
+  return whole * ppm + part * ppm / 1000000;
+}
+
+
+void retime_map(long* starts, long* ends, size_t n, long ppm, long offset) {
+  /*
+   * Applies the affine map t -> t + t*ppm/1000000 + offset to n start
+   * and end times, exactly in 64 bits.  The loops are branch-free so
+   * that the compiler can vectorise them; the division by 1000000
+   * becomes a multiplication by its reciprocal.
+   */
+  size_t i;
+  if (ppm == 0) {
+    // Just a translation, which vectorises completely
+    for (i=0; i < n; ++i) {
+      starts[i] += offset;
+      ends[i] += offset;
+    }
+    return;
+  }
+  for (i=0; i < n; ++i) {
+    starts[i] += retime_scale(starts[i], ppm) + offset;
+  }
+  for (i=0; i < n; ++i) {
+    ends[i] += retime_scale(ends[i], ppm) + offset;
+  }
+}
+
+
+size_t retime_clamp(srt_document* doc, size_t first, size_t last) {
+  /*
+   * Drops the subtitles from first up to last which now end before
+   * the start of the video, and moves the start of any which straddle
+   * it to zero.  The ones kept are moved down to be contiguous from
+   * first; returns where they end, leaving anything after that up to
+   * last unspecified.
+   */
+
+  // Usually nothing needs clamping, so look for the first subtitle
+  // which does before moving anything
+  size_t n;
+  for (n=first; n < last; ++n) {
+    if (doc->starts[n] < 0 || doc->ends[n] <= 0) break;
+  }
+  if (n == last) {
+    return last;
+  }
+
+  size_t kept = n;
+  for (; n < last; ++n) {
+    long start = doc->starts[n];
+    long end = doc->ends[n];
+    doc->ids[kept] = doc->ids[n];
+    doc->starts[kept] = (start < 0) ? 0 : start;
+    doc->ends[kept] = end;
+    doc->text_offsets[kept] = doc->text_offsets[n];
+    doc->text_lens[kept] = doc->text_lens[n];
+    kept += (end > 0);
+  }
+  return kept;
+}
+
+
+void retime_offset(srt_document* doc, int translation, int factor) {
+  /*
+   * Applies the factor (in ppm) and then the translation (in ms) to
+   * every subtitle in the document, then clamps them to the start of
+   * the video as retime_clamp does.
+   */
+  retime_map(doc->starts, doc->ends, doc->nr_subs, factor, translation);
+  doc->nr_subs = retime_clamp(doc, 0, doc->nr_subs);
+}
+
+
+int retime_find_segment(retime_point* points, int nr_points, long time) {
+  /*
+   * Finds the segment which a subtitle starting at time belongs to:
+   * the first point whose initial time is no earlier, so segment i
+   * covers times after point i-1 up to point i.  Returns nr_points if
+   * time is after every point.  The points' initial times must be
+   * increasing.
+   */
+  int lo = 0;
+  int hi = nr_points;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (points[mid].time_initial < time) {
+      lo = mid+1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+
+size_t retime_segment_end(retime_point* points, int nr_points, int i,
+                          srt_document* doc, size_t first, size_t last) {
+  /*
+   * Finds the end of the run of subtitles from first (and before
+   * last) which start within segment i, the last segment extending
+   * forever after its point.
+   */
+  long after = (i > 0) ? points[i-1].time_initial : 0;
+  long until = points[i].time_initial;
+  int bounded = (i+1 < nr_points);
+  size_t n;
+  for (n=first+1; n < last; ++n) {
+    long start = doc->starts[n];
+    if ((i > 0 && start <= after) || (bounded && start > until)) break;
+  }
+  return n;
+}
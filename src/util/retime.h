@@ -0,0 +1,59 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+
+#include "srt_document.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A subtitle whose time is fixed by an interpolation, and the
+// coefficients for the segment of subtitles which ends at it
+typedef struct {
+  unsigned int id;
+  long time_initial;
+  long time_final;
+
+  // Amount to offset and multiply everything after the previous point but before this by
+  long ppm;
+  long offset;
+} retime_point;
+
+
+int retime_parse_seconds(char* arg, int* ms);
+int retime_parse_time(char* arg, unsigned long* ms);
+int retime_parse_factor(char* arg, int* ppm);
+int retime_parse_points(int nr_args, char** args, char* points_file,
+                        retime_point** points_out, int* nr_points_out);
+void retime_calculate_segment(retime_point* points, int nr_points, int i);
+void retime_map(long* starts, long* ends, size_t n, long ppm, long offset);
+size_t retime_clamp(srt_document* doc, size_t first, size_t last);
+void retime_offset(srt_document* doc, int translation, int factor);
+int retime_find_segment(retime_point* points, int nr_points, long time);
+size_t retime_segment_end(retime_point* points, int nr_points, int i,
+                          srt_document* doc, size_t first, size_t last);
+
+#ifdef __cplusplus
+}
+#endif
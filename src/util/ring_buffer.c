@@ -17,9 +17,12 @@
  *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "ring_buffer.h"
 
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 Ring *ring_alloc(size_t max_size) {
   /*
@@ -41,6 +44,63 @@ Ring *ring_alloc(size_t max_size) {
   r->size = max_size + 1;
   r->buf_start = r->buf;
   r->buf_end = r->buf;
+  r->mirrored = 0;
+  r->scratch = NULL;
+  return r;
+}
+
+
+Ring *ring_alloc_mirrored(size_t max_size) {
+  /*
+   * Like ring_alloc, but the buffer is a memfd mapped twice back to
+   * back, so that whatever is in the ring can be read in place with
+   * ring_peek without ever being copied.  The ring may hold a little
+   * more than max_size bytes, as its size is rounded up to whole
+   * pages.  Returns NULL if the mappings cannot be set up, in which
+   * case ring_alloc may be used instead.
+   */
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (max_size + 1 + page - 1) / page * page;
+
+  Ring *r = malloc(sizeof(Ring));
+  if (r == NULL) {
+    return NULL;
+  }
+
+  int fd = memfd_create("ring", MFD_CLOEXEC);
+  if (fd < 0) {
+    free(r);
+    return NULL;
+  }
+  if (ftruncate(fd, size)) {
+    close(fd);
+    free(r);
+    return NULL;
+  }
+
+  // Reserve space for both copies, then map the memfd over each half
+  uint8_t *buf = mmap(NULL, 2*size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    close(fd);
+    free(r);
+    return NULL;
+  }
+  if (mmap(buf, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+      mmap(buf + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(buf, 2*size);
+    close(fd);
+    free(r);
+    return NULL;
+  }
+  close(fd);
+
+  r->buf = buf;
+  r->size = size;
+  r->buf_start = r->buf;
+  r->buf_end = r->buf;
+  r->mirrored = 1;
+  r->scratch = NULL;
   return r;
 }
   
@@ -55,6 +115,18 @@ int ring_read(FILE *fin, Ring *r, uint8_t *couldnt_read) {
   int total_read = 0;
   int to_read, read;
 
+  if (r->mirrored) {
+    // The free space is contiguous too, running on into the mirror
+    to_read = r->size - 1 - ring_get_fill(r);
+    read = fread(r->buf_end, 1, to_read, fin);
+    r->buf_end += read;
+    if (r->buf_end >= r->buf + r->size) {
+      r->buf_end -= r->size;
+    }
+    *couldnt_read = (read < to_read);
+    return read;
+  }
+
   if (r->buf_start <= r->buf_end) {
     // If the buffer has two spaces, fill the first one
     if (r->buf_start == r->buf) {
@@ -95,7 +167,12 @@ int ring_read(FILE *fin, Ring *r, uint8_t *couldnt_read) {
 
 
 void ring_free(Ring *r) {
-  free (r->buf);
+  if (r->mirrored) {
+    munmap(r->buf, 2*r->size);
+  } else {
+    free (r->buf);
+  }
+  free (r->scratch);
   free (r);
 }
 
@@ -173,3 +250,49 @@ int ring_skip (Ring *r, size_t len) {
 
   return 0;
 }
+
+
+int ring_peek(Ring *r, size_t len, uint8_t **ptr) {
+  /*
+   * Points ptr at the next len bytes in the ring without removing
+   * them; they stay valid until the ring is next modified.  For a
+   * mirrored ring they are always read in place; otherwise they are
+   * only copied if they wrap around the end of the buffer.  Returns 0
+   * on success, -1 if there were not enough bytes in the buffer, -2
+   * if there will never be enough bytes because of the size of the
+   * buffer, or -3 if memory could not be allocated.
+   */
+
+  if (ring_get_fill(r) < len) {
+    if (r->size-1 < len) {
+      return -2;
+    }
+    return -1;
+  }
+
+  if (r->mirrored || r->buf_start + len <= r->buf + r->size) {
+    *ptr = r->buf_start;
+    return 0;
+  }
+
+  if (r->scratch == NULL) {
+    r->scratch = malloc(r->size);
+    if (r->scratch == NULL) {
+      return -3;
+    }
+  }
+  size_t first = r->buf + r->size - r->buf_start;
+  memcpy(r->scratch, r->buf_start, first);
+  memcpy(r->scratch + first, r->buf, len - first);
+  *ptr = r->scratch;
+  return 0;
+}
+
+
+int ring_consume(Ring *r, size_t len) {
+  /*
+   * Removes the next len bytes from the ring, typically after they
+   * have been looked at with ring_peek.  Returns as for ring_skip.
+   */
+  return ring_skip(r, len);
+}
@@ -23,16 +23,35 @@
 #include <string.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct {
   uint8_t *buf;
   uint8_t *buf_start;
   uint8_t *buf_end;
   size_t size;
+
+  // Set if buf is immediately followed by a second mapping of the
+  // same memory, so that the data in the ring is always contiguous
+  int mirrored;
+
+  // For rings which aren't mirrored, somewhere to assemble data which
+  // wraps around the end of buf for ring_peek; allocated when needed
+  uint8_t *scratch;
 } Ring;
 
 Ring *ring_alloc(size_t max_size);
+Ring *ring_alloc_mirrored(size_t max_size);
 int ring_read(FILE *fin, Ring *r, uint8_t*couldnt_read);
 void ring_free(Ring *r);
 size_t ring_get_fill(Ring *r);
 int ring_get_exact(Ring *r, size_t len, uint8_t *buf);
 int ring_skip (Ring *r, size_t len);
+int ring_peek(Ring *r, size_t len, uint8_t **ptr);
+int ring_consume(Ring *r, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -18,11 +18,29 @@
  */
 
 #include "srt.h"
+#include "stats.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef enum {
+  SCAN_OK,
+  SCAN_EMPTY,
+  SCAN_LENIENT
+} scan_result;
 
 typedef enum {
   STATE_INITIAL,
@@ -39,6 +57,149 @@ int SRT_ERROR_MODE_CANNOT_WRITE = -6;
 int SRT_ERROR_PREVIOUS_ERROR = -7;
 int SRT_EOF = -8;
 int SRT_ERROR_SEEK = -9;
+int SRT_ERROR_ENCODING = -10;
+
+static void* srt_default_realloc(void* ctx, void* ptr, size_t old_size, size_t new_size) {
+  return realloc(ptr, new_size);
+}
+
+
+static void srt_default_free(void* ctx, void* ptr, size_t size) {
+  free(ptr);
+}
+
+
+static srt_allocator srt_default_allocator = {
+  srt_default_realloc,
+  srt_default_free,
+  NULL
+};
+
+
+static srt_file* srt_new_file(FILE* f, srt_mode mode) {
+  /*
+   * Allocates and initialises the handle for a file.  Returns NULL if
+   * memory could not be allocated.
+   */
+  srt_file* file = malloc(sizeof(srt_file));
+  if (file == NULL) {
+    return NULL;
+  }
+
+  file->f = f;
+  file->delimiter = NULL;
+  file->mode = mode;
+  file->line_no = 0;
+  file->error = 0;
+  file->truncated = 0;
+  file->line = NULL;
+  file->len = 0;
+  file->map = NULL;
+  file->map_len = 0;
+  file->map_pos = 0;
+  file->map_owned = 0;
+  file->map_heap = 0;
+  file->map_start = 0;
+  file->encoding = UTF_8;
+  file->encoding_checked = 0;
+  file->text = NULL;
+  file->text_len = 0;
+  file->alloc = &srt_default_allocator;
+  file->out = NULL;
+  file->out_fill = 0;
+  file->sink = NULL;
+  file->sink_len = 0;
+  file->sink_max = 0;
+
+  return file;
+}
+
+
+static int srt_decode(srt_file* file) {
+  /*
+   * Looks at the encoding of a file held in memory: a UTF-8 byte order
+   * mark is skipped, and UTF-16 is transcoded to UTF-8 in a buffer of
+   * the file's own, which replaces the original.  Returns 0 on success
+   * or SRT_ERROR_ALLOC.
+   */
+  size_t bom_len;
+  file->encoding = utf_detect(file->map, file->map_len, &bom_len);
+  file->encoding_checked = 1;
+  if (file->encoding == UTF_8 || file->encoding == UTF_8_BOM) {
+    file->map_start = file->map_pos = bom_len;
+    return 0;
+  }
+
+  size_t in_len = file->map_len - bom_len;
+  char* utf8 = malloc(UTF16_MAX_UTF8_LEN(in_len));
+  if (utf8 == NULL) {
+    return SRT_ERROR_ALLOC;
+  }
+  size_t len = utf16_to_utf8(file->map + bom_len, in_len, file->encoding == UTF_16BE, utf8);
+  if (file->map_heap) {
+    free(file->map);
+  } else if (file->map_owned && file->map_len > 0) {
+    munmap(file->map, file->map_len);
+  }
+  file->map = utf8;
+  file->map_len = len;
+  file->map_pos = 0;
+  file->map_start = 0;
+  file->map_owned = 1;
+  file->map_heap = 1;
+  return 0;
+}
+
+
+static int srt_decode_stream(srt_file* file, size_t first_len) {
+  /*
+   * For a file read through stdio whose first line, first_len bytes
+   * in file->line, shows it to be UTF-16: reads the rest of the file
+   * and transcodes the lot into memory, to be read from there.
+   * Returns 0 on success or SRT_ERROR_ALLOC.
+   */
+  size_t len = first_len;
+  size_t max = 2*first_len + 65536;
+  char* raw = malloc(max);
+  if (raw == NULL) {
+    return SRT_ERROR_ALLOC;
+  }
+  memcpy(raw, file->line, first_len);
+  while (1) {
+    if (len == max) {
+      STATS_ADD(STATS_REALLOCS, 1);
+      char* new = realloc(raw, 2*max);
+      if (new == NULL) {
+        free(raw);
+        return SRT_ERROR_ALLOC;
+      }
+      raw = new;
+      max *= 2;
+    }
+    stats_timer t;
+    STATS_BEGIN(t);
+    size_t read = fread(raw + len, 1, max - len, file->f);
+    STATS_END(STATS_IO_NS, t);
+    STATS_ADD(STATS_BYTES_READ, read);
+    if (read == 0) {
+      break;
+    }
+    len += read;
+  }
+
+  file->map = raw;
+  file->map_len = len;
+  file->map_pos = 0;
+  file->map_owned = 1;
+  file->map_heap = 1;
+  int error = srt_decode(file);
+  if (error) {
+    file->map = NULL;
+    free(raw);
+  }
+  return error;
+}
+
 
 srt_file* srt_open_read(char* filename) {
   /* 
@@ -53,19 +214,98 @@ srt_file* srt_open_read(char* filename) {
     return NULL;
   }
 
-  srt_file* file = malloc(sizeof(srt_file));
+  srt_file* file = srt_new_file(f, SRT_MODE_READ);
   if (file == NULL) {
     fclose(f);
     return NULL;
   }
 
-  file->f = f;
-  file->delimiter = NULL;
-  file->mode = SRT_MODE_READ;
-  file->line_no = 0;
-  file->error = 0;
-  file->line = NULL;
-  file->len = 0;
+  return file;
+}
+
+
+srt_file* srt_open_mmap(char* filename) {
+  /*
+   * Opens filename for reading subtitles by mapping the whole file
+   * into memory.  Subtitles read with srt_read_ref point straight
+   * into the mapping and remain valid until the file is closed; plain
+   * srt_read works as for srt_open_read.  Returns NULL if the file
+   * cannot be opened or mapped (e.g. it is a pipe); errno may be
+   * inspected to determine the cause, and srt_open_read may be used
+   * instead.  The file must be closed with srt_close() when it is no
+   * longer needed.
+   */
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return NULL;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    close(fd);
+    errno = ENODEV;
+    return NULL;
+  }
+
+  // An empty file can't be mapped, but reads from it just give EOF
+  char* map = "";
+  if (st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  srt_file* file = srt_new_file(NULL, SRT_MODE_READ);
+  if (file == NULL) {
+    if (st.st_size > 0) {
+      munmap(map, st.st_size);
+    }
+    return NULL;
+  }
+  file->map = map;
+  file->map_len = st.st_size;
+  file->map_owned = 1;
+
+  // Mapped input is counted as read when it is mapped; it is read by
+  // page faults as it is parsed
+  STATS_ADD(STATS_BYTES_READ, st.st_size);
+
+  if (srt_decode(file)) {
+    srt_close(file);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  return file;
+}
+
+
+srt_file* srt_open_memory(char* data, size_t len) {
+  /*
+   * Opens an in-memory copy of an SRT file for reading.  The data is
+   * read in place, just like a file opened with srt_open_mmap, and
+   * must remain valid until the file is closed; it is not freed by
+   * srt_close.  Returns NULL if memory could not be allocated.
+   */
+  srt_file* file = srt_new_file(NULL, SRT_MODE_READ);
+  if (file == NULL) {
+    return NULL;
+  }
+  file->map = (len > 0) ? data : "";
+  file->map_len = len;
+  if (srt_decode(file)) {
+    srt_close(file);
+    return NULL;
+  }
 
   return file;
 }
@@ -84,39 +324,105 @@ srt_file* srt_open_write(char* filename) {
     return NULL;
   }
 
-  srt_file* file = malloc(sizeof(srt_file));
+  srt_file* file = srt_open_write_stream(f);
   if (file == NULL) {
     fclose(f);
     return NULL;
   }
 
-  file->f = f;
+  return file;
+}
+
+
+srt_file* srt_open_write_stream(FILE* f) {
+  /*
+   * Writes SRT to a stream which is already open, such as stdout,
+   * and which is closed by srt_close.  Output is written straight to
+   * the underlying file descriptor, so anything the caller writes to
+   * the stream itself must be flushed before, and srt_flush called
+   * after, each switch between the two.  Returns NULL if memory could
+   * not be allocated.
+   */
+  srt_file* file = srt_new_file(f, SRT_MODE_WRITE);
+  if (file == NULL) {
+    return NULL;
+  }
   file->delimiter = "\r\n";
-  file->mode = SRT_MODE_WRITE;
-  file->line_no = 0;
-  file->error = 0;
 
   return file;
 }
 
 
-void srt_close(srt_file* file) {
+srt_file* srt_open_write_memory(void) {
+  /*
+   * Writes SRT to memory rather than a file; the output is collected
+   * with srt_take_memory.  Returns NULL if memory could not be
+   * allocated.
+   */
+  return srt_open_write_stream(NULL);
+}
+
+
+char* srt_take_memory(srt_file* file, size_t* len) {
+  /*
+   * Hands over everything written so far to a file opened with
+   * srt_open_write_memory, and starts again with nothing.  The memory
+   * must be freed by the caller.  Returns NULL, with len set to 0, if
+   * nothing has been written, or if the output could not be
+   * collected, in which case file->error is set.
+   */
+  char* sink = NULL;
+  *len = 0;
+  if (!srt_flush(file)) {
+    sink = file->sink;
+    *len = file->sink_len;
+    file->sink = NULL;
+    file->sink_len = 0;
+    file->sink_max = 0;
+  }
+  return sink;
+}
+
+
+int srt_close(srt_file* file) {
   /*
-   * Closes an open file.
+   * Closes an open file, first writing out anything buffered for a
+   * file being written.  Returns 0 on success, or SRT_ERROR_WRITE if
+   * the buffered output could not be written.
    */
-  fclose(file->f);
+  int error = 0;
+  if (file->mode == SRT_MODE_WRITE) {
+    error = srt_flush(file);
+    free(file->out);
+  }
+
+  if (file->map_heap) {
+    free(file->map);
+  } else if (file->map != NULL && file->map_owned && file->map_len > 0) {
+    munmap(file->map, file->map_len);
+  }
+  if (file->f != NULL) {
+    fclose(file->f);
+  }
+  free(file->sink);
   if (file->line != NULL) {
     free(file->line);
   }
+  if (file->text != NULL) {
+    file->alloc->free(file->alloc->ctx, file->text, file->text_len);
+  }
   free(file);
+  return error;
 }
 
 
-int srt_isempty(char*s) {
+int srt_isempty(char*s, size_t len) {
   /*
-   * Returns true if a string is empty, apart from whitespace
+   * Returns true if the first len characters of a string are empty,
+   * apart from whitespace, or if it ends before then
    */
-  while (*s != 0) {
+  char* end = s + len;
+  while (s < end && *s != 0) {
     if (!isspace(*s)) return 0;
     ++s;
   }
@@ -124,18 +430,196 @@ int srt_isempty(char*s) {
 }
 
 
-int srt_read(srt_file* file, sub_text* subtitle) {
+static ssize_t srt_getline(srt_file* file, char** line) {
   /*
-   * Reads a subtitle from the file into subtitle.  Reallocs the
-   * subtitle text buffer if necessary to accomodate the length, and
-   * updates buf_len appropriately.  If the subtitle doesn't currently
-   * have a text buffer, it is allocated, and must be freed by the *
-   * caller.
-   *
-   * If there was an error reading from the file, or if the file has
-   * been opened for reading rather than writing, the error flag in
-   * file is set and a negative number is returned.  On success, 0 is
-   * returned.
+   * Fetches the next line of the file, including its newline, and
+   * points line at it.  Returns the length of the line, or -1 at the
+   * end of the file.  Lines from stdio files are NUL-terminated;
+   * lines from mapped files point into the mapping and are not.
+   */
+  if (file->map == NULL) {
+    stats_timer t;
+    STATS_BEGIN(t);
+    ssize_t line_len = getline(&file->line, &file->len, file->f);
+    STATS_END(STATS_IO_NS, t);
+    *line = file->line;
+    if (line_len >= 0) {
+      STATS_ADD(STATS_BYTES_READ, line_len);
+    }
+
+    if (!file->encoding_checked && line_len > 0) {
+      size_t bom_len;
+      file->encoding = utf_detect(file->line, line_len, &bom_len);
+      file->encoding_checked = 1;
+      if (file->encoding == UTF_16LE || file->encoding == UTF_16BE) {
+        if (srt_decode_stream(file, line_len)) {
+          file->error = SRT_ERROR_ALLOC;
+          return -1;
+        }
+        return srt_getline(file, line);
+      }
+      memmove(file->line, file->line + bom_len, line_len - bom_len + 1);
+      line_len -= bom_len;
+    }
+    if (line_len >= 0) {
+      STATS_ADD(STATS_LINES, 1);
+    }
+    return line_len;
+  }
+
+  if (file->map_pos >= file->map_len) {
+    return -1;
+  }
+  char* start = file->map + file->map_pos;
+  size_t remaining = file->map_len - file->map_pos;
+  char* nl = memchr(start, '\n', remaining);
+  size_t line_len = (nl == NULL) ? remaining : (size_t)(nl - start) + 1;
+  file->map_pos += line_len;
+  *line = start;
+  STATS_ADD(STATS_LINES, 1);
+  return line_len;
+}
+
+
+static char* srt_terminate(srt_file* file, char* line, size_t line_len) {
+  /*
+   * Returns a NUL-terminated copy of a line from a mapped file in the
+   * file's line buffer, suitable for sscanf, or NULL if the buffer
+   * could not be grown.  Lines from stdio files are returned as-is.
+   */
+  if (file->map == NULL) {
+    return line;
+  }
+  if (line_len + 1 > file->len) {
+    char* new = realloc(file->line, line_len + 1);
+    if (new == NULL) {
+      return NULL;
+    }
+    file->line = new;
+    file->len = line_len + 1;
+  }
+  memcpy(file->line, line, line_len);
+  file->line[line_len] = 0;
+  return file->line;
+}
+
+
+static scan_result srt_scan_id(char* line, size_t line_len, unsigned int* id) {
+  /*
+   * Scans an ID line of the form " %u ".  Returns SCAN_EMPTY if the
+   * line is blank, SCAN_OK if it starts with a short enough run of
+   * digits which have been converted into id, or SCAN_LENIENT if it
+   * has to be left to sscanf (which will usually reject it).
+   */
+  char* c = line;
+  char* end = line + line_len;
+  while (c < end && *c != 0 && isspace(*c)) ++c;
+  if (c == end || *c == 0) {
+    return SCAN_EMPTY;
+  }
+
+  // Nine digits can't overflow an unsigned int; anything longer goes
+  // the slow way so that overflow behaves as before
+  unsigned int val = 0;
+  char* digits = c;
+  while (c < end && c - digits < 10 && (unsigned char)(*c - '0') < 10) {
+    val = val*10 + (*c - '0');
+    ++c;
+  }
+  if (c == digits || c - digits > 9) {
+    return SCAN_LENIENT;
+  }
+  *id = val;
+  return SCAN_OK;
+}
+
+
+// The layout of a times line with the usual field widths; digits are
+// shown as '0'
+#define SRT_TIMES_LEN 29
+static const char srt_times_template[32] = "00:00:00,000 --> 00:00:00,000\0\0";
+
+// The largest allowable value of each character minus the template;
+// 9 for digits, 0 for punctuation, and anything for the padding
+static const unsigned char srt_times_limit[32] = {
+  9, 9, 0, 9, 9, 0, 9, 9, 0, 9, 9, 9,
+  0, 0, 0, 0, 0,
+  9, 9, 0, 9, 9, 0, 9, 9, 0, 9, 9, 9,
+  255, 255, 255
+};
+
+
+static scan_result srt_scan_times(char* line, size_t line_len,
+                                  unsigned long* start, unsigned long* end) {
+  /*
+   * Scans a times line of the form HH:MM:SS,mmm --> HH:MM:SS,mmm,
+   * with optional leading whitespace and anything after, checking all
+   * the fixed-width fields in one go.  Returns SCAN_EMPTY if the line
+   * is blank, SCAN_OK if the line matched and start and end have been
+   * set, or SCAN_LENIENT if the fields are not the usual widths and
+   * the line has to be left to sscanf.
+   */
+  char* c = line;
+  char* line_end = line + line_len;
+  while (c < line_end && *c != 0 && isspace(*c)) ++c;
+  if (c == line_end || *c == 0) {
+    return SCAN_EMPTY;
+  }
+  if (line_end - c < SRT_TIMES_LEN) {
+    return SCAN_LENIENT;
+  }
+
+  // Take a padded copy so that whole vectors can be loaded; the
+  // padding matches the template so it always passes
+  unsigned char d[32];
+  memcpy(d, c, SRT_TIMES_LEN);
+  d[29] = d[30] = d[31] = 0;
+
+#ifdef __SSE2__
+  __m128i t0 = _mm_loadu_si128((const __m128i*)srt_times_template);
+  __m128i t1 = _mm_loadu_si128((const __m128i*)(srt_times_template+16));
+  __m128i l0 = _mm_loadu_si128((const __m128i*)srt_times_limit);
+  __m128i l1 = _mm_loadu_si128((const __m128i*)(srt_times_limit+16));
+  __m128i d0 = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)d), t0);
+  __m128i d1 = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(d+16)), t1);
+  // Each byte is in range iff max(d, limit) == limit
+  __m128i ok = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(d0, l0), l0),
+                             _mm_cmpeq_epi8(_mm_max_epu8(d1, l1), l1));
+  if (_mm_movemask_epi8(ok) != 0xffff) {
+    return SCAN_LENIENT;
+  }
+  _mm_storeu_si128((__m128i*)d, d0);
+  _mm_storeu_si128((__m128i*)(d+16), d1);
+#else
+  int i;
+  for (i=0; i < SRT_TIMES_LEN; ++i) {
+    d[i] -= srt_times_template[i];
+    if (d[i] > srt_times_limit[i]) {
+      return SCAN_LENIENT;
+    }
+  }
+#endif
+
+  unsigned int start_hr = d[0]*10 + d[1];
+  unsigned int start_min = d[3]*10 + d[4];
+  unsigned int start_sec = d[6]*10 + d[7];
+  unsigned int start_msec = d[9]*100 + d[10]*10 + d[11];
+  unsigned int end_hr = d[17]*10 + d[18];
+  unsigned int end_min = d[20]*10 + d[21];
+  unsigned int end_sec = d[23]*10 + d[24];
+  unsigned int end_msec = d[26]*100 + d[27]*10 + d[28];
+  *start = start_hr*3600000 + start_min*60000 + start_sec*1000 + start_msec;
+  *end = end_hr*3600000 + end_min*60000 + end_sec*1000 + end_msec;
+  return SCAN_OK;
+}
+
+
+static int srt_parse(srt_file* file, sub_text* subtitle, int by_ref) {
+  /*
+   * Parses the next subtitle from the file.  If by_ref is zero, the
+   * text is copied into the subtitle's own buffer as described for
+   * srt_read; otherwise the subtitle's text is pointed at the mapping
+   * or the file's text buffer as described for srt_read_ref.
    */
 
   if (file->mode != SRT_MODE_READ) {
@@ -153,9 +637,11 @@ int srt_read(srt_file* file, sub_text* subtitle) {
   unsigned int id;
   unsigned long start=0, end=0;
 
+  // For text referenced in place in a mapped file, where it starts
+  char* text_start = NULL;
+
   while (1) {
-    line_len = getline(&file->line, &file->len, file->f);
-    line = file->line;
+    line_len = srt_getline(file, &line);
     ++file->line_no;
 
     // If EOF or some other error
@@ -164,6 +650,7 @@ int srt_read(srt_file* file, sub_text* subtitle) {
         s = STATE_INITIAL;
         break;
       } else {
+        file->truncated = (s != STATE_INITIAL);
         return SRT_EOF;
       }
     }
@@ -194,47 +681,93 @@ int srt_read(srt_file* file, sub_text* subtitle) {
 
     if (s == STATE_INITIAL) {
       // Expect a  subtitle ID
-      if (srt_isempty(line)) continue;
-      if (sscanf(line, " %u ", &id) != 1) {
-        file->error = SRT_ERROR_ID;
-        return SRT_ERROR_ID;
+      scan_result r = srt_scan_id(line, line_len, &id);
+      if (r == SCAN_EMPTY) continue;
+      if (r == SCAN_LENIENT) {
+        if ((line = srt_terminate(file, line, line_len)) == NULL) {
+          file->error = SRT_ERROR_ALLOC;
+          return SRT_ERROR_ALLOC;
+        }
+        if (sscanf(line, " %u ", &id) != 1) {
+          file->error = SRT_ERROR_ID;
+          return SRT_ERROR_ID;
+        }
       }
       s = STATE_EXPECT_TIMES;
       continue;
     }
 
     else if (s == STATE_EXPECT_TIMES) {
-      if (srt_isempty(line)) continue;
-      unsigned int start_hr, start_min, start_sec, start_msec;
-      unsigned int end_hr, end_min, end_sec, end_msec;
-      if (sscanf(line, " %02u:%02u:%02u,%03u --> %02u:%02u:%02u,%03u ",
-                 &start_hr, &start_min, &start_sec, &start_msec,
-                 &end_hr, &end_min, &end_sec, &end_msec) != 8) {
-        file->error = SRT_ERROR_TIMES;
-        return SRT_ERROR_TIMES;
+      scan_result r = srt_scan_times(line, line_len, &start, &end);
+      if (r == SCAN_EMPTY) continue;
+      if (r == SCAN_LENIENT) {
+        if ((line = srt_terminate(file, line, line_len)) == NULL) {
+          file->error = SRT_ERROR_ALLOC;
+          return SRT_ERROR_ALLOC;
+        }
+        unsigned int start_hr, start_min, start_sec, start_msec;
+        unsigned int end_hr, end_min, end_sec, end_msec;
+        if (sscanf(line, " %02u:%02u:%02u,%03u --> %02u:%02u:%02u,%03u ",
+                   &start_hr, &start_min, &start_sec, &start_msec,
+                   &end_hr, &end_min, &end_sec, &end_msec) != 8) {
+          file->error = SRT_ERROR_TIMES;
+          return SRT_ERROR_TIMES;
+        }
+        start = start_hr*3600000 + start_min*60000 + start_sec*1000 + start_msec;
+        end = end_hr*3600000 + end_min*60000 + end_sec*1000 + end_msec;
       }
-      start = start_hr*3600000 + start_min*60000 + start_sec*1000 + start_msec;
-      end = end_hr*3600000 + end_min*60000 + end_sec*1000 + end_msec;
       s = STATE_EXPECT_SUBTITLES;
       subtitle->len = 0;
       continue;
     }
 
     else if (s == STATE_EXPECT_SUBTITLES) {
-      if (srt_isempty(line)) {
+      if (srt_isempty(line, line_len)) {
         s = STATE_INITIAL;
         break;
       }
-      if (subtitle->len+line_len+1 > subtitle->buf_len) {
-        char*new = realloc(subtitle->text, subtitle->len+line_len+1);
+
+      if (by_ref && file->map != NULL) {
+        // The lines of text are contiguous in the mapping, so just
+        // remember where they start
+        if (text_start == NULL) {
+          text_start = line;
+        }
+        subtitle->len = line + line_len - text_start;
+        continue;
+      }
+
+      // The buffer is kept between subtitles and grows by doubling,
+      // so once it is big enough for the longest subtitle there are
+      // no more allocations
+      char** text = by_ref ? &file->text : &subtitle->text;
+      size_t buf_len = by_ref ? file->text_len : subtitle->buf_len;
+      size_t needed = subtitle->len + line_len + 1;
+      if (needed > buf_len) {
+        size_t new_len = buf_len ? 2*buf_len : SRT_MIN_TEXT_BUF;
+        while (new_len < needed) new_len *= 2;
+        if (!by_ref && new_len > UINT_MAX) {
+          file->error = SRT_ERROR_ALLOC;
+          return SRT_ERROR_ALLOC;
+        }
+        STATS_ADD(STATS_REALLOCS, 1);
+        // With buf_len 0, text isn't the subtitle's own (it may point
+        // into a mapping), so it mustn't be reallocated
+        char* new = file->alloc->realloc(file->alloc->ctx, buf_len ? *text : NULL, buf_len, new_len);
         if (new == NULL) {
           file->error = SRT_ERROR_ALLOC;
           return SRT_ERROR_ALLOC;
         }
-        subtitle->text = new;
-      }  
-      memcpy(subtitle->text+subtitle->len, line, line_len+1);
+        *text = new;
+        if (by_ref) {
+          file->text_len = new_len;
+        } else {
+          subtitle->buf_len = new_len;
+        }
+      }
+      memcpy(*text+subtitle->len, line, line_len);
       subtitle->len += line_len;
+      (*text)[subtitle->len] = 0;
     }
 
   }
@@ -243,87 +776,337 @@ int srt_read(srt_file* file, sub_text* subtitle) {
   subtitle->start = start;
   subtitle->end = end;
 
+  if (by_ref) {
+    if (file->map != NULL) {
+      subtitle->text = text_start;
+    } else {
+      subtitle->text = file->text;
+    }
+    subtitle->buf_len = 0;
+  }
+
   return 0;
 }
 
 
-int srt_write(srt_file* file, sub_text* subtitle) {
+int srt_read(srt_file* file, sub_text* subtitle) {
   /*
-   * Writes subtitle to file.  If an error occurs, file->error is set
-   * to an error code and the same error code is returned.  Otherwise,
-   * 0 is returned.
+   * Reads a subtitle from the file into subtitle.  Reallocs the
+   * subtitle text buffer if necessary to accomodate the length, and
+   * updates buf_len appropriately.  If the subtitle doesn't currently
+   * have a text buffer (buf_len is 0), it is allocated, and must be
+   * freed by the caller, with free or, if the file has an allocator
+   * of its own, srt_free_text.  The buffer grows by doubling, so a
+   * subtitle reused for every read soon stops needing allocations.
+   *
+   * If there was an error reading from the file, or if the file has
+   * been opened for reading rather than writing, the error flag in
+   * file is set and a negative number is returned.  On success, 0 is
+   * returned.
+   */
+  stats_timer t;
+  STATS_BEGIN(t);
+  int error = srt_parse(file, subtitle, 0);
+  STATS_END(STATS_PARSE_NS, t);
+  if (!error) {
+    STATS_ADD(STATS_CUES, 1);
+  }
+  return error;
+}
+
+
+int srt_read_ref(srt_file* file, sub_text* subtitle) {
+  /*
+   * Reads a subtitle from the file like srt_read, but without copying
+   * its text into a buffer owned by the subtitle.  Instead, text
+   * points into the mapping for files opened with srt_open_mmap (and
+   * remains valid until the file is closed), or into a buffer owned
+   * by the file for other files (and remains valid until the next
+   * read).  Text in a mapping is not NUL-terminated; len must be used.
+   *
+   * buf_len is set to 0, and the text must not be freed or realloc'd
+   * by the caller.  Returns 0 on success or a negative error code, as
+   * for srt_read.
+   */
+  stats_timer t;
+  STATS_BEGIN(t);
+  int error = srt_parse(file, subtitle, 1);
+  STATS_END(STATS_PARSE_NS, t);
+  if (!error) {
+    STATS_ADD(STATS_CUES, 1);
+  }
+  return error;
+}
+
+
+// Pairs of digits "00" to "99", for formatting numbers two digits at a time
+static const char srt_digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+
+static char* srt_format_uint(char* out, unsigned long val, int min_digits) {
+  /*
+   * Formats val in decimal at out, zero-padded to at least min_digits
+   * digits (at most 3), and returns a pointer just past the last digit.
+   */
+  char tmp[24];
+  char* c = tmp + sizeof(tmp);
+  while (val >= 100) {
+    c -= 2;
+    memcpy(c, srt_digit_pairs + 2*(val % 100), 2);
+    val /= 100;
+  }
+  if (val >= 10) {
+    c -= 2;
+    memcpy(c, srt_digit_pairs + 2*val, 2);
+  } else {
+    *--c = '0' + val;
+  }
+  while (tmp + sizeof(tmp) - c < min_digits) {
+    *--c = '0';
+  }
+  size_t len = tmp + sizeof(tmp) - c;
+  memcpy(out, c, len);
+  return out + len;
+}
+
+
+static char* srt_format_time(char* out, unsigned long t) {
+  /*
+   * Formats a time in milliseconds as HH:MM:SS,mmm at out, and returns
+   * a pointer just past the end.
+   */
+  unsigned int msec = t % 1000UL;
+  t /= 1000UL;
+  unsigned int sec = t % 60UL;
+  t /= 60UL;
+  unsigned int min = t % 60UL;
+  // Hours are printed as an unsigned int, as they always have been
+  unsigned int hr = t / 60UL;
+
+  if (hr < 100) {
+    memcpy(out, srt_digit_pairs + 2*hr, 2);
+    out += 2;
+  } else {
+    out = srt_format_uint(out, hr, 2);
+  }
+  *out++ = ':';
+  memcpy(out, srt_digit_pairs + 2*min, 2);
+  out[2] = ':';
+  memcpy(out+3, srt_digit_pairs + 2*sec, 2);
+  out[5] = ',';
+  out[6] = '0' + msec / 100;
+  memcpy(out+7, srt_digit_pairs + 2*(msec % 100), 2);
+  return out + 9;
+}
+
+
+static int srt_write_memory(srt_file* file, const struct iovec* iov, int iovcnt) {
+  /*
+   * Appends the given buffers to the memory of a file opened with
+   * srt_open_write_memory.  Returns 0 on success or SRT_ERROR_WRITE.
+   */
+  size_t len = 0;
+  int i;
+  for (i=0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+  if (file->sink_len + len > file->sink_max) {
+    size_t new_max = file->sink_max ? 2 * file->sink_max : SRT_OUT_BUF_SIZE;
+    while (new_max < file->sink_len + len) new_max *= 2;
+    STATS_ADD(STATS_REALLOCS, 1);
+    char* new = realloc(file->sink, new_max);
+    if (new == NULL) {
+      return SRT_ERROR_WRITE;
+    }
+    file->sink = new;
+    file->sink_max = new_max;
+  }
+  for (i=0; i < iovcnt; ++i) {
+    memcpy(file->sink + file->sink_len, iov[i].iov_base, iov[i].iov_len);
+    file->sink_len += iov[i].iov_len;
+  }
+  return 0;
+}
+
+
+static int srt_write_fd(srt_file* file, const struct iovec* iov, int iovcnt) {
+  /*
+   * Writes all of the given buffers to the file, retrying after short
+   * writes.  Returns 0 on success or SRT_ERROR_WRITE.
    */
+  if (file->f == NULL) {
+    return srt_write_memory(file, iov, iovcnt);
+  }
+  int fd = fileno(file->f);
+  struct iovec v[2];
+  memcpy(v, iov, iovcnt*sizeof(struct iovec));
+  struct iovec* cur = v;
+
+  stats_timer t;
+  STATS_BEGIN(t);
+  while (iovcnt > 0) {
+    ssize_t written = writev(fd, cur, iovcnt);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      STATS_END(STATS_IO_NS, t);
+      return SRT_ERROR_WRITE;
+    }
+    STATS_ADD(STATS_BYTES_WRITTEN, written);
+    while (iovcnt > 0 && (size_t)written >= cur->iov_len) {
+      written -= cur->iov_len;
+      ++cur;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      cur->iov_base = (char*)cur->iov_base + written;
+      cur->iov_len -= written;
+    }
+  }
+  STATS_END(STATS_IO_NS, t);
+  return 0;
+}
+
 
+int srt_flush(srt_file* file) {
+  /*
+   * Writes out anything buffered by srt_write.  Returns 0 on success,
+   * or sets file->error and returns SRT_ERROR_WRITE.
+   */
   if (file->mode != SRT_MODE_WRITE) {
     return SRT_ERROR_MODE_CANNOT_WRITE;
   }
-
-  if(fprintf(file->f, "%u%s", subtitle->id, file->delimiter) < 0) {
+  if (file->out_fill == 0) {
+    return 0;
+  }
+  struct iovec iov = { file->out, file->out_fill };
+  file->out_fill = 0;
+  if (srt_write_fd(file, &iov, 1)) {
     file->error = SRT_ERROR_WRITE;
     return SRT_ERROR_WRITE;
   }
+  return 0;
+}
 
-  unsigned long start = subtitle->start;
-  unsigned long end = subtitle->end;
-  unsigned int start_hr, start_min, start_sec, start_msec;
-  unsigned int end_hr, end_min, end_sec, end_msec;
-
-  start_msec = start % 1000UL;
-  start /= 1000UL;
-  start_sec = start % 60UL;
-  start /= 60UL;
-  start_min = start % 60UL;
-  start /= 60UL;
-  start_hr = start;
-
-  end_msec = end % 1000UL;
-  end /= 1000UL;
-  end_sec = end % 60UL;
-  end /= 60UL;
-  end_min = end % 60UL;
-  end /= 60UL;
-  end_hr = end;
-  
-  if(fprintf(file->f, "%02u:%02u:%02u,%03u --> %02u:%02u:%02u,%03u%s",
-             start_hr, start_min, start_sec, start_msec,
-             end_hr, end_min, end_sec, end_msec,
-             file->delimiter) < 0) {
-    file->error = SRT_ERROR_WRITE;
+
+static int srt_emit(srt_file* file, const char* data, size_t len) {
+  /*
+   * Appends len bytes to the output buffer, flushing as necessary.
+   * Spans too big to be worth copying are written straight from data
+   * together with the buffer contents.
+   */
+  if (file->out_fill + len <= SRT_OUT_BUF_SIZE) {
+    memcpy(file->out + file->out_fill, data, len);
+    file->out_fill += len;
+    return 0;
+  }
+
+  if (len >= SRT_OUT_BUF_SIZE/2) {
+    struct iovec iov[2] = {
+      { file->out, file->out_fill },
+      { (void*)data, len }
+    };
+    file->out_fill = 0;
+    if (srt_write_fd(file, iov, 2)) {
+      file->error = SRT_ERROR_WRITE;
+      return SRT_ERROR_WRITE;
+    }
+    return 0;
+  }
+
+  if (srt_flush(file)) {
     return SRT_ERROR_WRITE;
   }
+  memcpy(file->out, data, len);
+  file->out_fill = len;
+  return 0;
+}
+
+
+static int srt_format(srt_file* file, sub_text* subtitle) {
+  /*
+   * Formats subtitle into the output buffer, for srt_write.
+   */
+  if (file->mode != SRT_MODE_WRITE) {
+    return SRT_ERROR_MODE_CANNOT_WRITE;
+  }
 
-  // Need to do newline conversion on the subtitle string
-  char*c;
-  for (c=subtitle->text; c < subtitle->text+subtitle->len; c++) {
-    if (*c == '\n') {
-      if (fputs(file->delimiter, file->f) < 0) {
-        file->error = SRT_ERROR_WRITE;
+  if (file->out == NULL) {
+    file->out = malloc(SRT_OUT_BUF_SIZE);
+    if (file->out == NULL) {
+      file->error = SRT_ERROR_ALLOC;
+      return SRT_ERROR_ALLOC;
+    }
+  }
+
+  const char* delim = file->delimiter;
+  size_t delim_len = strlen(delim);
+
+  // The ID and times lines are short enough to always be formatted
+  // into a local buffer in one go
+  char head[128];
+  char* c = srt_format_uint(head, subtitle->id, 1);
+  memcpy(c, delim, delim_len);
+  c += delim_len;
+  c = srt_format_time(c, subtitle->start);
+  memcpy(c, " --> ", 5);
+  c = srt_format_time(c+5, subtitle->end);
+  memcpy(c, delim, delim_len);
+  c += delim_len;
+  if (srt_emit(file, head, c - head)) {
+    return SRT_ERROR_WRITE;
+  }
+
+  // Need to do newline conversion on the subtitle string: \r is
+  // dropped and \n becomes the delimiter.  Text between them is
+  // copied a span at a time.  A subtitle with no text may have no
+  // buffer at all, so there is nothing to scan.
+  if (subtitle->len > 0) {
+    const char* text = subtitle->text;
+    const char* text_end = text + subtitle->len;
+    // With a \n delimiter, newlines can be copied along with the text
+    int lf_delim = (delim_len == 1);
+    const char* next_cr = memchr(text, '\r', subtitle->len);
+    const char* next_lf = lf_delim ? NULL : memchr(text, '\n', subtitle->len);
+    while (text < text_end) {
+      const char* stop = text_end;
+      if (next_cr != NULL && next_cr < stop) stop = next_cr;
+      if (next_lf != NULL && next_lf < stop) stop = next_lf;
+
+      if (stop > text && srt_emit(file, text, stop - text)) {
         return SRT_ERROR_WRITE;
       }
-    } else if (*c == '\r') {
-      continue;
-    } else {
-      if (fputc(*c, file->f) < 0) {
-        file->error = SRT_ERROR_WRITE;
-        return SRT_ERROR_WRITE;
+      if (stop == text_end) {
+        break;
       }
+      if (*stop == '\n') {
+        if (srt_emit(file, delim, delim_len)) {
+          return SRT_ERROR_WRITE;
+        }
+        next_lf = memchr(stop+1, '\n', text_end - stop - 1);
+      } else {
+        next_cr = memchr(stop+1, '\r', text_end - stop - 1);
+      }
+      text = stop + 1;
     }
   }
 
-  if (subtitle->len == 0) {
-    if(fputs(file->delimiter, file->f) < 0) {
-      file->error = SRT_ERROR_WRITE;
-      return SRT_ERROR_WRITE;
-    }
-  } else if (*(c-1) != '\n') {
-    if(fputs(file->delimiter, file->f) < 0) {
-      file->error = SRT_ERROR_WRITE;
+  if (subtitle->len == 0 || subtitle->text[subtitle->len-1] != '\n') {
+    if (srt_emit(file, delim, delim_len)) {
       return SRT_ERROR_WRITE;
     }
   }
 
-  if(fputs(file->delimiter, file->f) < 0) {
-    file->error = SRT_ERROR_WRITE;
+  if (srt_emit(file, delim, delim_len)) {
     return SRT_ERROR_WRITE;
   }
 
@@ -331,6 +1114,70 @@ int srt_write(srt_file* file, sub_text* subtitle) {
 }
 
 
+int srt_write(srt_file* file, sub_text* subtitle) {
+  /*
+   * Writes subtitle to file.  If an error occurs, file->error is set
+   * to an error code and the same error code is returned.  Otherwise,
+   * 0 is returned.
+   *
+   * Output is buffered and formatted by hand, so a write error may
+   * not be reported until a later call, srt_flush or srt_close.
+   */
+  stats_timer t;
+  STATS_BEGIN(t);
+  int error = srt_format(file, subtitle);
+  STATS_END(STATS_FORMAT_NS, t);
+  return error;
+}
+
+
+void srt_set_allocator(srt_file* file, srt_allocator* alloc) {
+  /*
+   * Makes file use alloc for the text buffers of subtitles read with
+   * srt_read, and for its own buffer for srt_read_ref; NULL restores
+   * the C library's allocator.  Must be called before anything is
+   * read.  alloc must remain valid until the file is closed, and
+   * subtitles read with srt_read must be freed with srt_free_text.
+   */
+  file->alloc = (alloc != NULL) ? alloc : &srt_default_allocator;
+}
+
+
+void srt_free_text(srt_file* file, sub_text* subtitle) {
+  /*
+   * Frees the text buffer of a subtitle filled by srt_read from file,
+   * with the file's allocator.
+   */
+  if (subtitle->text != NULL && subtitle->buf_len > 0) {
+    file->alloc->free(file->alloc->ctx, subtitle->text, subtitle->buf_len);
+  }
+  subtitle->text = NULL;
+  subtitle->buf_len = 0;
+  subtitle->len = 0;
+}
+
+
+int srt_validate(srt_file* file, size_t* offset) {
+  /*
+   * Checks that the text of a file opened with srt_open_mmap or
+   * srt_open_memory is well-formed UTF-8 (once transcoded, if it was
+   * UTF-16).  Returns 0 if it is, or SRT_ERROR_ENCODING with offset
+   * set to the byte offset of the first invalid sequence.  Files read
+   * through stdio aren't checked, and give 0.
+   */
+  if (file->map == NULL) {
+    return 0;
+  }
+  size_t len = file->map_len - file->map_start;
+  size_t bad = utf8_validate(file->map + file->map_start, len);
+  if (bad == len) {
+    return 0;
+  }
+  *offset = file->map_start + bad;
+  return SRT_ERROR_ENCODING;
+}
+
+
 char* srt_strerror(int error_code) {
   /*
    * Returns a human-readable string explaining an error code.
@@ -353,6 +1200,8 @@ char* srt_strerror(int error_code) {
     return "End of file";
   } else if (error_code == SRT_ERROR_SEEK) {
     return "Cannot seek in this file";
+  } else if (error_code == SRT_ERROR_ENCODING) {
+    return "The file is not valid UTF-8";
   } else {
     return "Unknown error code";
   }
@@ -370,9 +1219,14 @@ int srt_seek_beginning(srt_file* file) {
   if (file->error && file->error != SRT_EOF) {
     return SRT_ERROR_PREVIOUS_ERROR;
   }
+  if (file->map != NULL) {
+    file->map_pos = file->map_start;
+    return 0;
+  }
   if (fseek(file->f, 0, SEEK_SET)) {
     file->error = SRT_ERROR_SEEK;
     return SRT_ERROR_SEEK;
   }
+  file->encoding_checked = 0;
   return 0;
 }
@@ -23,6 +23,14 @@
 #include <string.h>
 
 #include "subtitles.h"
+#include "utf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Size of the buffer used to collect output before it is written
+#define SRT_OUT_BUF_SIZE 262144
 
 typedef enum {
   SRT_MODE_READ,
@@ -31,15 +39,30 @@ typedef enum {
 
 // Errors which might be encountered while reading; correspond to
 // parse errors on the ID line and the start/end times line
-int SRT_ERROR_ID;
-int SRT_ERROR_TIMES;
-int SRT_ERROR_ALLOC;
-int SRT_ERROR_WRITE;
-int SRT_ERROR_MODE_CANNOT_READ;
-int SRT_ERROR_MODE_CANNOT_WRITE;
-int SRT_ERROR_PREVIOUS_ERROR;
-int SRT_EOF;
-int SRT_ERROR_SEEK;
+extern int SRT_ERROR_ID;
+extern int SRT_ERROR_TIMES;
+extern int SRT_ERROR_ALLOC;
+extern int SRT_ERROR_WRITE;
+extern int SRT_ERROR_MODE_CANNOT_READ;
+extern int SRT_ERROR_MODE_CANNOT_WRITE;
+extern int SRT_ERROR_PREVIOUS_ERROR;
+extern int SRT_EOF;
+extern int SRT_ERROR_SEEK;
+extern int SRT_ERROR_ENCODING;
+
+// An allocator for the text buffers filled by srt_read and
+// srt_read_ref, so that the caller may supply an arena or a pool.
+// realloc behaves as the C library's, but is told the old size too;
+// free is given the size of the buffer being freed.
+typedef struct {
+  void* (*realloc)(void* ctx, void* ptr, size_t old_size, size_t new_size);
+  void (*free)(void* ctx, void* ptr, size_t size);
+  void* ctx;
+} srt_allocator;
+
+// The smallest text buffer srt_read allocates; buffers grow by
+// doubling from here
+#define SRT_MIN_TEXT_BUF 256
 
 typedef struct {
 
@@ -59,15 +82,76 @@ typedef struct {
   char* line;
   size_t len;
 
+  // For files opened with srt_open_mmap or srt_open_memory, the
+  // mapping of the whole file, its length and the offset of the next
+  // unread line.  map is NULL for files read through stdio.
+  char* map;
+  size_t map_len;
+  size_t map_pos;
+
+  // Set if map is a mapping to be unmapped by srt_close, rather than
+  // memory belonging to the caller
+  int map_owned;
+
+  // Set if map is instead a buffer holding the file transcoded to
+  // UTF-8, to be freed by srt_close
+  int map_heap;
+
+  // Where the subtitles start in map, after any byte order mark
+  size_t map_start;
+
+  // The encoding the file was found to be in, and whether it has been
+  // looked at yet (files read through stdio are looked at when the
+  // first line is read)
+  utf_encoding encoding;
+  int encoding_checked;
+
+  // Buffer holding the text handed out by srt_read_ref for files read
+  // through stdio, and its allocated length
+  char* text;
+  size_t text_len;
+
+  // The allocator for text buffers; the C library's by default
+  srt_allocator* alloc;
+
+  // For files being written, a buffer of SRT_OUT_BUF_SIZE bytes
+  // holding output not yet written, and the number of bytes in it
+  char* out;
+  size_t out_fill;
+
+  // For files opened with srt_open_write_memory, the memory the output
+  // is collected in, the number of bytes in it and its allocated size
+  char* sink;
+  size_t sink_len;
+  size_t sink_max;
+
   // Error flag, set if there was an error parsing the file
   int error;
+
+  // Set if the end of the file was reached part-way through a
+  // subtitle, after its ID line but before its times line
+  int truncated;
 } srt_file;
 
 
 srt_file* srt_open_read(char* filename);
+srt_file* srt_open_mmap(char* filename);
+srt_file* srt_open_memory(char* data, size_t len);
 srt_file* srt_open_write(char* filename);
-void srt_close(srt_file* file);
+srt_file* srt_open_write_stream(FILE* f);
+srt_file* srt_open_write_memory(void);
+char* srt_take_memory(srt_file* file, size_t* len);
+int srt_close(srt_file* file);
 int srt_read(srt_file* file, sub_text* subtitle);
+int srt_read_ref(srt_file* file, sub_text* subtitle);
 int srt_write(srt_file* file, sub_text* subtitle);
+int srt_flush(srt_file* file);
 int srt_seek_beginning(srt_file* file);
+void srt_set_allocator(srt_file* file, srt_allocator* alloc);
+void srt_free_text(srt_file* file, sub_text* subtitle);
+int srt_validate(srt_file* file, size_t* offset);
 char* srt_strerror(int error_code);
+
+#ifdef __cplusplus
+}
+#endif
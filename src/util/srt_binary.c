@@ -0,0 +1,214 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "srt_binary.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int SRT_BINARY_ERROR_FORMAT = -1;
+int SRT_BINARY_ERROR_WRITE = -2;
+
+// Records are written in batches of this many
+#define SRT_BINARY_WRITE_BATCH 4096
+
+
+int srt_binary_write(srt_document* doc, char* filename) {
+  /*
+   * Compiles the document into filename.  The file is written to a
+   * temporary file and renamed into place, so a reader never maps a
+   * partial file.  Returns 0 on success or SRT_BINARY_ERROR_WRITE
+   * (errno may be inspected to determine the cause).
+   */
+  srt_binary_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SRT_BINARY_MAGIC, 8);
+  h.byte_order = 0x01020304;
+  h.version = SRT_BINARY_VERSION;
+  h.nr_subs = doc->nr_subs;
+  h.text_len = doc->text_len;
+  if (doc->delimiter != NULL) {
+    strncpy(h.delimiter, doc->delimiter, sizeof(h.delimiter) - 1);
+  }
+
+  srt_binary_record* batch = malloc(SRT_BINARY_WRITE_BATCH * sizeof(srt_binary_record));
+  char* tmp_name = malloc(strlen(filename) + 5);
+  if (batch == NULL || tmp_name == NULL) {
+    free(batch);
+    free(tmp_name);
+    return SRT_BINARY_ERROR_WRITE;
+  }
+  sprintf(tmp_name, "%s.tmp", filename);
+
+  FILE* f = fopen(tmp_name, "wb");
+  if (f == NULL) {
+    free(batch);
+    free(tmp_name);
+    return SRT_BINARY_ERROR_WRITE;
+  }
+
+  int error = fwrite(&h, sizeof(h), 1, f) != 1;
+  size_t i = 0;
+  while (i < doc->nr_subs && !error) {
+    size_t n = doc->nr_subs - i;
+    if (n > SRT_BINARY_WRITE_BATCH) n = SRT_BINARY_WRITE_BATCH;
+    size_t j;
+    for (j=0; j < n; ++j) {
+      srt_binary_record* r = &batch[j];
+      r->id = doc->ids[i+j];
+      r->text_len = doc->text_lens[i+j];
+      r->start = doc->starts[i+j];
+      r->end = doc->ends[i+j];
+      r->text_offset = doc->text_offsets[i+j];
+    }
+    error = fwrite(batch, sizeof(srt_binary_record), n, f) != n;
+    i += n;
+  }
+  if (!error && doc->text_len > 0) {
+    error = fwrite(doc->text, 1, doc->text_len, f) != doc->text_len;
+  }
+  error |= fclose(f) != 0;
+  if (!error) {
+    error = rename(tmp_name, filename) != 0;
+  }
+  if (error) {
+    remove(tmp_name);
+  } else {
+    STATS_ADD(STATS_BYTES_WRITTEN, sizeof(h) + doc->nr_subs * sizeof(srt_binary_record) + doc->text_len);
+  }
+  free(batch);
+  free(tmp_name);
+  return error ? SRT_BINARY_ERROR_WRITE : 0;
+}
+
+
+srt_binary* srt_binary_open(char* filename) {
+  /*
+   * Maps a compiled file.  Only the header is checked, so this takes
+   * the same time for any size of file; each record is checked as it
+   * is fetched by srt_binary_get.  Returns NULL if the file cannot be
+   * opened (errno may be inspected to determine the cause; EINVAL
+   * means it isn't a compiled file, or is damaged) or memory cannot be
+   * allocated.  The file must be closed with srt_binary_close.
+   */
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return NULL;
+  }
+  size_t len = st.st_size;
+  if (!S_ISREG(st.st_mode) || len < sizeof(srt_binary_header)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  char* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  srt_binary_header* h = (srt_binary_header*) map;
+  size_t records_len = len - sizeof(srt_binary_header);
+  if (memcmp(h->magic, SRT_BINARY_MAGIC, 8) || h->byte_order != 0x01020304 ||
+      h->version != SRT_BINARY_VERSION ||
+      h->nr_subs > records_len / sizeof(srt_binary_record) ||
+      h->text_len != records_len - h->nr_subs * sizeof(srt_binary_record)) {
+    munmap(map, len);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  srt_binary* bin = malloc(sizeof(srt_binary));
+  if (bin == NULL) {
+    munmap(map, len);
+    return NULL;
+  }
+  bin->map = map;
+  bin->map_len = len;
+  bin->header = h;
+  bin->records = (srt_binary_record*) (map + sizeof(srt_binary_header));
+  bin->text = (char*) (bin->records + h->nr_subs);
+  bin->nr_subs = h->nr_subs;
+  STATS_ADD(STATS_BYTES_READ, len);
+  if (!strcmp(h->delimiter, "\n")) {
+    bin->delimiter = "\n";
+  } else {
+    bin->delimiter = "\r\n";
+  }
+
+  // Subtitles are mostly fetched in order
+  madvise(map, len, MADV_SEQUENTIAL);
+  return bin;
+}
+
+
+void srt_binary_close(srt_binary* bin) {
+  munmap(bin->map, bin->map_len);
+  free(bin);
+}
+
+
+int srt_binary_get(srt_binary* bin, size_t i, sub_text* subtitle) {
+  /*
+   * Fills in subtitle with subtitle i of the file.  The text points
+   * into the mapping (and is not NUL-terminated), so it remains valid
+   * until the file is closed; buf_len is set to 0, and the text must
+   * not be freed or realloc'd.  Returns 0 on success or
+   * SRT_BINARY_ERROR_FORMAT if the record is damaged.
+   */
+  srt_binary_record* r = &bin->records[i];
+  uint64_t text_len = bin->header->text_len;
+  if (r->text_offset > text_len || r->text_len > text_len - r->text_offset ||
+      r->start < 0 || r->end < 0) {
+    return SRT_BINARY_ERROR_FORMAT;
+  }
+  subtitle->id = r->id;
+  subtitle->start = r->start;
+  subtitle->end = r->end;
+  subtitle->text = bin->text + r->text_offset;
+  subtitle->len = r->text_len;
+  subtitle->buf_len = 0;
+  return 0;
+}
+
+
+char* srt_binary_strerror(int error_code) {
+  /*
+   * Returns a human-readable string explaining an error code.
+   */
+  if (error_code == SRT_BINARY_ERROR_FORMAT) {
+    return "The compiled file is damaged";
+  } else if (error_code == SRT_BINARY_ERROR_WRITE) {
+    return "Could not write the compiled file";
+  } else {
+    return "Unknown error code";
+  }
+}
@@ -0,0 +1,92 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "srt_document.h"
+#include "subtitles.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A compiled SRT file: a header, one fixed-width record per subtitle
+// and then the text of all the subtitles in one pool.  Compiled files
+// are used by mapping them, with no parsing, so opening one takes the
+// same time however many subtitles it holds.
+
+#define SRT_BINARY_MAGIC "SRTBIN\0\0"
+#define SRT_BINARY_VERSION 1
+
+typedef struct {
+  char magic[8];
+
+  // 0x01020304 as written, to catch files from a different byte order
+  uint32_t byte_order;
+  uint32_t version;
+
+  uint64_t nr_subs;
+  uint64_t text_len;
+
+  // The newline delimiter of the original SRT file, NUL-padded
+  char delimiter[8];
+} srt_binary_header;
+
+typedef struct {
+  uint32_t id;
+
+  // The length of the text, which is at text_offset in the text pool
+  // and is not NUL-terminated
+  uint32_t text_len;
+  int64_t start;
+  int64_t end;
+  uint64_t text_offset;
+} srt_binary_record;
+
+typedef struct {
+  // The mapping of the whole file and its length
+  char* map;
+  size_t map_len;
+
+  // Pointers into the mapping
+  srt_binary_header* header;
+  srt_binary_record* records;
+  char* text;
+
+  size_t nr_subs;
+
+  // The delimiter, as one of the strings srt_file uses
+  char* delimiter;
+} srt_binary;
+
+extern int SRT_BINARY_ERROR_FORMAT;
+extern int SRT_BINARY_ERROR_WRITE;
+
+int srt_binary_write(srt_document* doc, char* filename);
+srt_binary* srt_binary_open(char* filename);
+void srt_binary_close(srt_binary* bin);
+int srt_binary_get(srt_binary* bin, size_t i, sub_text* subtitle);
+char* srt_binary_strerror(int error_code);
+
+#ifdef __cplusplus
+}
+#endif
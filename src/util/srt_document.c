@@ -0,0 +1,505 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "srt_document.h"
+#include "stats.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Rough number of bytes per subtitle in a typical file, used to guess
+// how many subtitles a file holds from its size
+#define SRT_BYTES_PER_SUB_GUESS 48
+
+
+static size_t srt_document_arena_len(size_t max_subs, size_t text_max) {
+  /*
+   * Returns the size of an arena holding max_subs subtitles and
+   * text_max bytes of text.  The 8-byte arrays come first so that
+   * everything stays aligned.
+   */
+  return max_subs * (2*sizeof(long) + sizeof(size_t) + 2*sizeof(unsigned int))
+    + text_max;
+}
+
+
+static void srt_document_layout(srt_document* doc, void* arena,
+                                size_t max_subs, size_t text_max) {
+  /*
+   * Points the arrays of doc into arena, laid out for max_subs
+   * subtitles and text_max bytes of text.
+   */
+  char* c = arena;
+  doc->starts = (long*)c;
+  c += max_subs * sizeof(long);
+  doc->ends = (long*)c;
+  c += max_subs * sizeof(long);
+  doc->text_offsets = (size_t*)c;
+  c += max_subs * sizeof(size_t);
+  doc->ids = (unsigned int*)c;
+  c += max_subs * sizeof(unsigned int);
+  doc->text_lens = (unsigned int*)c;
+  c += max_subs * sizeof(unsigned int);
+  doc->text = c;
+
+  doc->arena = arena;
+  doc->arena_len = srt_document_arena_len(max_subs, text_max);
+  doc->max_subs = max_subs;
+  doc->text_max = text_max;
+}
+
+
+srt_document* srt_document_alloc(size_t max_subs, size_t text_max) {
+  /*
+   * Allocates an empty document with room for max_subs subtitles and
+   * text_max bytes of text; it grows as needed beyond that.  Returns
+   * NULL if memory could not be allocated.  The document must be
+   * freed with srt_document_free.
+   */
+  srt_document* doc = malloc(sizeof(srt_document));
+  if (doc == NULL) {
+    return NULL;
+  }
+
+  if (max_subs == 0) max_subs = 1;
+  if (text_max == 0) text_max = 1;
+  void* arena = malloc(srt_document_arena_len(max_subs, text_max));
+  if (arena == NULL) {
+    free(doc);
+    return NULL;
+  }
+
+  srt_document_layout(doc, arena, max_subs, text_max);
+  doc->nr_subs = 0;
+  doc->text_len = 0;
+  doc->delimiter = NULL;
+  return doc;
+}
+
+
+void srt_document_free(srt_document* doc) {
+  /*
+   * Frees a document and all of its subtitles.
+   */
+  free(doc->arena);
+  free(doc);
+}
+
+
+void srt_document_clear(srt_document* doc) {
+  /*
+   * Removes all subtitles from a document, keeping its memory for
+   * reuse.
+   */
+  doc->nr_subs = 0;
+  doc->text_len = 0;
+}
+
+
+int srt_document_reserve(srt_document* doc, size_t max_subs, size_t text_max) {
+  /*
+   * Makes sure the document has room for at least max_subs subtitles
+   * and text_max bytes of text, growing the arena geometrically if
+   * not.  Returns 0 on success or SRT_ERROR_ALLOC, in which case the
+   * document is unchanged.
+   */
+  if (max_subs <= doc->max_subs && text_max <= doc->text_max) {
+    return 0;
+  }
+
+  size_t new_subs = doc->max_subs;
+  while (new_subs < max_subs) new_subs *= 2;
+  size_t new_text = doc->text_max;
+  while (new_text < text_max) new_text *= 2;
+
+  STATS_ADD(STATS_REALLOCS, 1);
+  void* arena = malloc(srt_document_arena_len(new_subs, new_text));
+  if (arena == NULL) {
+    return SRT_ERROR_ALLOC;
+  }
+
+  // The arrays move relative to each other, so copy them one by one
+  srt_document old = *doc;
+  srt_document_layout(doc, arena, new_subs, new_text);
+  memcpy(doc->starts, old.starts, old.nr_subs * sizeof(long));
+  memcpy(doc->ends, old.ends, old.nr_subs * sizeof(long));
+  memcpy(doc->text_offsets, old.text_offsets, old.nr_subs * sizeof(size_t));
+  memcpy(doc->ids, old.ids, old.nr_subs * sizeof(unsigned int));
+  memcpy(doc->text_lens, old.text_lens, old.nr_subs * sizeof(unsigned int));
+  memcpy(doc->text, old.text, old.text_len);
+  free(old.arena);
+
+  return 0;
+}
+
+
+int srt_document_append(srt_document* doc, sub_text* subtitle) {
+  /*
+   * Appends a copy of subtitle to the end of the document.  Returns 0
+   * on success or SRT_ERROR_ALLOC.
+   */
+  if (srt_document_reserve(doc, doc->nr_subs + 1, doc->text_len + subtitle->len)) {
+    return SRT_ERROR_ALLOC;
+  }
+
+  size_t i = doc->nr_subs++;
+  doc->ids[i] = subtitle->id;
+  doc->starts[i] = subtitle->start;
+  doc->ends[i] = subtitle->end;
+  doc->text_offsets[i] = doc->text_len;
+  doc->text_lens[i] = subtitle->len;
+  if (subtitle->len > 0) {
+    memcpy(doc->text + doc->text_len, subtitle->text, subtitle->len);
+  }
+  doc->text_len += subtitle->len;
+  return 0;
+}
+
+
+void srt_document_get(srt_document* doc, size_t i, sub_text* subtitle) {
+  /*
+   * Fills in subtitle with subtitle i of the document.  The text
+   * points into the document (and is not NUL-terminated), so it
+   * remains valid until the document is next modified; buf_len is
+   * set to 0, and the text must not be freed or realloc'd.
+   */
+  subtitle->id = doc->ids[i];
+  subtitle->start = doc->starts[i];
+  subtitle->end = doc->ends[i];
+  subtitle->text = doc->text + doc->text_offsets[i];
+  subtitle->len = doc->text_lens[i];
+  subtitle->buf_len = 0;
+}
+
+
+int srt_document_read(srt_file* file, srt_document* doc) {
+  /*
+   * Reads all the remaining subtitles in file, appending them to the
+   * document.  Returns 0 when the end of the file is reached, or a
+   * negative error code, in which case the subtitles before the error
+   * have been appended and file->line_no gives the line of the error.
+   */
+  if (file->map != NULL) {
+    // The text can't be longer than what's left of the file, so
+    // reserve that up front, along with a guess at the number of
+    // subtitles
+    size_t remaining = file->map_len - file->map_pos;
+    if (srt_document_reserve(doc, doc->nr_subs + remaining/SRT_BYTES_PER_SUB_GUESS,
+                             doc->text_len + remaining)) {
+      return SRT_ERROR_ALLOC;
+    }
+  }
+
+  sub_text sub;
+  int error;
+  while (!(error = srt_read_ref(file, &sub))) {
+    if ((error = srt_document_append(doc, &sub))) {
+      file->error = error;
+      return error;
+    }
+  }
+  if (doc->delimiter == NULL) {
+    doc->delimiter = file->delimiter;
+  }
+
+  if (error == SRT_EOF) {
+    return 0;
+  }
+  return error;
+}
+
+
+int srt_document_write(srt_file* file, srt_document* doc) {
+  /*
+   * Writes all the subtitles in the document to file.  Returns 0 on
+   * success or a negative error code, as for srt_write.
+   */
+  sub_text sub;
+  size_t i;
+  int error;
+  for (i=0; i < doc->nr_subs; ++i) {
+    srt_document_get(doc, i, &sub);
+    if ((error = srt_write(file, &sub))) {
+      return error;
+    }
+  }
+  return 0;
+}
+
+
+// Each thread parses at least this much of a file, so that small
+// files are not split up for nothing
+#define SRT_PARALLEL_MIN_CHUNK 262144
+
+typedef struct {
+  // The part of the file to parse, which starts at the beginning of
+  // a subtitle
+  char* data;
+  size_t len;
+  char* delimiter;
+
+  // Results: the subtitles, the return value of srt_document_read,
+  // the line number reached, whether the chunk ended part-way
+  // through a subtitle, and the number of lines in the chunk
+  srt_document* doc;
+  int error;
+  unsigned int line_no;
+  int truncated;
+  unsigned int nr_lines;
+} srt_chunk;
+
+
+static char* srt_next_line(char* line, char* end) {
+  /*
+   * Returns the start of the line after the one at line, or end.
+   */
+  char* nl = memchr(line, '\n', end - line);
+  return (nl == NULL) ? end : nl + 1;
+}
+
+
+static int srt_line_is(char* line, char* end, int want_digits) {
+  /*
+   * Returns true if the line at line is blank, or, if want_digits is
+   * set, consists of a number surrounded by optional whitespace.
+   */
+  while (line < end && *line != '\n' && isspace(*line)) ++line;
+  if (want_digits) {
+    char* digits = line;
+    while (line < end && (unsigned char)(*line - '0') < 10) ++line;
+    if (line == digits) return 0;
+    while (line < end && *line != '\n' && isspace(*line)) ++line;
+  }
+  return line == end || *line == '\n';
+}
+
+
+static char* srt_find_boundary(char* p, char* end) {
+  /*
+   * Finds the first likely subtitle boundary at or after the line
+   * following p: a blank line, then an ID line, then a line
+   * containing "-->".  Returns the start of the ID line, or end if
+   * there is none.
+   */
+  p = srt_next_line(p, end);
+  while (p < end) {
+    char* next = srt_next_line(p, end);
+    if (srt_line_is(p, next, 0)) {
+      char* id = next;
+      char* times = srt_next_line(id, end);
+      if (id < end && srt_line_is(id, times, 1)) {
+        char* after = srt_next_line(times, end);
+        if (times < end && memmem(times, after - times, "-->", 3) != NULL) {
+          return id;
+        }
+      }
+    }
+    p = next;
+  }
+  return end;
+}
+
+
+static void* srt_parse_chunk(void* arg) {
+  /*
+   * Thread body: parses one chunk of a file into its own document.
+   */
+  srt_chunk* chunk = arg;
+  chunk->error = SRT_ERROR_ALLOC;
+  chunk->doc = srt_document_alloc(chunk->len/SRT_BYTES_PER_SUB_GUESS, chunk->len);
+  srt_file* view = srt_open_memory(chunk->data, chunk->len);
+  if (chunk->doc == NULL || view == NULL) {
+    if (view != NULL) srt_close(view);
+    return NULL;
+  }
+  view->delimiter = chunk->delimiter;
+
+  chunk->error = srt_document_read(view, chunk->doc);
+  chunk->line_no = view->line_no;
+  chunk->truncated = view->truncated;
+  srt_close(view);
+
+  chunk->nr_lines = 0;
+  char* c = chunk->data;
+  char* end = chunk->data + chunk->len;
+  while ((c = memchr(c, '\n', end - c)) != NULL) {
+    ++chunk->nr_lines;
+    ++c;
+  }
+  return NULL;
+}
+
+
+static int srt_document_merge(srt_document* doc, srt_document* part) {
+  /*
+   * Appends all the subtitles of part to doc.  Returns 0 on success
+   * or SRT_ERROR_ALLOC.
+   */
+  if (srt_document_reserve(doc, doc->nr_subs + part->nr_subs,
+                           doc->text_len + part->text_len)) {
+    return SRT_ERROR_ALLOC;
+  }
+  size_t n = doc->nr_subs;
+  memcpy(doc->ids + n, part->ids, part->nr_subs * sizeof(unsigned int));
+  memcpy(doc->starts + n, part->starts, part->nr_subs * sizeof(long));
+  memcpy(doc->ends + n, part->ends, part->nr_subs * sizeof(long));
+  memcpy(doc->text_lens + n, part->text_lens, part->nr_subs * sizeof(unsigned int));
+  size_t i;
+  for (i=0; i < part->nr_subs; ++i) {
+    doc->text_offsets[n+i] = part->text_offsets[i] + doc->text_len;
+  }
+  memcpy(doc->text + doc->text_len, part->text, part->text_len);
+  doc->nr_subs += part->nr_subs;
+  doc->text_len += part->text_len;
+  return 0;
+}
+
+
+int srt_document_read_parallel(srt_file* file, srt_document* doc, int nr_threads) {
+  /*
+   * Reads all the remaining subtitles in file into the document like
+   * srt_document_read, but splits the file at subtitle boundaries and
+   * parses the pieces on up to nr_threads threads.  The result, the
+   * return value and file->line_no are exactly as for
+   * srt_document_read.  Files which are not mapped (see
+   * srt_open_mmap), and small files, are simply read sequentially.
+   */
+  if (file->map == NULL || nr_threads <= 1 || file->error) {
+    return srt_document_read(file, doc);
+  }
+
+  // Read the first subtitle on its own, which settles the delimiter
+  // and leaves us at the start of a subtitle
+  sub_text sub;
+  int error = srt_read_ref(file, &sub);
+  if (doc->delimiter == NULL) {
+    doc->delimiter = file->delimiter;
+  }
+  if (error) {
+    return (error == SRT_EOF) ? 0 : error;
+  }
+  if ((error = srt_document_append(doc, &sub))) {
+    file->error = error;
+    return error;
+  }
+
+  char* start = file->map + file->map_pos;
+  char* end = file->map + file->map_len;
+  size_t remaining = end - start;
+  if (remaining / SRT_PARALLEL_MIN_CHUNK < (size_t)nr_threads) {
+    nr_threads = remaining / SRT_PARALLEL_MIN_CHUNK;
+  }
+  if (nr_threads <= 1) {
+    return srt_document_read(file, doc);
+  }
+
+  srt_chunk* chunks = calloc(nr_threads, sizeof(srt_chunk));
+  pthread_t* threads = calloc(nr_threads, sizeof(pthread_t));
+  int* started = calloc(nr_threads, sizeof(int));
+  if (chunks == NULL || threads == NULL || started == NULL) {
+    free(chunks);
+    free(threads);
+    free(started);
+    return srt_document_read(file, doc);
+  }
+
+  // Split into roughly equal pieces, each starting at a boundary
+  int nr_chunks = 0;
+  char* chunk_start = start;
+  while (chunk_start < end && nr_chunks < nr_threads) {
+    char* chunk_end = end;
+    if (nr_chunks < nr_threads - 1) {
+      char* target = start + remaining / nr_threads * (nr_chunks + 1);
+      if (target < chunk_start) target = chunk_start;
+      chunk_end = srt_find_boundary(target, end);
+    }
+    chunks[nr_chunks].data = chunk_start;
+    chunks[nr_chunks].len = chunk_end - chunk_start;
+    chunks[nr_chunks].delimiter = file->delimiter;
+    ++nr_chunks;
+    chunk_start = chunk_end;
+  }
+
+  int i;
+  for (i=0; i < nr_chunks; ++i) {
+    started[i] = !pthread_create(&threads[i], NULL, srt_parse_chunk, &chunks[i]);
+    if (!started[i]) {
+      srt_parse_chunk(&chunks[i]);
+    }
+  }
+  for (i=0; i < nr_chunks; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  // Stitch the pieces back together in order, stopping at the first
+  // error just as a sequential read would
+  unsigned int base_line = file->line_no;
+  int fallback = -1;
+  error = 0;
+  for (i=0; i < nr_chunks; ++i) {
+    srt_chunk* chunk = &chunks[i];
+    if (chunk->doc == NULL) {
+      error = SRT_ERROR_ALLOC;
+      break;
+    }
+    if (chunk->truncated && i < nr_chunks - 1) {
+      // The blank line before the next chunk was inside a subtitle
+      // after all, so the split was wrong; read the rest in sequence
+      fallback = i;
+      break;
+    }
+    if ((error = srt_document_merge(doc, chunk->doc))) {
+      break;
+    }
+    if (chunk->error || i == nr_chunks - 1) {
+      error = chunk->error;
+      file->line_no = base_line + chunk->line_no;
+      file->truncated = chunk->truncated;
+      file->map_pos = file->map_len;
+      break;
+    }
+    base_line += chunk->nr_lines;
+  }
+
+  if (fallback >= 0) {
+    file->map_pos = chunks[fallback].data - file->map;
+    file->line_no = base_line;
+  } else if (error) {
+    file->error = error;
+  }
+
+  for (i=0; i < nr_chunks; ++i) {
+    if (chunks[i].doc != NULL) {
+      srt_document_free(chunks[i].doc);
+    }
+  }
+  free(chunks);
+  free(threads);
+  free(started);
+
+  if (fallback >= 0) {
+    return srt_document_read(file, doc);
+  }
+  return error;
+}
@@ -0,0 +1,78 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "srt.h"
+#include "subtitles.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A whole SRT file held in memory.  The subtitles are stored as
+// parallel arrays in a single arena, so passes over the timestamps
+// are linear sweeps, and the text of all the subtitles is kept
+// together in one pool.  Timestamps are signed so that transformations
+// may take them below zero before they are clamped.
+typedef struct {
+
+  // The number of subtitles in the document, and the number there is
+  // currently room for
+  size_t nr_subs;
+  size_t max_subs;
+
+  // One entry per subtitle; the text of subtitle i is text_lens[i]
+  // bytes at text+text_offsets[i], and is not NUL-terminated
+  unsigned int* ids;
+  long* starts;
+  long* ends;
+  size_t* text_offsets;
+  unsigned int* text_lens;
+
+  // The text pool, the number of bytes used and the number there is
+  // currently room for
+  char* text;
+  size_t text_len;
+  size_t text_max;
+
+  // The newline delimiter of the file the document was read from
+  char* delimiter;
+
+  // The block of memory holding all of the above arrays
+  void* arena;
+  size_t arena_len;
+} srt_document;
+
+
+srt_document* srt_document_alloc(size_t max_subs, size_t text_max);
+void srt_document_free(srt_document* doc);
+void srt_document_clear(srt_document* doc);
+int srt_document_reserve(srt_document* doc, size_t max_subs, size_t text_max);
+int srt_document_append(srt_document* doc, sub_text* subtitle);
+void srt_document_get(srt_document* doc, size_t i, sub_text* subtitle);
+int srt_document_read(srt_file* file, srt_document* doc);
+int srt_document_read_parallel(srt_file* file, srt_document* doc, int nr_threads);
+int srt_document_write(srt_file* file, srt_document* doc);
+
+#ifdef __cplusplus
+}
+#endif
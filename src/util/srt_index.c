@@ -0,0 +1,213 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "srt_index.h"
+
+#include <stdlib.h>
+
+// Subtrees this small are scanned rather than descended
+#define SRT_INDEX_SCAN_LEVEL 3
+
+
+static int srt_index_compare(const void* a, const void* b, void* arg) {
+  /*
+   * Orders subtitles by start time, then by position in the file.
+   */
+  long* starts = arg;
+  size_t i = *(const size_t*) a;
+  size_t j = *(const size_t*) b;
+  if (starts[i] != starts[j]) {
+    return (starts[i] > starts[j]) - (starts[i] < starts[j]);
+  }
+  return (i > j) - (i < j);
+}
+
+
+static int srt_index_augment(srt_index* idx) {
+  /*
+   * Fills in max_ends.  Node i of the implicit tree is at the level
+   * given by the number of trailing 1 bits of i, and at level k its
+   * children are i - 2^(k-1) and i + 2^(k-1); nodes beyond the end of
+   * the array are treated as ending as late as the last real node
+   * before them.  Returns the level of the root.
+   */
+  long* ends = idx->ends;
+  long* max_ends = idx->max_ends;
+  size_t n = idx->nr_subs;
+  size_t i;
+  size_t last_i = 0;
+  long last = 0;
+  for (i=0; i < n; i += 2) {
+    last_i = i;
+    last = max_ends[i] = ends[i];
+  }
+  int k;
+  for (k=1; ((size_t) 1 << k) <= n; ++k) {
+    size_t x = (size_t) 1 << (k-1);
+    size_t step = x << 2;
+    for (i = (x << 1) - 1; i < n; i += step) {
+      long left = max_ends[i - x];
+      long right = (i + x < n) ? max_ends[i + x] : last;
+      long e = ends[i];
+      e = (e > left) ? e : left;
+      e = (e > right) ? e : right;
+      max_ends[i] = e;
+    }
+    last_i = ((last_i >> k) & 1) ? last_i - x : last_i + x;
+    if (last_i < n && max_ends[last_i] > last) {
+      last = max_ends[last_i];
+    }
+  }
+  return k-1;
+}
+
+
+srt_index* srt_index_build(srt_document* doc) {
+  /*
+   * Indexes the subtitles currently in a document by time.  The index
+   * doesn't refer to the document, so must be rebuilt if the document
+   * changes.  Returns NULL if memory could not be allocated.  The
+   * index must be freed with srt_index_free.
+   */
+  srt_index* idx = malloc(sizeof(srt_index));
+  if (idx == NULL) {
+    return NULL;
+  }
+  size_t n = doc->nr_subs;
+  idx->nr_subs = n;
+  idx->root_level = 0;
+
+  // One block for all the arrays
+  size_t m = n ? n : 1;
+  idx->starts = malloc(m * (3*sizeof(long) + sizeof(size_t)));
+  if (idx->starts == NULL) {
+    free(idx);
+    return NULL;
+  }
+  idx->ends = idx->starts + m;
+  idx->max_ends = idx->ends + m;
+  idx->subs = (size_t*) (idx->max_ends + m);
+
+  size_t i;
+  for (i=0; i < n; ++i) {
+    idx->subs[i] = i;
+  }
+  qsort_r(idx->subs, n, sizeof(size_t), srt_index_compare, doc->starts);
+  for (i=0; i < n; ++i) {
+    idx->starts[i] = doc->starts[idx->subs[i]];
+    idx->ends[i] = doc->ends[idx->subs[i]];
+  }
+
+  if (n > 0) {
+    idx->root_level = srt_index_augment(idx);
+  }
+  return idx;
+}
+
+
+void srt_index_free(srt_index* idx) {
+  free(idx->starts);
+  free(idx);
+}
+
+
+static int srt_index_add(srt_index_results* results, size_t sub) {
+  if (results->nr_subs == results->max_subs) {
+    size_t new_max = results->max_subs ? 2 * results->max_subs : 16;
+    size_t* new = realloc(results->subs, new_max * sizeof(size_t));
+    if (new == NULL) {
+      return SRT_ERROR_ALLOC;
+    }
+    results->subs = new;
+    results->max_subs = new_max;
+  }
+  results->subs[results->nr_subs++] = sub;
+  return 0;
+}
+
+
+int srt_index_query(srt_index* idx, long from, long to, srt_index_results* results) {
+  /*
+   * Finds the subtitles showing at any time from from up to (but not
+   * including) to, i.e. those starting before to and ending after
+   * from; for the subtitles showing at time t, query from t to t+1.
+   * They are put in results, replacing anything already there, and
+   * results->subs must be freed by the caller (it may start out
+   * NULL, with max_subs 0).  Returns 0 on success or SRT_ERROR_ALLOC.
+   */
+  results->nr_subs = 0;
+  size_t n = idx->nr_subs;
+  if (n == 0) {
+    return 0;
+  }
+
+  // Nodes still to visit, and whether their left subtree has been
+  // dealt with yet
+  struct {
+    size_t x;
+    int k;
+    int left_done;
+  } stack[64];
+  int t = 0;
+  stack[t].x = ((size_t) 1 << idx->root_level) - 1;
+  stack[t].k = idx->root_level;
+  stack[t++].left_done = 0;
+
+  while (t > 0) {
+    size_t x = stack[--t].x;
+    int k = stack[t].k;
+    int left_done = stack[t].left_done;
+
+    if (k <= SRT_INDEX_SCAN_LEVEL) {
+      // Scan the whole subtree, in order
+      size_t i = x >> k << k;
+      size_t end = i + ((size_t) 1 << (k+1)) - 1;
+      if (end > n) end = n;
+      for (; i < end && idx->starts[i] < to; ++i) {
+        if (idx->ends[i] > from && srt_index_add(results, idx->subs[i])) {
+          return SRT_ERROR_ALLOC;
+        }
+      }
+    } else if (!left_done) {
+      // Come back to this node after its left subtree, which is only
+      // worth visiting if something in it ends late enough (a child
+      // off the end of the array may still have real descendants)
+      size_t y = x - ((size_t) 1 << (k-1));
+      stack[t].x = x;
+      stack[t].k = k;
+      stack[t++].left_done = 1;
+      if (y >= n || idx->max_ends[y] > from) {
+        stack[t].x = y;
+        stack[t].k = k-1;
+        stack[t++].left_done = 0;
+      }
+    } else if (x < n && idx->starts[x] < to) {
+      // Then the node itself, and its right subtree if the node
+      // starts early enough that anything there might
+      if (idx->ends[x] > from && srt_index_add(results, idx->subs[x])) {
+        return SRT_ERROR_ALLOC;
+      }
+      stack[t].x = x + ((size_t) 1 << (k-1));
+      stack[t].k = k-1;
+      stack[t++].left_done = 0;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "srt_document.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An index of the subtitles in a document by time, answering "which
+// subtitles are showing between these times" in O(log n + k) however
+// much they overlap.  The subtitles are sorted by start time and laid
+// out as an implicit balanced binary tree over the sorted array, each
+// node holding the latest end time in its subtree, so whole subtrees
+// which end too early can be skipped.
+typedef struct {
+  size_t nr_subs;
+
+  // For the subtitles in order of start time: their start and end
+  // times, and their index in the document
+  long* starts;
+  long* ends;
+  size_t* subs;
+
+  // The latest end time in the subtree under each node
+  long* max_ends;
+
+  // The level of the root of the tree
+  int root_level;
+} srt_index;
+
+// Results of a query: the document indices of the subtitles found, in
+// order of start time
+typedef struct {
+  size_t* subs;
+  size_t nr_subs;
+  size_t max_subs;
+} srt_index_results;
+
+
+srt_index* srt_index_build(srt_document* doc);
+void srt_index_free(srt_index* idx);
+int srt_index_query(srt_index* idx, long from, long to, srt_index_results* results);
+
+#ifdef __cplusplus
+}
+#endif
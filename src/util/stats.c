@@ -0,0 +1,136 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int stats_enabled = 0;
+
+static uint64_t stats_counters[STATS_NR_COUNTERS];
+
+// The I/O time of this thread, so that it can be left out of the
+// parsing and formatting which it interrupts
+static __thread uint64_t stats_thread_io = 0;
+
+// For the report: the tool's name and when it started
+static char* stats_tool = NULL;
+static uint64_t stats_start_ns = 0;
+
+static const char* stats_names[STATS_NR_COUNTERS] = {
+  "bytes_read",
+  "bytes_written",
+  "lines_parsed",
+  "cues_parsed",
+  "segments_parsed",
+  "reallocs",
+  "parse_seconds",
+  "format_seconds",
+  "io_seconds"
+};
+
+
+static uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void stats_add(stats_counter counter, uint64_t n) {
+  __atomic_add_fetch(&stats_counters[counter], n, __ATOMIC_RELAXED);
+}
+
+
+void stats_begin(stats_timer* timer) {
+  timer->start = stats_now();
+  timer->io = stats_thread_io;
+}
+
+
+void stats_end(stats_counter counter, stats_timer* timer) {
+  /*
+   * Adds the time since stats_begin to a time counter, less any I/O
+   * this thread did in the meantime.
+   */
+  uint64_t elapsed = stats_now() - timer->start;
+  if (counter == STATS_IO_NS) {
+    stats_thread_io += elapsed;
+  } else {
+    uint64_t io = stats_thread_io - timer->io;
+    elapsed = (elapsed > io) ? elapsed - io : 0;
+  }
+  stats_add(counter, elapsed);
+}
+
+
+uint64_t stats_get(stats_counter counter) {
+  return __atomic_load_n(&stats_counters[counter], __ATOMIC_RELAXED);
+}
+
+
+void stats_option(int* argc, char** argv) {
+  /*
+   * Looks for --stats anywhere on a tool's command line, removing it
+   * from argv.  If it is there, counting is switched on and the
+   * counters are reported on stderr when the tool exits.
+   */
+  int i, j;
+  for (i=1, j=1; i < *argc; ++i) {
+    if (!strcmp(argv[i], "--stats")) {
+      stats_enabled = 1;
+    } else {
+      argv[j++] = argv[i];
+    }
+  }
+  argv[j] = NULL;
+  *argc = j;
+
+  if (stats_enabled) {
+    char* slash = strrchr(argv[0], '/');
+    stats_tool = slash ? slash+1 : argv[0];
+    stats_start_ns = stats_now();
+    atexit(stats_report);
+  }
+}
+
+
+void stats_usage(void) {
+  printf("\nWith --stats, performance counters are printed as JSON on stderr on exit.\n");
+}
+
+
+void stats_report(void) {
+  /*
+   * Prints the counters as a JSON object on one line of stderr.
+   */
+  fprintf(stderr, "{\"tool\":\"%s\"", stats_tool ? stats_tool : "");
+  int i;
+  for (i=0; i < STATS_NR_COUNTERS; ++i) {
+    if (i >= STATS_PARSE_NS) {
+      fprintf(stderr, ",\"%s\":%.6f", stats_names[i], stats_get(i) / 1e9);
+    } else {
+      fprintf(stderr, ",\"%s\":%llu", stats_names[i], (unsigned long long) stats_get(i));
+    }
+  }
+  fprintf(stderr, ",\"wall_seconds\":%.6f}\n", (stats_now() - stats_start_ns) / 1e9);
+}
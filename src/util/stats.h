@@ -0,0 +1,77 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Performance counters, kept by the library for every thread and
+// reported by the tools' --stats option.  They are always compiled in;
+// while stats_enabled is clear, counting costs a load and a branch
+// which is predicted not taken.
+
+typedef enum {
+  STATS_BYTES_READ,
+  STATS_BYTES_WRITTEN,
+  STATS_LINES,
+  STATS_CUES,
+  STATS_SEGMENTS,
+  STATS_REALLOCS,
+
+  // Time spent parsing, formatting and in I/O, in nanoseconds.  I/O
+  // done part-way through parsing or formatting is counted only as
+  // I/O; page faults on mapped input count as parsing.
+  STATS_PARSE_NS,
+  STATS_FORMAT_NS,
+  STATS_IO_NS,
+
+  STATS_NR_COUNTERS
+} stats_counter;
+
+typedef struct {
+  uint64_t start;
+
+  // The thread's I/O time when the timer started
+  uint64_t io;
+} stats_timer;
+
+extern int stats_enabled;
+
+#define STATS_ADD(counter, n) \
+  do { if (__builtin_expect(stats_enabled, 0)) stats_add((counter), (n)); } while (0)
+#define STATS_BEGIN(timer) \
+  do { if (__builtin_expect(stats_enabled, 0)) stats_begin(&(timer)); } while (0)
+#define STATS_END(counter, timer) \
+  do { if (__builtin_expect(stats_enabled, 0)) stats_end((counter), &(timer)); } while (0)
+
+void stats_add(stats_counter counter, uint64_t n);
+void stats_begin(stats_timer* timer);
+void stats_end(stats_counter counter, stats_timer* timer);
+uint64_t stats_get(stats_counter counter);
+void stats_option(int* argc, char** argv);
+void stats_usage(void);
+void stats_report(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -19,6 +19,10 @@
 
 #pragma once
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct {
 
   // The ID number of the subtitle.  If the file format itself does not have an ID, a unique ID is generated internally.
@@ -40,3 +44,7 @@ typedef struct {
   unsigned int len;
 
 } sub_text;
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,199 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "utf.h"
+
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// What an unpaired surrogate or a dangling byte becomes
+#define UTF_REPLACEMENT 0xFFFD
+
+
+utf_encoding utf_detect(const char* data, size_t len, size_t* bom_len) {
+  /*
+   * Works out the encoding of a file from its first bytes: by its byte
+   * order mark if it has one, or else by where the zero bytes are, as
+   * an SRT file starts with ASCII.  bom_len is set to the length of
+   * the byte order mark, or 0.
+   */
+  const unsigned char* d = (const unsigned char*) data;
+  *bom_len = 0;
+  if (len >= 3 && d[0] == 0xEF && d[1] == 0xBB && d[2] == 0xBF) {
+    *bom_len = 3;
+    return UTF_8_BOM;
+  }
+  if (len >= 2 && d[0] == 0xFF && d[1] == 0xFE) {
+    *bom_len = 2;
+    return UTF_16LE;
+  }
+  if (len >= 2 && d[0] == 0xFE && d[1] == 0xFF) {
+    *bom_len = 2;
+    return UTF_16BE;
+  }
+  if (len >= 2 && d[0] != 0 && d[1] == 0) {
+    return UTF_16LE;
+  }
+  if (len >= 2 && d[0] == 0 && d[1] != 0) {
+    return UTF_16BE;
+  }
+  return UTF_8;
+}
+
+
+static char* utf8_put(char* out, uint32_t c) {
+  if (c < 0x80) {
+    *out++ = c;
+  } else if (c < 0x800) {
+    *out++ = 0xC0 | (c >> 6);
+    *out++ = 0x80 | (c & 0x3F);
+  } else if (c < 0x10000) {
+    *out++ = 0xE0 | (c >> 12);
+    *out++ = 0x80 | ((c >> 6) & 0x3F);
+    *out++ = 0x80 | (c & 0x3F);
+  } else {
+    *out++ = 0xF0 | (c >> 18);
+    *out++ = 0x80 | ((c >> 12) & 0x3F);
+    *out++ = 0x80 | ((c >> 6) & 0x3F);
+    *out++ = 0x80 | (c & 0x3F);
+  }
+  return out;
+}
+
+
+size_t utf16_to_utf8(const char* in, size_t len, int big_endian, char* out) {
+  /*
+   * Transcodes len bytes of UTF-16 (without a byte order mark) to
+   * UTF-8, writing at most UTF16_MAX_UTF8_LEN(len) bytes to out.
+   * Unpaired surrogates, and an odd byte at the end, become U+FFFD.
+   * Returns the number of bytes written.
+   */
+  const unsigned char* p = (const unsigned char*) in;
+  const unsigned char* end = p + (len & ~(size_t)1);
+  char* o = out;
+  int hi = big_endian ? 0 : 1;
+
+  while (p < end) {
+#ifdef __SSE2__
+    // Runs of ASCII, which is most of an SRT file, go 16 code units
+    // at a time: check the top 9 bits of each are clear, then pack
+    // the low bytes together
+    while (end - p >= 32) {
+      __m128i a = _mm_loadu_si128((const __m128i*) p);
+      __m128i b = _mm_loadu_si128((const __m128i*) (p + 16));
+      if (big_endian) {
+        a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+      }
+      __m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16((short) 0xFF80));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xFFFF) {
+        break;
+      }
+      _mm_storeu_si128((__m128i*) o, _mm_packus_epi16(a, b));
+      o += 16;
+      p += 32;
+    }
+    if (p >= end) {
+      break;
+    }
+#endif
+
+    uint32_t c = (p[hi] << 8) | p[1-hi];
+    p += 2;
+    if (c >= 0xD800 && c < 0xDC00) {
+      uint32_t c2 = (p < end) ? (uint32_t)((p[hi] << 8) | p[1-hi]) : 0;
+      if (c2 >= 0xDC00 && c2 < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+        p += 2;
+      } else {
+        c = UTF_REPLACEMENT;
+      }
+    } else if (c >= 0xDC00 && c < 0xE000) {
+      c = UTF_REPLACEMENT;
+    }
+    o = utf8_put(o, c);
+  }
+
+  if (len & 1) {
+    o = utf8_put(o, UTF_REPLACEMENT);
+  }
+  return o - out;
+}
+
+
+size_t utf8_validate(const char* data, size_t len) {
+  /*
+   * Checks that data is well-formed UTF-8: no overlong forms,
+   * surrogates, or code points beyond U+10FFFF.  Returns the offset
+   * of the first byte of the first invalid sequence, or len if there
+   * is none.
+   */
+  const unsigned char* d = (const unsigned char*) data;
+  size_t i = 0;
+  while (i < len) {
+#ifdef __SSE2__
+    // Skip ASCII 16 bytes at a time
+    while (len - i >= 16 &&
+           !_mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (d + i)))) {
+      i += 16;
+    }
+    if (i >= len) {
+      break;
+    }
+#endif
+
+    unsigned char c = d[i];
+    if (c < 0x80) {
+      ++i;
+      continue;
+    }
+
+    // The length of the sequence, and the range its second byte must
+    // be in to rule out overlong forms, surrogates and values too big
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+      n = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      n = 3;
+      if (c == 0xE0) lo = 0xA0;
+      if (c == 0xED) hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      n = 4;
+      if (c == 0xF0) lo = 0x90;
+      if (c == 0xF4) hi = 0x8F;
+    } else {
+      return i;
+    }
+    if (len - i < n || d[i+1] < lo || d[i+1] > hi) {
+      return i;
+    }
+    size_t j;
+    for (j=2; j < n; ++j) {
+      if ((d[i+j] & 0xC0) != 0x80) {
+        return i;
+      }
+    }
+    i += n;
+  }
+  return len;
+}
@@ -0,0 +1,44 @@
+/*
+ *  Copyright Andrew Ryrie 2014
+ *
+ *  This file is part of subutil.
+ *
+ *  subutil is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Foobar is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  UTF_8,
+  UTF_8_BOM,
+  UTF_16LE,
+  UTF_16BE
+} utf_encoding;
+
+utf_encoding utf_detect(const char* data, size_t len, size_t* bom_len);
+size_t utf16_to_utf8(const char* in, size_t len, int big_endian, char* out);
+size_t utf8_validate(const char* data, size_t len);
+
+// The most bytes of UTF-8 that len bytes of UTF-16 can become
+#define UTF16_MAX_UTF8_LEN(len) ((len) / 2 * 3 + 3)
+
+#ifdef __cplusplus
+}
+#endif